@@ -0,0 +1,206 @@
+//
+// benchmark.cpp
+//
+// Launch throughput benchmark for the demo program.  See
+// benchmark.h for a description.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "benchmark.h"
+
+// Most children one benchmark thread has running at once.  When
+// a thread has this many, it waits for them all to exit with a
+// single WaitForMultipleObjects before launching more.
+#define BENCHMARK_BATCH_SIZE    MAXIMUM_WAIT_OBJECTS
+
+// State of one benchmark thread.
+struct BenchmarkThread
+{
+    HANDLE    thread;
+    int       numLaunches;       // Launches this thread is to make.
+    int       numFailed;         // Launches where CreateProcess failed.
+    long long launchTicks;       // Total QueryPerformanceCounter ticks
+                                 // spent in CreateProcess.
+};
+
+// Command line of the child process, built once per run.
+static wchar_t childCommandLine[MAX_PATH + 32] = {0};
+
+// Set to release all of the threads at once.
+static HANDLE startEvent = nullptr;
+
+//
+// Returns the current QueryPerformanceCounter value.
+//
+static long long ReadTimestamp()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+//
+// Launches one child.  Returns its process handle, or null if
+// CreateProcess failed.
+//
+static HANDLE LaunchChild()
+{
+    STARTUPINFOW si = {0};
+    PROCESS_INFORMATION pi = {0};
+    si.cb = sizeof(si);
+
+    // CreateProcessW may write to the command line, so each
+    // launch gets its own copy.
+    wchar_t cmdline[ARRAYSIZE(childCommandLine)];
+    wcscpy_s(cmdline, childCommandLine);
+    if (!CreateProcessW(nullptr, cmdline, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi))
+        return nullptr;
+
+    CloseHandle(pi.hThread);
+    return pi.hProcess;
+}
+
+//
+// Waits for a batch of children to exit, and closes their
+// handles.
+//
+static void WaitForChildren(HANDLE *children, int &numChildren)
+{
+    if (numChildren > 0)
+        WaitForMultipleObjects(numChildren, children, TRUE, INFINITE);
+
+    for (int i = 0; i < numChildren; i++)
+        CloseHandle(children[i]);
+    numChildren = 0;
+}
+
+//
+// Entry point of each benchmark thread.
+//
+static DWORD WINAPI BenchmarkThreadProc(LPVOID param)
+{
+    BenchmarkThread &state = *(BenchmarkThread *)param;
+    WaitForSingleObject(startEvent, INFINITE);
+
+    HANDLE children[BENCHMARK_BATCH_SIZE];
+    int numChildren = 0;
+    for (int i = 0; i < state.numLaunches; i++)
+    {
+        const long long startTime = ReadTimestamp();
+        const HANDLE child = LaunchChild();
+        state.launchTicks += ReadTimestamp() - startTime;
+
+        if (!child)
+        {
+            state.numFailed++;
+            continue;
+        }
+
+        children[numChildren++] = child;
+        if (numChildren == BENCHMARK_BATCH_SIZE)
+            WaitForChildren(children, numChildren);
+    }
+
+    WaitForChildren(children, numChildren);
+    return 0;
+}
+
+bool RunLaunchBenchmark(int numLaunches, int numThreads, LaunchBenchmarkResult &result)
+{
+    memset(&result, 0, sizeof(result));
+    if (numLaunches <= 0 || numThreads <= 0 || numThreads > MAX_BENCHMARK_THREADS)
+    {
+        printf("ERROR: Benchmark needs at least one launch, and 1 to %d threads!\n", MAX_BENCHMARK_THREADS);
+        return false;
+    }
+
+    wchar_t exePath[MAX_PATH];
+    if (!GetModuleFileNameW(nullptr, exePath, ARRAYSIZE(exePath)))
+    {
+        printf("ERROR: Failed getting program path (error %lu)!\n", GetLastError());
+        return false;
+    }
+    swprintf_s(childCommandLine, L"\"%s\" %S", exePath, BENCHMARK_CHILD_OPTION);
+
+    // Launch one child first, so the first timed launch doesn't
+    // pay for loading our executable image from disk.
+    HANDLE child = LaunchChild();
+    if (!child)
+    {
+        printf("ERROR: Failed launching benchmark child (error %lu)!\n", GetLastError());
+        return false;
+    }
+    int numChildren = 1;
+    WaitForChildren(&child, numChildren);
+
+    startEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (!startEvent)
+    {
+        printf("ERROR: Failed creating benchmark event (error %lu)!\n", GetLastError());
+        return false;
+    }
+
+    BenchmarkThread threads[MAX_BENCHMARK_THREADS] = {0};
+    HANDLE threadHandles[MAX_BENCHMARK_THREADS];
+    int numStarted = 0;
+    for (; numStarted < numThreads; numStarted++)
+    {
+        BenchmarkThread &state = threads[numStarted];
+        state.numLaunches = numLaunches / numThreads + (numStarted < numLaunches % numThreads ? 1 : 0);
+        state.thread = CreateThread(nullptr, 0, BenchmarkThreadProc, &state, 0, nullptr);
+        if (!state.thread)
+        {
+            printf("ERROR: Failed creating benchmark thread (error %lu)!\n", GetLastError());
+            break;
+        }
+        threadHandles[numStarted] = state.thread;
+    }
+
+    // Release the threads together, and time until the last of
+    // their children has exited.
+    const long long startTime = ReadTimestamp();
+    SetEvent(startEvent);
+    if (numStarted > 0)
+        WaitForMultipleObjects(numStarted, threadHandles, TRUE, INFINITE);
+    const long long endTime = ReadTimestamp();
+
+    long long launchTicks = 0;
+    for (int i = 0; i < numStarted; i++)
+    {
+        result.numLaunches += threads[i].numLaunches;
+        result.numFailed += threads[i].numFailed;
+        launchTicks += threads[i].launchTicks;
+        CloseHandle(threads[i].thread);
+    }
+    CloseHandle(startEvent);
+    startEvent = nullptr;
+
+    if (numStarted < numThreads)
+        return false;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    result.seconds = (double)(endTime - startTime) / frequency.QuadPart;
+    if (result.seconds > 0)
+        result.launchesPerSecond = (result.numLaunches - result.numFailed) / result.seconds;
+    result.meanLaunchMicroseconds = launchTicks * 1000000.0 / frequency.QuadPart / result.numLaunches;
+    return true;
+}
+
+void PrintLaunchBenchmark(const char *label, const LaunchBenchmarkResult &result)
+{
+    printf("* %s: %d launches (%d failed) in %.3f seconds\n",
+        label, result.numLaunches, result.numFailed, result.seconds);
+    printf("    %.1f launches/sec, %.1f microseconds per CreateProcess call\n",
+        result.launchesPerSecond, result.meanLaunchMicroseconds);
+}
+
+void PrintLaunchOverhead(const LaunchBenchmarkResult &baseline, const LaunchBenchmarkResult &hooked)
+{
+    const double overhead = hooked.meanLaunchMicroseconds - baseline.meanLaunchMicroseconds;
+    printf("* Hook overhead: %.0f nanoseconds per launch", overhead * 1000.0);
+    if (baseline.meanLaunchMicroseconds > 0)
+        printf(" (%+.1f%%)", overhead * 100.0 / baseline.meanLaunchMicroseconds);
+    printf("\n");
+}
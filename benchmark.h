@@ -0,0 +1,52 @@
+//
+// benchmark.h
+//
+// Launch throughput benchmark for the demo program.
+//
+// Launches a number of short-lived child processes from a
+// number of threads at once, with no fixed delays anywhere, and
+// times each CreateProcess call.  Running it once before the
+// hooks are installed and once after gives the cost the hooks
+// add to each launch.
+//
+// The child is the demo program itself, run with
+// BENCHMARK_CHILD_OPTION, which exits as soon as it starts, so
+// the numbers don't depend on what other programs are
+// installed.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Command line option that makes the demo program exit right
+// away, for use as the benchmark's child process.
+#define BENCHMARK_CHILD_OPTION  "-exit"
+
+// Most threads a benchmark run can use, since the threads are
+// waited for with a single WaitForMultipleObjects.
+#define MAX_BENCHMARK_THREADS   MAXIMUM_WAIT_OBJECTS
+
+// Results of one benchmark run.
+struct LaunchBenchmarkResult
+{
+    int    numLaunches;          // Launches attempted.
+    int    numFailed;            // Launches where CreateProcess failed.
+    double seconds;              // Wall time from the first launch until
+                                 // every child had exited.
+    double launchesPerSecond;    // Successful launches over that time.
+    double meanLaunchMicroseconds;   // Mean time in CreateProcess.
+};
+
+// Launches numLaunches children spread across numThreads
+// threads, and waits for them all to exit.  Returns true if
+// the benchmark ran, even if some launches failed.
+bool RunLaunchBenchmark(int numLaunches, int numThreads, LaunchBenchmarkResult &result);
+
+// Prints the results of one benchmark run.
+void PrintLaunchBenchmark(const char *label, const LaunchBenchmarkResult &result);
+
+// Prints how much slower each launch was with the hooks
+// installed than without.
+void PrintLaunchOverhead(const LaunchBenchmarkResult &baseline, const LaunchBenchmarkResult &hooked);
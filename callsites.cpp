@@ -0,0 +1,174 @@
+//
+// callsites.cpp
+//
+// Per-callsite counts and latency for the API hooks.  See
+// callsites.h for a description.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "callsites.h"
+#include "detours.h"
+
+// One slot in the callsite table.  The address is zero until a
+// callsite claims the slot, and never changes after that.
+struct alignas(64) CallsiteSlot
+{
+    volatile LONG64 address;
+    volatile LONG   hookId;
+    volatile LONG64 calls;
+    volatile LONG64 totalTicks;
+    volatile LONG64 maxTicks;
+};
+
+static CallsiteSlot callsiteTable[CALLSITE_TABLE_SIZE];
+
+// Calls not recorded because the table was full.
+static volatile LONG64 callsiteOverflow = 0;
+
+//
+// Returns the slot to start probing at for an address.
+//
+static unsigned int HashCallsite(ULONG_PTR address)
+{
+    // Fibonacci hashing; the low bits of code addresses vary
+    // the least, so take the top bits of the product.
+    const unsigned long long product = (unsigned long long)address * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(product >> 32) & (CALLSITE_TABLE_SIZE - 1);
+}
+
+//
+// Returns the slot for an address, claiming a free one if the
+// address isn't in the table yet, or null if the table is full.
+//
+static CallsiteSlot *FindCallsiteSlot(LONG64 address, int hookId)
+{
+    unsigned int index = HashCallsite((ULONG_PTR)address);
+    for (int probes = 0; probes < CALLSITE_TABLE_SIZE; probes++)
+    {
+        CallsiteSlot &slot = callsiteTable[index];
+        LONG64 current = ReadAcquire64(&slot.address);
+        if (!current)
+        {
+            // A report taken between the claim and setting the
+            // hook ID shows the slot with no calls yet, so it is
+            // skipped.
+            current = InterlockedCompareExchange64(&slot.address, address, 0);
+            if (!current)
+            {
+                InterlockedExchange(&slot.hookId, hookId);
+                return &slot;
+            }
+        }
+
+        if (current == address)
+            return &slot;
+
+        index = (index + 1) & (CALLSITE_TABLE_SIZE - 1);
+    }
+
+    return nullptr;
+}
+
+void RecordCallsite(PVOID returnAddress, int hookId, long long ticks)
+{
+    CallsiteSlot *slot = FindCallsiteSlot((LONG64)(ULONG_PTR)returnAddress, hookId);
+    if (!slot)
+    {
+        InterlockedIncrement64(&callsiteOverflow);
+        return;
+    }
+
+    InterlockedIncrement64(&slot->calls);
+    InterlockedAdd64(&slot->totalTicks, ticks);
+
+    LONG64 maxTicks = ReadNoFence64(&slot->maxTicks);
+    while (ticks > maxTicks)
+    {
+        const LONG64 previous = InterlockedCompareExchange64(&slot->maxTicks, ticks, maxTicks);
+        if (previous == maxTicks)
+            break;
+        maxTicks = previous;
+    }
+}
+
+//
+// Sorts callsite reports busiest first.
+//
+static int CompareCallsites(const void *a, const void *b)
+{
+    const long long callsA = ((const CallsiteReport *)a)->calls;
+    const long long callsB = ((const CallsiteReport *)b)->calls;
+    return (callsA < callsB) ? 1 : (callsA > callsB) ? -1 : 0;
+}
+
+//
+// Fills in the module name and offset of a callsite.  This is
+// the slow part, which is why it's only done here.
+//
+static void SymbolizeCallsite(CallsiteReport &report)
+{
+    const HMODULE module = DetourGetContainingModule(report.address);
+    char modulePath[MAX_PATH];
+    if (!module || !GetModuleFileNameA(module, modulePath, sizeof(modulePath)))
+    {
+        strcpy_s(report.module, "?");
+        report.offset = (ULONG_PTR)report.address;
+        return;
+    }
+
+    const char *moduleName = strrchr(modulePath, '\\');
+    moduleName = moduleName ? moduleName + 1 : modulePath;
+    strncpy_s(report.module, moduleName, _TRUNCATE);
+    report.offset = (ULONG_PTR)report.address - (ULONG_PTR)module;
+}
+
+int GetCallsites(CallsiteReport *reports, int maxReports)
+{
+    if (!reports || maxReports <= 0)
+        return 0;
+
+    // Take every callsite first, so the busiest are kept even if
+    // there's only room to report a few.
+    CallsiteReport all[CALLSITE_TABLE_SIZE];
+    int numFound = 0;
+    for (int i = 0; i < CALLSITE_TABLE_SIZE; i++)
+    {
+        const CallsiteSlot &slot = callsiteTable[i];
+        const LONG64 address = ReadAcquire64(&slot.address);
+        const LONG64 calls = ReadNoFence64(&slot.calls);
+        if (!address || !calls)
+            continue;
+
+        CallsiteReport &report = all[numFound++];
+        memset(&report, 0, sizeof(report));
+        report.address = (PVOID)(ULONG_PTR)address;
+        report.hookId = ReadNoFence(&slot.hookId);
+        report.calls = calls;
+        report.meanMicroseconds = (double)ReadNoFence64(&slot.totalTicks) / calls;
+        report.maxMicroseconds = (double)ReadNoFence64(&slot.maxTicks);
+    }
+
+    qsort(all, numFound, sizeof(all[0]), CompareCallsites);
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    const double ticksToMicroseconds = 1000000.0 / frequency.QuadPart;
+
+    const int numReports = numFound < maxReports ? numFound : maxReports;
+    for (int i = 0; i < numReports; i++)
+    {
+        reports[i] = all[i];
+        reports[i].meanMicroseconds *= ticksToMicroseconds;
+        reports[i].maxMicroseconds *= ticksToMicroseconds;
+        SymbolizeCallsite(reports[i]);
+    }
+
+    return numReports;
+}
+
+long long GetCallsiteOverflowCount()
+{
+    return ReadNoFence64(&callsiteOverflow);
+}
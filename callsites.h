@@ -0,0 +1,55 @@
+//
+// callsites.h
+//
+// Per-callsite counts and latency for the API hooks, so we can
+// tell which code is launching processes and not just how many
+// launches there were.
+//
+// Each hook passes in its return address, which is the address
+// in the caller just past its call to the hooked API.  The
+// counts are kept in a fixed-size open-addressed hash table
+// keyed by that address.  A new callsite claims its slot with a
+// single compare-exchange, and after that every update is an
+// interlocked add, so the table never takes a lock.  Addresses
+// are only turned into module names and offsets when the
+// report is read.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Number of slots in the callsite table.  A power of two.  Once
+// every slot is taken, calls from further callsites are only
+// counted as overflow.
+#define CALLSITE_TABLE_SIZE     256
+
+// Room for a module's file name in a CallsiteReport.
+#define CALLSITE_MODULE_NAME_SIZE 64
+
+// One callsite, as reported by GetCallsites.
+struct CallsiteReport
+{
+    PVOID     address;           // Return address of the call.
+    int       hookId;            // HookId of the API it called.
+    char      module[CALLSITE_MODULE_NAME_SIZE];  // Module containing the
+                                 // address, or "?" if none.
+    ULONG_PTR offset;            // Offset of the address in that module.
+    long long calls;             // Number of calls.
+    double    meanMicroseconds;  // Mean time in the hook per call.
+    double    maxMicroseconds;   // Longest time in the hook.
+};
+
+// Records one call to a hook from the given return address,
+// which took the given number of QueryPerformanceCounter ticks.
+void RecordCallsite(PVOID returnAddress, int hookId, long long ticks);
+
+// Fills in up to maxReports callsites, busiest first, and
+// returns how many were filled in.
+HOOKDLL_API int GetCallsites(CallsiteReport *reports, int maxReports);
+
+// Returns the number of calls that weren't recorded because the
+// table was full.
+HOOKDLL_API long long GetCallsiteOverflowCount();
@@ -0,0 +1,112 @@
+//
+// childjob.cpp
+//
+// Job object containment of the process trees our hooks launch.
+// See childjob.h for a description.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "childjob.h"
+
+// The child job, or null if it isn't started.
+static HANDLE childJob = nullptr;
+
+// Children the hooks couldn't add to the job.
+static volatile LONG numAssignFailures = 0;
+
+bool StartChildJob()
+{
+    if (childJob)
+        return true;
+
+    const HANDLE job = CreateJobObject(nullptr, nullptr);
+    if (!job)
+    {
+        printf("ERROR: Failed creating child job (error %lu)!\n", GetLastError());
+        return false;
+    }
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {0};
+    limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    if (!SetInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits)))
+    {
+        printf("ERROR: Failed setting child job limits (error %lu)!\n", GetLastError());
+        CloseHandle(job);
+        return false;
+    }
+
+    numAssignFailures = 0;
+    childJob = job;
+    return true;
+}
+
+bool TerminateChildJob(UINT exitCode)
+{
+    if (!childJob)
+        return false;
+
+    if (!TerminateJobObject(childJob, exitCode))
+    {
+        printf("ERROR: Failed terminating child job (error %lu)!\n", GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+bool GetChildJobAccounting(ChildJobAccounting &accounting)
+{
+    memset(&accounting, 0, sizeof(accounting));
+    if (!childJob)
+        return false;
+
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION info = {0};
+    if (!QueryInformationJobObject(childJob, JobObjectBasicAndIoAccountingInformation,
+                                   &info, sizeof(info), nullptr))
+    {
+        printf("ERROR: Failed reading child job accounting (error %lu)!\n", GetLastError());
+        return false;
+    }
+
+    // Job times are in 100 nanosecond units.
+    accounting.totalProcesses = info.BasicInfo.TotalProcesses;
+    accounting.activeProcesses = info.BasicInfo.ActiveProcesses;
+    accounting.totalTerminated = info.BasicInfo.TotalTerminatedProcesses;
+    accounting.numAssignFailures = (DWORD)numAssignFailures;
+    accounting.userSeconds = info.BasicInfo.TotalUserTime.QuadPart / 10000000.0;
+    accounting.kernelSeconds = info.BasicInfo.TotalKernelTime.QuadPart / 10000000.0;
+    accounting.readOperations = info.IoInfo.ReadOperationCount;
+    accounting.writeOperations = info.IoInfo.WriteOperationCount;
+    accounting.readBytes = info.IoInfo.ReadTransferCount;
+    accounting.writeBytes = info.IoInfo.WriteTransferCount;
+    return true;
+}
+
+void CloseChildJob()
+{
+    if (!childJob)
+        return;
+
+    CloseHandle(childJob);
+    childJob = nullptr;
+}
+
+bool IsChildJobStarted()
+{
+    return childJob != nullptr;
+}
+
+bool AddToChildJob(HANDLE process)
+{
+    if (!childJob)
+        return false;
+
+    if (!AssignProcessToJobObject(childJob, process))
+    {
+        InterlockedIncrement(&numAssignFailures);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,60 @@
+//
+// childjob.h
+//
+// Job object containment of the process trees our hooks launch.
+//
+// When the child job is on, the hooks start every child
+// suspended, assign it to one job object, and only then let it
+// run, so the child can't start a process of its own before
+// it's in the job.  Everything the child goes on to launch
+// lands in the same job, so the whole tree can be torn down
+// with one TerminateJobObject call, and the job's accounting
+// gives CPU and I/O totals for the tree without any
+// per-process bookkeeping.
+//
+// The job is created with JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE, so
+// if this process goes away, its process trees go with it.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Accounting for everything that has run in the child job.
+struct ChildJobAccounting
+{
+    DWORD     totalProcesses;        // Processes ever in the job.
+    DWORD     activeProcesses;       // Processes still running.
+    DWORD     totalTerminated;       // Processes ended by a job limit.
+    DWORD     numAssignFailures;     // Children the hooks couldn't add.
+    double    userSeconds;           // Total user mode CPU time.
+    double    kernelSeconds;         // Total kernel mode CPU time.
+    ULONGLONG readOperations;        // I/O operations and bytes
+    ULONGLONG writeOperations;       // transferred by all of them.
+    ULONGLONG readBytes;
+    ULONGLONG writeBytes;
+};
+
+// Creates the child job.  Must be called before the hooks are
+// installed.  Returns true if successful.
+HOOKDLL_API bool StartChildJob();
+
+// Terminates every process in the child job at once.  Returns
+// true if successful.
+HOOKDLL_API bool TerminateChildJob(UINT exitCode);
+
+// Gets the child job's accounting.  Returns true if successful.
+HOOKDLL_API bool GetChildJobAccounting(ChildJobAccounting &accounting);
+
+// Closes the child job, which terminates anything still in it.
+// The hooks must have been removed first.
+HOOKDLL_API void CloseChildJob();
+
+// Returns true if the hooks should add children to the job.
+bool IsChildJobStarted();
+
+// Adds a child that was created suspended to the job.  Returns
+// true if successful.
+bool AddToChildJob(HANDLE process);
@@ -0,0 +1,361 @@
+//
+// childstartup.cpp
+//
+// Startup latency of injected children.  See childstartup.h for
+// a description.
+//
+
+#include <stdio.h>
+#include "childstartup.h"
+#include "detours.h"
+#include "hookstats.h"
+
+// States of a slot.
+enum ChildStartupState
+{
+    STARTUP_SLOT_FREE = 0,
+    STARTUP_SLOT_CLAIMED,    // The parent is filling it in.
+    STARTUP_SLOT_HELD,       // The caller keeps the child suspended.
+    STARTUP_SLOT_RUNNING,    // The child may report.
+    STARTUP_SLOT_REPORTING,  // The child is filling it in.
+    STARTUP_SLOT_DONE,       // The child has reported.
+    STARTUP_SLOT_COLLECTING, // The parent is recording it.
+};
+
+// One child's startup, shared between the parent and the child,
+// which may be of the other bitness, so it holds no pointers.
+struct alignas(64) ChildStartupSlot
+{
+    volatile LONG state;     // ChildStartupState.
+    DWORD     processId;     // The child's.
+    LONG      hookId;        // The hook that launched it.
+    DWORD     reserved;
+
+    // Written by the parent.
+    long long hookTime;          // The hook was called.
+    long long createReturnTime;  // The original CreateProcess returned.
+    long long resumeTime;        // The child was about to be resumed.
+
+    // Written by the child.
+    long long attachTime;        // Our DllMain started.
+    long long initEndTime;       // The child's hooks were installed.
+    long long entryTime;         // The entry point was called, or 0
+                                 // if it couldn't be hooked.
+};
+
+// Our own children's slots, and the mapping they are in,
+// created with the first tracked launch.
+static HANDLE startupMapping = nullptr;
+static ChildStartupSlot *startupSlots = nullptr;
+
+// Guards creating the parent's mapping.
+static INIT_ONCE startupMappingOnce = INIT_ONCE_STATIC_INIT;
+
+// How the startups tracked so far have gone.
+static volatile LONG64 numTracked = 0;
+static volatile LONG64 numCollected = 0;
+static volatile LONG64 numLost = 0;
+static volatile LONG64 numUntracked = 0;
+
+// In a child, our parent's mapping and slots, which are opened
+// from DllMain and closed again once we have reported.  A child
+// can be a parent too, so these are kept apart from our own.
+static HANDLE reportMapping = nullptr;
+static ChildStartupSlot *reportSlots = nullptr;
+
+// The slot to report in, and what to report.
+static ChildStartupSlot *reportSlot = nullptr;
+static long long childAttachTime = 0;
+static long long childInitEndTime = 0;
+
+// Function signature of a program's entry point, as the loader
+// calls it: like a thread start routine, given the PEB.  The
+// CRT's entry points are declared differently on x86, but they
+// never return, so the difference doesn't matter.
+typedef DWORD (WINAPI * ENTRYPOINTFUNC)(PVOID);
+
+// Trampoline to the program's entry point, once it is hooked.
+static ENTRYPOINTFUNC PtrEntryPoint = nullptr;
+
+//
+// Builds the mapping name for a parent process.
+//
+static void GetStartupMappingName(DWORD parentProcessId, char *name, size_t nameSize)
+{
+    sprintf_s(name, nameSize, "%s%lu", CHILD_STARTUP_NAME_PREFIX, parentProcessId);
+}
+
+//
+// Creates the parent's mapping of slots.  Called once, by
+// InitOnceExecuteOnce.
+//
+static BOOL CALLBACK CreateStartupMapping(PINIT_ONCE, PVOID, PVOID *)
+{
+    char name[64];
+    GetStartupMappingName(GetCurrentProcessId(), name, sizeof(name));
+
+    startupMapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                       0, sizeof(ChildStartupSlot) * CHILD_STARTUP_SLOTS, name);
+    if (!startupMapping)
+    {
+        printf("ERROR: Failed creating child startup mapping \"%s\" (error %lu)!\n", name, GetLastError());
+        return TRUE;
+    }
+
+    startupSlots = (ChildStartupSlot *)MapViewOfFile(startupMapping, FILE_MAP_ALL_ACCESS,
+                                                     0, 0, sizeof(ChildStartupSlot) * CHILD_STARTUP_SLOTS);
+    if (!startupSlots)
+    {
+        printf("ERROR: Failed mapping child startup slots (error %lu)!\n", GetLastError());
+        CloseHandle(startupMapping);
+        startupMapping = nullptr;
+    }
+
+    // A failure isn't retried; launches just go untracked.
+    return TRUE;
+}
+
+int BeginChildStartup(DWORD processId, int hookId, long long hookTime, long long createReturnTime)
+{
+    InitOnceExecuteOnce(&startupMappingOnce, CreateStartupMapping, nullptr, nullptr);
+    if (!startupSlots)
+        return -1;
+
+    for (int i = 0; i < CHILD_STARTUP_SLOTS; i++)
+    {
+        ChildStartupSlot &slot = startupSlots[i];
+        if (ReadNoFence(&slot.state) != STARTUP_SLOT_FREE ||
+            InterlockedCompareExchange(&slot.state, STARTUP_SLOT_CLAIMED, STARTUP_SLOT_FREE) != STARTUP_SLOT_FREE)
+            continue;
+
+        slot.processId = processId;
+        slot.hookId = hookId;
+        slot.hookTime = hookTime;
+        slot.createReturnTime = createReturnTime;
+        slot.resumeTime = 0;
+        slot.attachTime = 0;
+        slot.initEndTime = 0;
+        slot.entryTime = 0;
+        InterlockedIncrement64(&numTracked);
+        return i;
+    }
+
+    InterlockedIncrement64(&numUntracked);
+    return -1;
+}
+
+void ResumeChildStartup(int slot)
+{
+    if (slot < 0 || slot >= CHILD_STARTUP_SLOTS || !startupSlots)
+        return;
+
+    startupSlots[slot].resumeTime = HookStatsReadTimestamp();
+    InterlockedExchange(&startupSlots[slot].state, STARTUP_SLOT_RUNNING);
+}
+
+void HoldChildStartup(int slot)
+{
+    if (slot < 0 || slot >= CHILD_STARTUP_SLOTS || !startupSlots)
+        return;
+
+    InterlockedExchange(&startupSlots[slot].state, STARTUP_SLOT_HELD);
+}
+
+void ResumeHeldChildStartup(DWORD processId)
+{
+    if (!startupSlots)
+        return;
+
+    for (int i = 0; i < CHILD_STARTUP_SLOTS; i++)
+    {
+        ChildStartupSlot &slot = startupSlots[i];
+        if (ReadAcquire(&slot.state) == STARTUP_SLOT_HELD && slot.processId == processId)
+        {
+            ResumeChildStartup(i);
+            return;
+        }
+    }
+}
+
+//
+// Records one child's report in the latency histograms of the
+// hook that launched it.  Returns false if the times don't make
+// sense, which only a misbehaving child could cause.
+//
+static bool RecordChildStartup(const ChildStartupSlot &slot)
+{
+    if (slot.hookId < 0 || slot.hookId >= NUM_HOOK_IDS ||
+        slot.hookTime > slot.createReturnTime ||
+        slot.createReturnTime > slot.resumeTime ||
+        slot.resumeTime > slot.attachTime ||
+        slot.attachTime > slot.initEndTime ||
+        (slot.entryTime && slot.initEndTime > slot.entryTime))
+        return false;
+
+    HookStatsRecordLatency(slot.hookId, LATENCY_CHILD_LOAD, slot.attachTime - slot.resumeTime);
+    HookStatsRecordLatency(slot.hookId, LATENCY_CHILD_INIT, slot.initEndTime - slot.attachTime);
+    if (slot.entryTime)
+    {
+        HookStatsRecordLatency(slot.hookId, LATENCY_CHILD_START, slot.entryTime - slot.initEndTime);
+        HookStatsRecordLatency(slot.hookId, LATENCY_CHILD_TOTAL, slot.entryTime - slot.hookTime);
+    }
+    return true;
+}
+
+int CollectChildStartups(bool finalPass)
+{
+    if (!startupSlots)
+        return 0;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    const long long timeoutTicks = frequency.QuadPart * CHILD_STARTUP_TIMEOUT_MS / 1000;
+    const long long now = HookStatsReadTimestamp();
+
+    int numRecorded = 0;
+    for (int i = 0; i < CHILD_STARTUP_SLOTS; i++)
+    {
+        ChildStartupSlot &slot = startupSlots[i];
+        const LONG state = ReadAcquire(&slot.state);
+        if (state == STARTUP_SLOT_DONE)
+        {
+            if (InterlockedCompareExchange(&slot.state, STARTUP_SLOT_COLLECTING, STARTUP_SLOT_DONE) != STARTUP_SLOT_DONE)
+                continue;
+
+            if (RecordChildStartup(slot))
+            {
+                InterlockedIncrement64(&numCollected);
+                numRecorded++;
+            }
+            else
+                InterlockedIncrement64(&numLost);
+            InterlockedExchange(&slot.state, STARTUP_SLOT_FREE);
+        }
+        else if (state == STARTUP_SLOT_RUNNING && (finalPass || now - slot.resumeTime > timeoutTicks))
+        {
+            // A child that is reporting right now keeps its slot.
+            if (InterlockedCompareExchange(&slot.state, STARTUP_SLOT_FREE, STARTUP_SLOT_RUNNING) == STARTUP_SLOT_RUNNING)
+                InterlockedIncrement64(&numLost);
+        }
+        else if (state == STARTUP_SLOT_HELD && (finalPass || now - slot.createReturnTime > timeoutTicks))
+        {
+            // Either the caller is still holding the child, or it
+            // resumed the child without telling us, in which case
+            // the child couldn't report.
+            if (InterlockedCompareExchange(&slot.state, STARTUP_SLOT_FREE, STARTUP_SLOT_HELD) == STARTUP_SLOT_HELD)
+                InterlockedIncrement64(&numLost);
+        }
+    }
+
+    return numRecorded;
+}
+
+void GetChildStartupCounts(ChildStartupCounts &counts)
+{
+    counts.numTracked = ReadNoFence64(&numTracked);
+    counts.numCollected = ReadNoFence64(&numCollected);
+    counts.numLost = ReadNoFence64(&numLost);
+    counts.numUntracked = ReadNoFence64(&numUntracked);
+}
+
+//
+// Unmaps our parent's slots.
+//
+static void CloseReportSlots()
+{
+    if (reportSlots)
+        UnmapViewOfFile(reportSlots);
+    reportSlots = nullptr;
+
+    if (reportMapping)
+        CloseHandle(reportMapping);
+    reportMapping = nullptr;
+}
+
+//
+// Fills in the child's slot and hands it back to the parent,
+// then unmaps the slots, since the child is done with them.
+//
+static void SendChildReport(long long entryTime)
+{
+    ChildStartupSlot &slot = *reportSlot;
+    if (InterlockedCompareExchange(&slot.state, STARTUP_SLOT_REPORTING, STARTUP_SLOT_RUNNING) == STARTUP_SLOT_RUNNING)
+    {
+        // If the parent gave up on us and the slot went to
+        // another child, leave it alone.
+        if (slot.processId == GetCurrentProcessId())
+        {
+            slot.attachTime = childAttachTime;
+            slot.initEndTime = childInitEndTime;
+            slot.entryTime = entryTime;
+            InterlockedExchange(&slot.state, STARTUP_SLOT_DONE);
+        }
+        else
+            InterlockedExchange(&slot.state, STARTUP_SLOT_RUNNING);
+    }
+
+    reportSlot = nullptr;
+    CloseReportSlots();
+}
+
+//
+// Hook on the program's entry point, which the loader calls
+// once every DLL is initialized.
+//
+static DWORD WINAPI ChildEntryPoint(PVOID parameter)
+{
+    if (reportSlot)
+        SendChildReport(HookStatsReadTimestamp());
+
+    return PtrEntryPoint(parameter);
+}
+
+void ReportChildStartup(DWORD parentProcessId, int slot, long long attachTime)
+{
+    childInitEndTime = HookStatsReadTimestamp();
+    childAttachTime = attachTime;
+    if (slot < 0 || slot >= CHILD_STARTUP_SLOTS)
+        return;
+
+    char name[64];
+    GetStartupMappingName(parentProcessId, name, sizeof(name));
+    reportMapping = OpenFileMapping(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name);
+    if (!reportMapping)
+        return;
+
+    reportSlots = (ChildStartupSlot *)MapViewOfFile(reportMapping, FILE_MAP_READ | FILE_MAP_WRITE,
+                                                    0, 0, sizeof(ChildStartupSlot) * CHILD_STARTUP_SLOTS);
+    if (!reportSlots)
+    {
+        CloseReportSlots();
+        return;
+    }
+    reportSlot = &reportSlots[slot];
+
+    // We are in DllMain, so the entry point hasn't run yet.  If
+    // it can't be hooked, report what we have now.
+    PtrEntryPoint = (ENTRYPOINTFUNC)DetourGetEntryPoint(nullptr);
+    if (PtrEntryPoint && DetourTransactionBegin() == NO_ERROR)
+    {
+        DetourUpdateThread(GetCurrentThread());
+        DetourAttach(&(PVOID &)PtrEntryPoint, (PVOID)ChildEntryPoint);
+        if (DetourTransactionCommit() == NO_ERROR)
+            return;
+    }
+
+    SendChildReport(0);
+}
+
+void StopChildStartupTracking()
+{
+    reportSlot = nullptr;
+    CloseReportSlots();
+
+    if (startupSlots)
+        UnmapViewOfFile(startupSlots);
+    startupSlots = nullptr;
+
+    if (startupMapping)
+        CloseHandle(startupMapping);
+    startupMapping = nullptr;
+}
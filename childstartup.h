@@ -0,0 +1,121 @@
+//
+// childstartup.h
+//
+// End-to-end startup latency of the children our hooks inject,
+// from the hooked CreateProcess call until the child's main
+// thread starts running the program's own code.
+//
+// The parent knows when the hook was called, when the original
+// CreateProcess returned and when it resumed the child.  Only
+// the child knows when the loader got as far as running our
+// DllMain, when the child's hooks were in place, and when its
+// entry point was called, so it reports those back through a
+// small table of slots in a mapping the parent shares.  The
+// mapping is named by CHILD_STARTUP_NAME_PREFIX and the
+// parent's process ID, which the child already has from its
+// HookConfigPayload, and the payload carries the index of the
+// child's slot.  QueryPerformanceCounter is the same clock in
+// every process on a machine, so both sides' timestamps can be
+// compared directly.
+//
+// The parent folds each finished slot into the latency
+// histograms of the hook that made the launch, which splits the
+// time between the OS loader and our own injection:
+//
+//     LATENCY_CHILD_LOAD   resume -> our DllMain in the child
+//                          (the loader, up to our DLL)
+//     LATENCY_CHILD_INIT   DllMain -> the child's hooks installed
+//                          (our injection overhead)
+//     LATENCY_CHILD_START  hooks installed -> entry point
+//                          (the rest of the loader's work)
+//     LATENCY_CHILD_TOTAL  hook called -> entry point
+//
+// A child the caller asked to be created suspended is held until
+// the caller says it is resuming it, with ResumeHeldChildStartup,
+// so the caller's own wait isn't counted as startup time.  Until
+// then the child's report is ignored.
+//
+// Slots are claimed, reported and collected with interlocked
+// state changes, so nothing here locks.  A child that never
+// reports, because it died early or couldn't open the mapping,
+// or whose caller never said it resumed it, has its slot given
+// up after CHILD_STARTUP_TIMEOUT_MS.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Name of the mapping for a parent is this prefix followed by
+// the parent's process ID in decimal.
+#define CHILD_STARTUP_NAME_PREFIX   "Local\\DetoursDemoChildStartup_"
+
+// Number of children whose startup can be tracked at once.
+// Launches beyond this aren't tracked.
+#define CHILD_STARTUP_SLOTS         64
+
+// How long a child gets to report its startup before its slot
+// is given up.
+#define CHILD_STARTUP_TIMEOUT_MS    10000
+
+// How the startups tracked so far have gone.
+struct ChildStartupCounts
+{
+    long long numTracked;    // Children given a slot.
+    long long numCollected;  // Startups recorded in the histograms.
+    long long numLost;       // Children that never reported.
+    long long numUntracked;  // Launches with no slot free.
+};
+
+//
+// Parent side.
+//
+
+// Claims a slot for a child that was just created suspended
+// with our DLL injected.  The times are when the hook was
+// called and when the original CreateProcess returned.  Returns
+// the slot's index, to send to the child, or -1 if there is no
+// slot free.
+int BeginChildStartup(DWORD processId, int hookId, long long hookTime, long long createReturnTime);
+
+// Records that the child in the given slot is about to be
+// resumed, after which it may report.  Call just before
+// ResumeThread.  Does nothing for a slot of -1.
+void ResumeChildStartup(int slot);
+
+// Records that the child in the given slot is staying suspended,
+// because the caller asked for that, until the caller calls
+// ResumeHeldChildStartup.  Does nothing for a slot of -1.
+void HoldChildStartup(int slot);
+
+// Records that a caller is about to resume a child it created
+// suspended, after which the child may report.  Call just
+// before ResumeThread.  Does nothing if the child's startup
+// isn't being tracked.
+HOOKDLL_API void ResumeHeldChildStartup(DWORD processId);
+
+// Records the startups children have finished reporting in the
+// latency histograms, and gives up the slots of children that
+// timed out.  If finalPass is true, such as once the children
+// have all exited, every child that still hasn't reported
+// counts as lost, timed out or not.  Returns the number
+// recorded.
+HOOKDLL_API int CollectChildStartups(bool finalPass = false);
+
+// Returns how the startups tracked so far have gone.
+HOOKDLL_API void GetChildStartupCounts(ChildStartupCounts &counts);
+
+//
+// Child side.
+//
+
+// Called from DllMain in a child, once its hooks are installed.
+// attachTime is when DllMain started.  Hooks the program's
+// entry point, which sends the report when it is called.
+void ReportChildStartup(DWORD parentProcessId, int slot, long long attachTime);
+
+// Unmaps the shared slots, on either side.  Called when the DLL
+// unloads.
+void StopChildStartupTracking();
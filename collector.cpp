@@ -0,0 +1,619 @@
+//
+// collector.cpp
+//
+// Tool that gathers the hook telemetry of every process on a
+// machine and ships it to a central aggregator, or that runs
+// the aggregator, so the demo's results can be followed across
+// a whole fleet of machines.
+//
+// Usage:  collector -collect <destination> [-interval <ms>]
+//         collector -aggregate <source> [-interval <ms>]
+//
+// In -collect mode, every interval the tool looks for processes
+// publishing telemetry (see telemetry.h), such as those the
+// demo injected hookdll64.dll or hookdll32.dll into with -inject
+// -telemetry, and sums their counters and latency histograms.
+// It then writes the change since the last batch, as one compact
+// batch (see fleetstats.h), to the destination: a file, or a
+// named pipe such as \\aggregator\pipe\hookfleet.  Nothing is
+// sent per event, and intervals where nothing changed send
+// nothing.  A process that exits has its final counts collected,
+// since holding its mapping open keeps them readable.  If the
+// destination can't be reached, the changes keep adding up and
+// go out in the next batch that can be written.
+//
+// In -aggregate mode, the source is either a named pipe to
+// serve, such as \\.\pipe\hookfleet, which any number of
+// collectors can connect to at once, from this machine or
+// others, or a file of batches to read.  A pipe's default
+// security only lets other accounts read from it, so the pipe is
+// created with its own: any authenticated user, including one
+// logged on over the network, can write batches to it, but only
+// its owner, administrators and the system can do anything else,
+// such as create another instance of it.  The batches are
+// merged into fleet-wide counters and histograms, and the
+// results are printed every interval (for a pipe) or once (for
+// a file).
+//
+// Press Ctrl+C to stop.  A collector sends one last batch first.
+//
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <sddl.h>
+#include <tlhelp32.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "fleetstats.h"
+#include "hookstats.h"
+#include "telemetry.h"
+
+// Default time between batches or reports, in milliseconds.
+#define DEFAULT_INTERVAL_MS     5000
+
+// Most processes a collector follows at once.
+#define COLLECTOR_MAX_PROCESSES 1024
+
+// Most nodes an aggregator keeps track of.
+#define AGGREGATOR_MAX_NODES    1024
+
+// Security for the aggregator's pipe: full access for its owner,
+// administrators and the system, and for authenticated users,
+// just enough to open it and write to it (FILE_WRITE_DATA,
+// FILE_WRITE_EA, FILE_READ_ATTRIBUTES, FILE_WRITE_ATTRIBUTES,
+// READ_CONTROL and SYNCHRONIZE).  Leaving out FILE_APPEND_DATA,
+// which on a pipe is FILE_CREATE_PIPE_INSTANCE, keeps anyone else
+// from serving the pipe's name.
+#define AGGREGATOR_PIPE_SDDL    "D:P(A;;GA;;;OW)(A;;GA;;;BA)(A;;GA;;;SY)(A;;0x00120192;;;AU)"
+
+// Set by Ctrl+C.
+static HANDLE stopEvent = nullptr;
+
+//
+// Asks the tool to stop when Ctrl+C is pressed.
+//
+static BOOL WINAPI ConsoleCtrlHandler(DWORD)
+{
+    SetEvent(stopEvent);
+    return TRUE;
+}
+
+//
+// Returns true if a path names a pipe, local or remote.
+//
+static bool IsPipeName(const char *path)
+{
+    char lower[MAX_PATH];
+    size_t i = 0;
+    for (; path[i] && i < sizeof(lower) - 1; i++)
+        lower[i] = (char)tolower((unsigned char)path[i]);
+    lower[i] = '\0';
+    return !strncmp(lower, "\\\\", 2) && strstr(lower, "\\pipe\\") != nullptr;
+}
+
+//---------------------------------------------------------------
+// COLLECTOR
+//---------------------------------------------------------------
+
+// One process being collected from.
+struct CollectedProcess
+{
+    DWORD         processId;
+    HANDLE        process;       // For telling when it exits.
+    TelemetryView view;
+    FleetCounters shipped;       // Counts already added to a batch.
+};
+
+static CollectedProcess *collected[COLLECTOR_MAX_PROCESSES] = {0};
+static int numCollected = 0;
+
+// Changes not sent yet.
+static FleetCounters pendingChange;
+static bool changePending = false;
+
+// Where batches go, and how many have been sent.
+static const char *destinationPath = nullptr;
+static HANDLE destination = INVALID_HANDLE_VALUE;
+static DWORD numBatchesSent = 0;
+
+//
+// Returns true if a process is already being collected from.
+//
+static bool IsCollected(DWORD processId)
+{
+    for (int i = 0; i < numCollected; i++)
+    {
+        if (collected[i]->processId == processId)
+            return true;
+    }
+    return false;
+}
+
+//
+// Starts collecting from every process that has published its
+// telemetry since we last looked.
+//
+static void FindNewProcesses()
+{
+    const HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+        return;
+
+    PROCESSENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+    for (BOOL more = Process32First(snapshot, &entry); more; more = Process32Next(snapshot, &entry))
+    {
+        const DWORD processId = entry.th32ProcessID;
+        if (processId == GetCurrentProcessId() || IsCollected(processId) || numCollected >= COLLECTOR_MAX_PROCESSES)
+            continue;
+
+        TelemetryView view;
+        if (!OpenTelemetry(processId, view))
+            continue;
+
+        const HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, processId);
+        CollectedProcess *target = process ? (CollectedProcess *)calloc(1, sizeof(CollectedProcess)) : nullptr;
+        if (!target)
+        {
+            if (process)
+                CloseHandle(process);
+            CloseTelemetry(view);
+            continue;
+        }
+
+        target->processId = processId;
+        target->process = process;
+        target->view = view;
+        collected[numCollected++] = target;
+    }
+
+    CloseHandle(snapshot);
+}
+
+//
+// Adds each process's counts since the last interval to the
+// pending change, and stops following processes that have
+// exited, once their final counts are in.
+//
+static void CollectChanges()
+{
+    static FleetCounters current, change;
+    for (int i = 0; i < numCollected; )
+    {
+        CollectedProcess *target = collected[i];
+
+        // Check for exit first, so the counts read next are known
+        // to be final.
+        const bool exited = WaitForSingleObject(target->process, 0) == WAIT_OBJECT_0;
+
+        ReadFleetCounters(target->view, current);
+        if (DiffFleetCounters(current, target->shipped, change))
+        {
+            AddFleetCounters(pendingChange, change);
+            changePending = true;
+        }
+        target->shipped = current;
+
+        if (!exited)
+        {
+            i++;
+            continue;
+        }
+
+        CloseTelemetry(target->view);
+        CloseHandle(target->process);
+        free(target);
+        collected[i] = collected[--numCollected];
+    }
+}
+
+//
+// Opens the destination, if it isn't open.  Returns true if it
+// is open.
+//
+static bool OpenDestination()
+{
+    if (destination != INVALID_HANDLE_VALUE)
+        return true;
+
+    // A file is opened for appending only, so every write goes on
+    // the end, even with other collectors writing to it too.  A
+    // pipe is opened with only the rights the aggregator grants
+    // (see AGGREGATOR_PIPE_SDDL).
+    const bool pipe = IsPipeName(destinationPath);
+    destination = CreateFileA(destinationPath, pipe ? FILE_WRITE_DATA : FILE_APPEND_DATA,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, pipe ? OPEN_EXISTING : OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    return destination != INVALID_HANDLE_VALUE;
+}
+
+//
+// Sends the pending change as one batch, if there is one.  If
+// it can't be sent, it stays pending.
+//
+static void SendBatch()
+{
+    static BYTE batch[sizeof(FleetBatchHeader) + FLEET_MAX_PAYLOAD];
+    if (!changePending)
+        return;
+
+    if (!OpenDestination())
+    {
+        printf("ERROR: Failed opening \"%s\" (error %lu); will try again!\n", destinationPath, GetLastError());
+        return;
+    }
+
+    FleetBatchHeader &header = *(FleetBatchHeader *)batch;
+    memset(&header, 0, sizeof(header));
+    header.magic = FLEET_BATCH_MAGIC;
+    header.version = FLEET_BATCH_VERSION;
+    header.headerSize = sizeof(header);
+    header.payloadSize = EncodeFleetPayload(pendingChange, batch + sizeof(header));
+    header.sequence = numBatchesSent;
+    header.numProcesses = (DWORD)numCollected;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    header.ticksPerSecond = frequency.QuadPart;
+    GetSystemTimeAsFileTime((FILETIME *)&header.time);
+
+    DWORD nodeLength = sizeof(header.node);
+    if (!GetComputerNameA(header.node, &nodeLength))
+        strcpy_s(header.node, "unknown");
+
+    // One write per batch, so batches appended to the same file
+    // by several collectors never interleave.
+    const DWORD size = sizeof(header) + header.payloadSize;
+    DWORD written = 0;
+    if (!WriteFile(destination, batch, size, &written, nullptr) || written != size)
+    {
+        printf("ERROR: Failed sending batch to \"%s\" (error %lu); will try again!\n", destinationPath, GetLastError());
+        CloseHandle(destination);
+        destination = INVALID_HANDLE_VALUE;
+        return;
+    }
+
+    printf("Sent batch %lu: %lu bytes from %d process(es).\n", numBatchesSent, size, numCollected);
+    numBatchesSent++;
+    pendingChange = FleetCounters();
+    changePending = false;
+}
+
+//
+// Runs the collector until Ctrl+C.
+//
+static int RunCollector(DWORD intervalMs)
+{
+    printf("Collecting hook telemetry into \"%s\" every %lu ms.\n", destinationPath, intervalMs);
+
+    for (;;)
+    {
+        CollectChanges();
+        FindNewProcesses();
+        SendBatch();
+        if (WaitForSingleObject(stopEvent, intervalMs) == WAIT_OBJECT_0)
+            break;
+    }
+
+    CollectChanges();
+    SendBatch();
+    while (numCollected > 0)
+    {
+        CollectedProcess *target = collected[--numCollected];
+        CloseTelemetry(target->view);
+        CloseHandle(target->process);
+        free(target);
+    }
+    if (destination != INVALID_HANDLE_VALUE)
+        CloseHandle(destination);
+
+    return changePending ? -1 : 0;
+}
+
+//---------------------------------------------------------------
+// AGGREGATOR
+//---------------------------------------------------------------
+
+// What we know about one collector node.
+struct FleetNode
+{
+    char      name[FLEET_MAX_NODE_NAME];
+    DWORD     numProcesses;      // As of its latest batch.
+    long long numBatches;
+    long long numBytes;
+};
+
+static FleetNode nodes[AGGREGATOR_MAX_NODES] = {0};
+static int numNodes = 0;
+
+// Everything merged so far.  All of the nodes' latencies must be
+// at the same QueryPerformanceFrequency to merge exactly;
+// batches at any other are counted and left out.
+static FleetCounters fleetTotal;
+static long long fleetTicksPerSecond = 0;
+static long long numBatchesLeftOut = 0;
+static SRWLOCK fleetLock = SRWLOCK_INIT;
+
+//
+// Merges one batch into the fleet totals.
+//
+static void MergeBatch(const FleetBatchHeader &header, const FleetCounters &change)
+{
+    AcquireSRWLockExclusive(&fleetLock);
+    if (!fleetTicksPerSecond)
+        fleetTicksPerSecond = header.ticksPerSecond;
+
+    if (header.ticksPerSecond != fleetTicksPerSecond)
+        numBatchesLeftOut++;
+    else
+    {
+        AddFleetCounters(fleetTotal, change);
+
+        FleetNode *node = nullptr;
+        for (int i = 0; i < numNodes && !node; i++)
+        {
+            if (!strncmp(nodes[i].name, header.node, sizeof(nodes[i].name)))
+                node = &nodes[i];
+        }
+        if (!node && numNodes < AGGREGATOR_MAX_NODES)
+        {
+            node = &nodes[numNodes++];
+            memcpy(node->name, header.node, sizeof(node->name));
+            node->name[sizeof(node->name) - 1] = '\0';
+        }
+        if (node)
+        {
+            node->numProcesses = header.numProcesses;
+            node->numBatches++;
+            node->numBytes += sizeof(header) + header.payloadSize;
+        }
+    }
+    ReleaseSRWLockExclusive(&fleetLock);
+}
+
+//
+// Reads exactly the given number of bytes.  Returns false at the
+// end of the stream or on an error.
+//
+static bool ReadExactly(HANDLE stream, void *buffer, DWORD size)
+{
+    BYTE *out = (BYTE *)buffer;
+    while (size > 0)
+    {
+        DWORD read = 0;
+        if (!ReadFile(stream, out, size, &read, nullptr) || !read)
+            return false;
+        out += read;
+        size -= read;
+    }
+    return true;
+}
+
+//
+// Reads and merges batches from a stream until it ends.
+// Returns false if it held anything that isn't a valid batch.
+//
+static bool ReadBatches(HANDLE stream)
+{
+    BYTE *payload = (BYTE *)malloc(FLEET_MAX_PAYLOAD);
+    FleetCounters *change = (FleetCounters *)malloc(sizeof(FleetCounters));
+    bool valid = payload && change;
+    while (valid)
+    {
+        FleetBatchHeader header;
+        if (!ReadExactly(stream, &header, sizeof(header)))
+            break;
+
+        valid = IsValidFleetBatchHeader(header) &&
+                ReadExactly(stream, payload, header.payloadSize) &&
+                DecodeFleetPayload(payload, header.payloadSize, *change);
+        if (valid)
+            MergeBatch(header, *change);
+    }
+
+    free(change);
+    free(payload);
+    return valid;
+}
+
+//
+// Reads the batches from one collector connected to the pipe.
+//
+static DWORD WINAPI PipeClientThread(LPVOID param)
+{
+    const HANDLE pipe = (HANDLE)param;
+    if (!ReadBatches(pipe))
+        printf("ERROR: A collector sent a batch that isn't valid; dropped its connection!\n");
+
+    DisconnectNamedPipe(pipe);
+    CloseHandle(pipe);
+    return 0;
+}
+
+//
+// Accepts collectors on the pipe, each on its own thread.
+//
+static DWORD WINAPI PipeServerThread(LPVOID param)
+{
+    const char *pipeName = (const char *)param;
+
+    // Every instance gets the same security, which is never freed
+    // since the thread runs until the tool exits.
+    SECURITY_ATTRIBUTES security = {0};
+    security.nLength = sizeof(security);
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(AGGREGATOR_PIPE_SDDL, SDDL_REVISION_1,
+        &security.lpSecurityDescriptor, nullptr))
+    {
+        printf("ERROR: Failed building security for pipe \"%s\" (error %lu)!\n", pipeName, GetLastError());
+        SetEvent(stopEvent);
+        return 1;
+    }
+
+    for (;;)
+    {
+        const HANDLE pipe = CreateNamedPipeA(pipeName, PIPE_ACCESS_INBOUND,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, PIPE_UNLIMITED_INSTANCES,
+            0, 64 * 1024, 0, &security);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            printf("ERROR: Failed creating pipe \"%s\" (error %lu)!\n", pipeName, GetLastError());
+            SetEvent(stopEvent);
+            return 1;
+        }
+
+        if (!ConnectNamedPipe(pipe, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED)
+        {
+            CloseHandle(pipe);
+            continue;
+        }
+
+        const HANDLE thread = CreateThread(nullptr, 0, PipeClientThread, pipe, 0, nullptr);
+        if (thread)
+            CloseHandle(thread);
+        else
+            CloseHandle(pipe);
+    }
+}
+
+//
+// Prints the latency percentiles for one hooked API across the
+// fleet.
+//
+static void PrintFleetLatency(int hookId)
+{
+    static const char *const kindNames[NUM_LATENCY_KINDS] =
+    {
+        "API:        ", "Hook:       ", "Inject:     ",
+        "Child load: ", "Child init: ", "Child start:", "Child total:",
+    };
+
+    printf("* %s latency in microseconds:\n", GetHookName(hookId));
+    for (int k = 0; k < NUM_LATENCY_KINDS; k++)
+    {
+        LatencyPercentiles percentiles;
+        ComputeLatencyPercentiles(fleetTotal.latency[hookId][k], fleetTicksPerSecond, percentiles);
+        if (percentiles.count || k == LATENCY_API || k == LATENCY_HOOK)
+        {
+            printf("    %s  p50 %10.1f  p99 %10.1f  p999 %10.1f\n",
+                kindNames[k], percentiles.p50, percentiles.p99, percentiles.p999);
+        }
+    }
+}
+
+//
+// Prints the fleet-wide results merged so far.
+//
+static void PrintFleetReport()
+{
+    AcquireSRWLockShared(&fleetLock);
+
+    long long numBatches = 0, numBytes = 0;
+    DWORD numProcesses = 0;
+    for (int i = 0; i < numNodes; i++)
+    {
+        numBatches += nodes[i].numBatches;
+        numBytes += nodes[i].numBytes;
+        numProcesses += nodes[i].numProcesses;
+    }
+
+    printf("\n============================================================\n");
+    printf("FLEET RESULTS: %d node(s), %lu process(es) publishing telemetry\n", numNodes, numProcesses);
+    printf("* Merged %lld batch(es), %lld bytes", numBatches, numBytes);
+    if (numBatchesLeftOut)
+        printf("; left out %lld batch(es) timed at another frequency", numBatchesLeftOut);
+    printf("\n");
+
+    for (int h = 0; h < NUM_HOOK_IDS; h++)
+    {
+        printf("* Number of %s calls:  %lld (%lld recorded)\n",
+            GetHookName(h), fleetTotal.calls[h], fleetTotal.sampledCalls[h]);
+    }
+    for (int h = 0; h < NUM_HOOK_IDS; h++)
+        PrintFleetLatency(h);
+    printf("============================================================\n");
+
+    ReleaseSRWLockShared(&fleetLock);
+}
+
+//
+// Runs the aggregator on a pipe until Ctrl+C, or over a file of
+// batches.
+//
+static int RunAggregator(const char *source, DWORD intervalMs)
+{
+    if (!IsPipeName(source))
+    {
+        const HANDLE file = CreateFileA(source, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            printf("ERROR: Failed opening \"%s\" (error %lu)!\n", source, GetLastError());
+            return -1;
+        }
+
+        const bool valid = ReadBatches(file);
+        CloseHandle(file);
+        if (!valid)
+            printf("ERROR: \"%s\" holds a batch that isn't valid; stopped there!\n", source);
+        PrintFleetReport();
+        return valid ? 0 : -1;
+    }
+
+    printf("Aggregating hook telemetry from collectors on \"%s\".\n", source);
+    const HANDLE server = CreateThread(nullptr, 0, PipeServerThread, (LPVOID)source, 0, nullptr);
+    if (!server)
+    {
+        printf("ERROR: Failed starting the pipe server (error %lu)!\n", GetLastError());
+        return -1;
+    }
+    CloseHandle(server);
+
+    while (WaitForSingleObject(stopEvent, intervalMs) != WAIT_OBJECT_0)
+        PrintFleetReport();
+
+    // The pipe threads are still blocked in their reads, and go
+    // away with the process.
+    PrintFleetReport();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *aggregateSource = nullptr;
+    DWORD intervalMs = DEFAULT_INTERVAL_MS;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!_stricmp(argv[i], "-collect") && i + 1 < argc)
+            destinationPath = argv[++i];
+        else if (!_stricmp(argv[i], "-aggregate") && i + 1 < argc)
+            aggregateSource = argv[++i];
+        else if (!_stricmp(argv[i], "-interval") && i + 1 < argc)
+            intervalMs = (DWORD)atol(argv[++i]);
+        else
+        {
+            printf("ERROR: Unknown option \"%s\"!\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (!destinationPath == !aggregateSource || intervalMs == 0)
+    {
+        printf("Usage: collector -collect <destination> [-interval <ms>]\n");
+        printf("       collector -aggregate <source> [-interval <ms>]\n");
+        return -1;
+    }
+
+    stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (!stopEvent)
+    {
+        printf("ERROR: Failed creating stop event (error %lu)!\n", GetLastError());
+        return -1;
+    }
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+
+    const int result = destinationPath ? RunCollector(intervalMs) : RunAggregator(aggregateSource, intervalMs);
+    CloseHandle(stopEvent);
+    return result;
+}
@@ -5,9 +5,14 @@
 // CreateProcess Windows API using the Microsoft Detours
 // library.  Since CreateProcess is actually two APIs
 // depending on the string format, we will be hooking both
-// of them (CreateProcessA and CreateProcessW).  For
-// purposes of this demo, we are only hooking APIs in the
-// current process.
+// of them (CreateProcessA and CreateProcessW).  By default
+// we are only hooking APIs in the current process; with the
+// -inject option, the hooks also inject themselves into the
+// child processes they launch.
+//
+// The hooking code itself lives in hookdll64.dll, or
+// hookdll32.dll in a 32-bit build (see hookdll.cpp), so that it
+// can be injected into children.
 //
 // General Description:
 //
@@ -36,6 +41,90 @@
 //
 // Note all program output goes to stdout, including errors.
 //
+// Command line options:
+//
+//   -allthreads   Suspend every thread in the process while
+//                 hooks are installed and removed, instead of
+//                 only updating the current thread.
+//
+//   -benchmark <launches> <threads>
+//                 Instead of running the test apps, launch the
+//                 given number of short-lived child processes
+//                 from the given number of threads at once,
+//                 first without the hooks and then with them,
+//                 and report launches/sec and the hook overhead
+//                 per launch.
+//
+//   -dispatchbench <calls> <threads>
+//                 Only run the microbenchmark of the raw cost of
+//                 calling through a detour (see dispatchbench.h),
+//                 then exit.
+//
+//   -eventlog <file>
+//                 Log every intercepted process launch to the
+//                 given file, from a background thread.
+//
+//   -trace <file> Record every intercepted process launch in the
+//                 given binary trace file (see tracefile.h),
+//                 which traceread.exe converts to CSV or JSON.
+//
+//   -json <file>  Also write the test results as JSON to the
+//                 given file (see report.h).
+//
+//   -job          Have the hooks put each child in a job object,
+//                 tear down every child's process tree at once
+//                 at the end, and report the job's CPU and I/O
+//                 accounting.
+//
+//   -lazy         Only hook each API once the DLL that exports
+//                 it has been loaded.
+//
+//   -exportcache <dir>
+//                 Save the export indexes used to look up hook
+//                 targets in the given directory, and load them
+//                 from there on later runs.
+//
+//   -filter <rules>
+//                 Only record the launches that the given
+//                 semicolon-separated allow (+) and deny (-)
+//                 rules pick out (see launchfilter.h).
+//
+//   -hotswap      Halfway through the test apps, swap the
+//                 hooks' implementations for ones in this
+//                 program while the hooks stay attached, then
+//                 swap the originals back at the end.
+//
+//   -inject       Launch children through
+//                 DetourCreateProcessWithDllEx, so hookdll64.dll
+//                 (or hookdll32.dll, in children of the other
+//                 width) hooks the whole process tree, and report
+//                 how long the injection takes, and how long each
+//                 child takes to start (see childstartup.h).
+//
+//   -profile      Report how long each phase of installing the
+//                 hooks took (see installprofile.h).
+//
+//   -rewrite <rules>
+//                 Have the hooks rewrite each child's command
+//                 line by the given semicolon-separated
+//                 find=>replace rules (see launchrewrite.h).
+//
+//   -sample <n>   Only record about one in every n calls to each
+//                 hook, and report the call counts estimated
+//                 from them (see hooksampling.h).
+//
+//   -sampletime <microseconds>
+//                 Only record about one call per the given
+//                 number of microseconds on each thread.
+//
+//   -setenv <variables>
+//                 Have the hooks set the given semicolon-separated
+//                 NAME=value variables in each child's environment.
+//
+//   -telemetry    Publish the hook counters and the launch event
+//                 ring in shared memory, for monitoring from
+//                 another process (see telemetry.h).
+//
 // Compiles with Microsoft C++ compiler from Visual Studio
 // 2022.  Also requires the Microsoft Detours library.
 //
@@ -43,153 +132,94 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <stdio.h>
-#include "detours.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include "benchmark.h"
+#include "callsites.h"
+#include "childjob.h"
+#include "childstartup.h"
+#include "dispatchbench.h"
+#include "eventlog.h"
+#include "exportindex.h"
+#include "hookdll.h"
+#include "hooksampling.h"
+#include "hookstats.h"
+#include "installprofile.h"
+#include "launchfilter.h"
+#include "launchrewrite.h"
+#include "reaper.h"
+#include "report.h"
+#include "stringtable.h"
+#include "trampolinepool.h"
+#include "telemetry.h"
 
-// Function signature of CreateProcessW system API.
-typedef BOOL (WINAPI * CREATEPROCESSWFUNC)(LPCWSTR, LPWSTR,
-            LPSECURITY_ATTRIBUTES, LPSECURITY_ATTRIBUTES,
-            BOOL, DWORD, LPVOID, LPCWSTR, LPSTARTUPINFOW,
-            LPPROCESS_INFORMATION);
+// True if the -allthreads option is used.
+static bool useAllThreads = false;
 
-// Function signature of CreateProcessA system API.
-typedef BOOL (WINAPI * CREATEPROCESSAFUNC)(LPCSTR, LPSTR,
-            LPSECURITY_ATTRIBUTES, LPSECURITY_ATTRIBUTES,
-            BOOL, DWORD, LPVOID, LPCSTR, LPSTARTUPINFOA,
-            LPPROCESS_INFORMATION);
+// True if the -job option is used.
+static bool useChildJob = false;
 
-// Pointers to the API functions we'll be hooking into.
-static CREATEPROCESSWFUNC PtrCreateProcessW = CreateProcessW;
-static CREATEPROCESSAFUNC PtrCreateProcessA = CreateProcessA;
+// True if the -inject option is used.
+static bool useInjection = false;
 
-// For keeping track of how many times our hooks were called.
-static int numCallsToCreateProcessA = 0;
-static int numCallsToCreateProcessW = 0;
+// True if the -lazy option is used.
+static bool useLazyInstall = false;
 
-// Synchronization lock.
-static volatile CHAR busy = 0;
+// Where to log intercepted launches, if the -eventlog option
+// is used.
+static const char *eventLogFile = nullptr;
 
-//---------------------------------------------------------------
-// API HOOKING CODE
-//---------------------------------------------------------------
+// Where to record intercepted launches in binary, if the -trace
+// option is used.
+static const char *traceFile = nullptr;
 
-//
-// Windows will call this hook function whenever CreateProcessW
-// is called.
-//
-BOOL WINAPI HookedCreateProcessW(
-    LPCWSTR               lpApplicationName,
-    LPWSTR                lpCommandLine,
-    LPSECURITY_ATTRIBUTES lpProcessAttributes,
-    LPSECURITY_ATTRIBUTES lpThreadAttributes,
-    BOOL                  bInheritHandles,
-    DWORD                 dwCreationFlags,
-    LPVOID                lpEnvironment,
-    LPCWSTR               lpCurrentDirectory,
-    LPSTARTUPINFOW        lpStartupInfo,
-    LPPROCESS_INFORMATION lpProcessInformation
-    )
-{
-    // Only allow one thread to access our globals at the same time.
-    // This isn't actually needed for a single-threaded demo, but
-    // it's good practice.
-    while (InterlockedExchange8(&busy, 1)) { /* Intentionally empty */ }
-
-    // Keep track of how many times we were called.
-    numCallsToCreateProcessW++;
-
-    // If we wanted to do any other processing or data exchange
-    // during this API call, the code would go here.
-    // ...
-    // ...
-
-    // Unlock.
-    busy = 0;
-
-    // Pass-thru call to the original API that we hooked into.
-    return PtrCreateProcessW(lpApplicationName, lpCommandLine,
-        lpProcessAttributes, lpThreadAttributes, bInheritHandles,
-        dwCreationFlags, lpEnvironment, lpCurrentDirectory,
-        lpStartupInfo, lpProcessInformation);
-}
+// True if the -telemetry option is used.
+static bool useTelemetry = false;
 
-//
-// Windows will call this hook function whenever CreateProcessA
-// is called.
-//
-BOOL WINAPI HookedCreateProcessA(
-    LPCSTR                lpApplicationName,
-    LPSTR                 lpCommandLine,
-    LPSECURITY_ATTRIBUTES lpProcessAttributes,
-    LPSECURITY_ATTRIBUTES lpThreadAttributes,
-    BOOL                  bInheritHandles,
-    DWORD                 dwCreationFlags,
-    LPVOID                lpEnvironment,
-    LPCSTR                lpCurrentDirectory,
-    LPSTARTUPINFOA        lpStartupInfo,
-    LPPROCESS_INFORMATION lpProcessInformation
-    )
-{
-    // Only allow one thread to access our globals at the same time.
-    // This isn't actually needed for a single-threaded demo, but
-    // it's good practice.
-    while (InterlockedExchange8(&busy, 1)) { /* Intentionally empty */ }
-
-    // Keep track of how many times we were called.
-    numCallsToCreateProcessA++;
-
-    // If we wanted to do any other processing or data exchange
-    // during this API call, the code would go here.
-    // ...
-    // ...
-
-    // Unlock.
-    busy = 0;
-
-    // Pass-thru call to the original API that we hooked into.
-    return PtrCreateProcessA(lpApplicationName, lpCommandLine,
-        lpProcessAttributes, lpThreadAttributes, bInheritHandles,
-        dwCreationFlags, lpEnvironment, lpCurrentDirectory,
-        lpStartupInfo, lpProcessInformation);
-}
+// True if the -hotswap option is used.
+static bool useHotSwap = false;
 
-//
-// Installs our API function hooks using Detours.
-// Returns true if successful.
-//
-static bool InstallHooks()
-{
-    printf("Installing API hooks.\n");
+// True if the -profile option is used.
+static bool useInstallProfile = false;
 
-    DetourTransactionBegin();
-    DetourUpdateThread(GetCurrentThread());
-    if (DetourAttach(&(PVOID &)PtrCreateProcessW, HookedCreateProcessW) != NO_ERROR)
-    {
-        printf("ERROR: Failed hooking CreateProcessW!\n");
-        return false;
-    }
-    if (DetourAttach(&(PVOID &)PtrCreateProcessA, HookedCreateProcessA) != NO_ERROR)
-    {
-        printf("ERROR: Failed hooking CreateProcessA!\n");
-        return false;
-    }
-    DetourTransactionCommit();
+// Number of launches and threads for the -benchmark option, or
+// zero launches to run the test apps instead.
+static int benchmarkLaunches = 0;
+static int benchmarkThreads = 0;
 
-    return true;
-}
+// Number of calls and threads for the -dispatchbench option, or
+// zero calls if it isn't used.
+static long long dispatchBenchCalls = 0;
+static int dispatchBenchThreads = 0;
 
-//
-// Removes our previously installed API function hooks.
-//
-static void RemoveHooks()
+// How long to wait at the end for the test apps to finish
+// exiting, in milliseconds.
+#define REAPER_STOP_TIMEOUT_MS  5000
+
+// Results of the benchmark run without the hooks.
+static LaunchBenchmarkResult benchmarkBaseline = {0};
+
+// How long the -hotswap test took to swap the implementations in
+// and back out, in microseconds.
+static double swapInMicroseconds = 0;
+static double swapOutMicroseconds = 0;
+
+// Most launches the test records for the report.
+#define MAX_TEST_LAUNCHES       32
+
+// One launch the test made.  Printing each one as it happens
+// would time the console along with the launches, so they are
+// only recorded here and reported with the results.
+struct TestLaunch
 {
-    printf("Removing API hooks.\n");
+    const void *appname;    // char or wchar_t, as wide says.
+    bool        wide;
+    DWORD       processId;  // Zero if it failed.
+    DWORD       error;
+};
 
-    DetourTransactionBegin();
-    DetourUpdateThread(GetCurrentThread());
-    DetourDetach(&(PVOID &)PtrCreateProcessW, HookedCreateProcessW);
-    DetourDetach(&(PVOID &)PtrCreateProcessA, HookedCreateProcessA);
-    DetourTransactionCommit();
-}
+static TestLaunch testLaunches[MAX_TEST_LAUNCHES];
+static int numTestLaunches = 0;
 
 //---------------------------------------------------------------
 // TESTING CODE
@@ -197,74 +227,189 @@ static void RemoveHooks()
 
 //
 // Kills the Windows process associated with the given process ID.
+// The process must have been handed to the reaper, which does
+// the actual work on its own thread, so this doesn't block.
 //
 static void KillProcess(DWORD processid)
 {
     if (!processid)
         return;
 
-    const auto hprocess = OpenProcess(PROCESS_TERMINATE, false, processid);
-    TerminateProcess(hprocess, 1);
-    CloseHandle(hprocess);
+    TerminateReapedProcess(processid);
 }
 
 //
-// Launch an app by name, using the CreateProcessA API.
-// Returns the process ID if successful, zero if error.
+// What differs between launching with CreateProcessA and with
+// CreateProcessW, so RunAppWithCreateProcess can do both.
 //
-static DWORD RunAppWithCreateProcessA(const char *appname)
+template <typename CharT> struct LaunchApi;
+
+template <> struct LaunchApi<char>
 {
-    if (!appname || !*appname)
-        return 0;
+    typedef STARTUPINFOA StartupInfo;
+    static const bool wide = false;
 
-    STARTUPINFO si = {0};
-    PROCESS_INFORMATION pi = {0};
-    si.cb = sizeof(si);
+    static void CopyCommandLine(char (&dest)[MAX_PATH], const char *src) { strcpy_s(dest, src); }
 
-    char cmdline[MAX_PATH] = {0};
-    strcpy_s(cmdline, appname);
-    printf("Calling CreateProcessA with \"%s\"\n", cmdline);
-    if (!CreateProcessA(nullptr, cmdline, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi))
+    static BOOL Create(char *cmdline, StartupInfo &si, PROCESS_INFORMATION &pi)
     {
-        printf("Failed running \"%s\"\n", appname);
-        return 0;
+        return CreateProcessA(nullptr, cmdline, nullptr, nullptr, FALSE, CREATE_SUSPENDED, nullptr, nullptr, &si, &pi);
     }
+};
 
-    printf("Created process ID %lu\n", pi.dwProcessId);
-    return pi.dwProcessId;
-}
+template <> struct LaunchApi<wchar_t>
+{
+    typedef STARTUPINFOW StartupInfo;
+    static const bool wide = true;
+
+    static void CopyCommandLine(wchar_t (&dest)[MAX_PATH], const wchar_t *src) { wcscpy_s(dest, src); }
+
+    static BOOL Create(wchar_t *cmdline, StartupInfo &si, PROCESS_INFORMATION &pi)
+    {
+        return CreateProcessW(nullptr, cmdline, nullptr, nullptr, FALSE, CREATE_SUSPENDED, nullptr, nullptr, &si, &pi);
+    }
+};
 
 //
-// Launch an app by name, using the CreateProcessW API.
-// Returns the process ID if successful, zero if error.
+// Launch an app by name, using CreateProcessA or CreateProcessW
+// depending on the character type, and records the launch for
+// the report.  Returns the process ID if successful, zero if
+// error.
 //
-static DWORD RunAppWithCreateProcessW(const wchar_t *appname)
+template <typename CharT>
+static DWORD RunAppWithCreateProcess(const CharT *appname)
 {
+    typedef LaunchApi<CharT> Api;
+
     if (!appname || !*appname)
         return 0;
 
-    STARTUPINFOW si = {0};
+    typename Api::StartupInfo si = {0};
     PROCESS_INFORMATION pi = {0};
     si.cb = sizeof(si);
 
-    wchar_t cmdline[MAX_PATH] = {0};
-    wcscpy_s(cmdline, appname);
-    printf("Calling CreateProcessW with \"%S\"\n", cmdline);
-    if (!CreateProcessW(nullptr, cmdline, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi))
+    CharT cmdline[MAX_PATH] = {0};
+    Api::CopyCommandLine(cmdline, appname);
+    const BOOL created = Api::Create(cmdline, si, pi);
+    const DWORD error = created ? 0 : GetLastError();
+
+    if (numTestLaunches < MAX_TEST_LAUNCHES)
     {
-        printf("Failed running \"%S\"\n", appname);
+        TestLaunch &launch = testLaunches[numTestLaunches++];
+        launch.appname = appname;
+        launch.wide = Api::wide;
+        launch.processId = created ? pi.dwProcessId : 0;
+        launch.error = error;
+    }
+
+    if (!created)
         return 0;
+
+    const DWORD processId = pi.dwProcessId;
+    ReapProcess(pi);
+    return processId;
+}
+
+template <typename Function> struct SwappedInHook;
+
+//
+// A hook implementation for the -hotswap test, which counts its
+// calls and passes them on to the implementation it replaced.
+//
+template <typename... Args>
+struct SwappedInHook<BOOL (WINAPI *)(Args...)>
+{
+    typedef BOOL (WINAPI *Function)(Args...);
+
+    // The implementation this one replaced.
+    static Function previous;
+
+    // Calls that went through this implementation.
+    static volatile LONG numCalls;
+
+    static BOOL WINAPI Implementation(Args... args)
+    {
+        InterlockedIncrement(&numCalls);
+        return previous(args...);
     }
 
-    printf("Created process ID %lu\n", pi.dwProcessId);
-    return pi.dwProcessId;
+    //
+    // Swaps this implementation in for a hook.  Returns true if
+    // successful.
+    //
+    static bool SwapIn(int hookId)
+    {
+        previous = (Function)GetHookImplementation(hookId);
+        return previous && SwapHookImplementation(hookId, (PVOID)Implementation) == (PVOID)previous;
+    }
+
+    //
+    // Swaps the replaced implementation back in.  Once this
+    // returns, no thread is running ours any more.
+    //
+    static void SwapOut(int hookId)
+    {
+        SwapHookImplementation(hookId, (PVOID)previous);
+    }
+};
+
+template <typename... Args>
+typename SwappedInHook<BOOL (WINAPI *)(Args...)>::Function SwappedInHook<BOOL (WINAPI *)(Args...)>::previous = nullptr;
+
+template <typename... Args>
+volatile LONG SwappedInHook<BOOL (WINAPI *)(Args...)>::numCalls = 0;
+
+typedef SwappedInHook<decltype(&CreateProcessW)> SwappedInCreateProcessW;
+typedef SwappedInHook<decltype(&CreateProcessA)> SwappedInCreateProcessA;
+
+//
+// Returns the current QueryPerformanceCounter value in
+// microseconds.
+//
+static double ReadMicroseconds()
+{
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (double)now.QuadPart * 1000000.0 / (double)frequency.QuadPart;
+}
+
+//
+// For the -hotswap test, swaps implementations from this
+// program in behind both CreateProcess hooks.  The hooks stay
+// attached, so no launch goes unseen.  Returns true if
+// successful.
+//
+static bool SwapInTestImplementations()
+{
+    const double start = ReadMicroseconds();
+    if (!SwappedInCreateProcessW::SwapIn(HOOK_CREATEPROCESSW) || !SwappedInCreateProcessA::SwapIn(HOOK_CREATEPROCESSA))
+    {
+        printf("ERROR: Failed swapping the hook implementations!\n");
+        return false;
+    }
+
+    swapInMicroseconds = ReadMicroseconds() - start;
+    return true;
+}
+
+//
+// Swaps the hooks' own implementations back in after the
+// -hotswap test.
+//
+static void SwapOutTestImplementations()
+{
+    const double start = ReadMicroseconds();
+    SwappedInCreateProcessW::SwapOut(HOOK_CREATEPROCESSW);
+    SwappedInCreateProcessA::SwapOut(HOOK_CREATEPROCESSA);
+    swapOutMicroseconds = ReadMicroseconds() - start;
 }
 
 //
 // Launches several common Windows apps and utilities over a
 // period of several seconds, so we can verify that our hooks
 // are actually being called.  Returns the number of apps we
-// tried to run.
+// tried to run, or -1 if the -hotswap swap failed.
 //
 static int RunAppsForTesting()
 {
@@ -279,82 +424,670 @@ static int RunAppsForTesting()
     for (int i = 0; appnames[i] != nullptr; i++)
     {
         Sleep(500);
-        DWORD processId = RunAppWithCreateProcessA(appnames[i]);
+        DWORD processId = RunAppWithCreateProcess(appnames[i]);
         if (processId)
         {
             Sleep(500);
-            printf("Killing process ID %lu\n", processId);
             KillProcess(processId);
         }
 
         count++;
     }
 
+    // Halfway through, the hooks get their new implementations.
+    if (useHotSwap && !SwapInTestImplementations())
+        return -1;
+
     // Run some apps using CreateProcessW.
     const wchar_t *appnamesW[] = { L"charmap", L"comp /N=1 /M README.md README.md", L"tasklist /m explorer*", L"systeminfo", L"findstr README readme*", L"app_that_doesnt_exist", nullptr };
     for (int i = 0; appnamesW[i] != nullptr; i++)
     {
         Sleep(500);
-        DWORD processId = RunAppWithCreateProcessW(appnamesW[i]);
+        DWORD processId = RunAppWithCreateProcess(appnamesW[i]);
         if (processId)
         {
             Sleep(500);
-            printf("Killing process ID %lu\n", processId);
             KillProcess(processId);
         }
 
         count++;
     }
 
+    if (useHotSwap)
+        SwapOutTestImplementations();
+
     return count;
 }
 
 //
-// Prints test results to the console.
-// Returns true if test passes, false if test fails.
+// Runs the launch benchmark before the hooks are installed, to
+// get a baseline.  Returns true if successful.
 //
-static bool CheckResults(int numAppsRun)
+static bool RunBaselineBenchmark()
 {
     printf("\n============================================================\n");
-    printf("TEST RESULTS:\n");
-    printf("* Number of CreateProcessA calls during test:  %d\n", numCallsToCreateProcessA);
-    printf("* Number of CreateProcessW calls during test:  %d\n", numCallsToCreateProcessW);
+    printf("Benchmark: Launching %d processes from %d thread(s).\n", benchmarkLaunches, benchmarkThreads);
+    printf("============================================================\n");
+
+    if (!RunLaunchBenchmark(benchmarkLaunches, benchmarkThreads, benchmarkBaseline))
+        return false;
+
+    PrintLaunchBenchmark("Unhooked", benchmarkBaseline);
+    return true;
+}
+
+//
+// Runs the launch benchmark again with the hooks installed, and
+// then with their monitoring switched off, and compares both to
+// the baseline.  Returns the number of monitored launches made,
+// or -1 if the benchmark failed.
+//
+static int RunHookedBenchmark()
+{
+    LaunchBenchmarkResult hooked;
+    if (!RunLaunchBenchmark(benchmarkLaunches, benchmarkThreads, hooked))
+        return -1;
+
+    PrintLaunchBenchmark("Hooked", hooked);
+    PrintLaunchOverhead(benchmarkBaseline, hooked);
+
+    // Once more with the hooks still in place but doing nothing,
+    // which is what a process pays for being ready to monitor.
+    LaunchBenchmarkResult passThru;
+    SetHookMonitoring(ALL_HOOKS, false);
+    const bool passThruOk = RunLaunchBenchmark(benchmarkLaunches, benchmarkThreads, passThru);
+    SetHookMonitoring(ALL_HOOKS, true);
+    if (!passThruOk)
+        return -1;
+
+    PrintLaunchBenchmark("Hooked, monitoring off", passThru);
+    PrintLaunchOverhead(benchmarkBaseline, passThru);
+    return hooked.numLaunches;
+}
+
+//
+// Tears down everything left in the child job, including any
+// processes our test apps launched themselves, and prints the
+// job's accounting.
+//
+static void TearDownChildJob()
+{
+    printf("Terminating child job.\n");
+    TerminateChildJob(1);
+
+    ChildJobAccounting accounting;
+    if (!GetChildJobAccounting(accounting))
+        return;
+
+    printf("Child job ran %lu process(es) (%lu not added), %.3f s user, %.3f s kernel CPU.\n",
+        accounting.totalProcesses, accounting.numAssignFailures,
+        accounting.userSeconds, accounting.kernelSeconds);
+    printf("Child job I/O: %llu read(s) of %llu bytes, %llu write(s) of %llu bytes.\n",
+        accounting.readOperations, accounting.readBytes,
+        accounting.writeOperations, accounting.writeBytes);
+}
+
+//
+// Reports the percentiles of one latency histogram, as one line
+// of the text and one object of the JSON.
+//
+static void ReportLatencyLine(const char *label, const char *key, const LatencyPercentiles &latency)
+{
+    ReportText("    %-12s p50 %10.1f  p99 %10.1f  p999 %10.1f\n", label, latency.p50, latency.p99, latency.p999);
+
+    ReportJsonBeginObject(key);
+    ReportJsonInt("count", latency.count);
+    ReportJsonNumber("p50", latency.p50);
+    ReportJsonNumber("p99", latency.p99);
+    ReportJsonNumber("p999", latency.p999);
+    ReportJsonEndObject();
+}
+
+//
+// Reports the latency percentiles for one hooked API.
+//
+static void ReportLatency(const char *apiname, int hookId)
+{
+    // The injection and child startup kinds only have anything in
+    // them with -inject or -job.
+    static const struct
+    {
+        int         kind;
+        const char *label;
+        const char *key;
+        bool        always;
+    }
+    kinds[] =
+    {
+        { LATENCY_API,          "API:",          "api",        true },
+        { LATENCY_HOOK,         "Hook:",         "hook",       true },
+        { LATENCY_INJECT,       "Inject:",       "inject",     false },
+        { LATENCY_CHILD_LOAD,   "Child load:",   "childLoad",  false },
+        { LATENCY_CHILD_INIT,   "Child init:",   "childInit",  false },
+        { LATENCY_CHILD_START,  "Child start:",  "childStart", false },
+        { LATENCY_CHILD_TOTAL,  "Child total:",  "childTotal", false },
+    };
+
+    ReportText("* %s latency in microseconds:\n", apiname);
+    ReportJsonBeginObject(apiname);
+    for (int i = 0; i < (int)ARRAYSIZE(kinds); i++)
+    {
+        LatencyPercentiles latency;
+        HookStatsGetLatency(hookId, kinds[i].kind, latency);
+        if (kinds[i].always || latency.count)
+            ReportLatencyLine(kinds[i].label, kinds[i].key, latency);
+    }
+    ReportJsonEndObject();
+}
+
+//
+// Reports how many injected children reported their startup.
+//
+static void ReportChildStartups()
+{
+    ChildStartupCounts counts;
+    GetChildStartupCounts(counts);
+    if (!counts.numTracked && !counts.numUntracked)
+        return;
+
+    ReportText("* Child startups:  %lld tracked, %lld recorded, %lld never reported, %lld untracked\n",
+        counts.numTracked, counts.numCollected, counts.numLost, counts.numUntracked);
+
+    ReportJsonBeginObject("childStartups");
+    ReportJsonInt("tracked", counts.numTracked);
+    ReportJsonInt("recorded", counts.numCollected);
+    ReportJsonInt("lost", counts.numLost);
+    ReportJsonInt("untracked", counts.numUntracked);
+    ReportJsonEndObject();
+}
+
+//
+// Reports the busiest places hooked APIs were called from.
+//
+static void ReportCallsites()
+{
+    CallsiteReport callsites[8];
+    const int numCallsites = GetCallsites(callsites, ARRAYSIZE(callsites));
+
+    ReportText("* Busiest callsites:\n");
+    ReportJsonBeginArray("callsites");
+    for (int i = 0; i < numCallsites; i++)
+    {
+        const CallsiteReport &site = callsites[i];
+        ReportText("    %s+0x%llX  %-14s %8lld call(s)  mean %10.1f us  max %10.1f us\n",
+            site.module, (unsigned long long)site.offset, GetHookName(site.hookId),
+            site.calls, site.meanMicroseconds, site.maxMicroseconds);
+
+        ReportJsonBeginObject(nullptr);
+        ReportJsonString("module", site.module);
+        ReportJsonInt("offset", (long long)site.offset);
+        ReportJsonString("api", GetHookName(site.hookId));
+        ReportJsonInt("calls", site.calls);
+        ReportJsonNumber("meanMicroseconds", site.meanMicroseconds);
+        ReportJsonNumber("maxMicroseconds", site.maxMicroseconds);
+        ReportJsonEndObject();
+    }
+    ReportJsonEndArray();
+
+    const long long overflow = GetCallsiteOverflowCount();
+    if (overflow)
+        ReportText("    (%lld call(s) from callsites that didn't fit in the table)\n", overflow);
+    ReportJsonInt("callsiteOverflow", overflow);
+}
+
+//
+// Reports how much memory the trampolines of our hooks take.
+//
+static void ReportTrampolinePool()
+{
+    TrampolinePoolStats pool;
+    if (!GetTrampolinePoolStats(pool))
+        return;
+
+    ReportText("* Trampoline regions:  %d region(s), %lld page(s), %lld bytes, %d empty\n",
+        pool.numRegions, pool.regionPages, pool.regionBytes, pool.numEmptyRegions);
+    ReportText("    %d live trampoline(s); %lld region(s) allocated and %lld freed so far\n",
+        pool.numTrampolines, pool.regionsAllocated, pool.regionsFreed);
+
+    ReportJsonBeginObject("trampolinePool");
+    ReportJsonInt("regions", pool.numRegions);
+    ReportJsonInt("pages", pool.regionPages);
+    ReportJsonInt("bytes", pool.regionBytes);
+    ReportJsonInt("emptyRegions", pool.numEmptyRegions);
+    ReportJsonInt("trampolines", pool.numTrampolines);
+    ReportJsonInt("regionsAllocated", pool.regionsAllocated);
+    ReportJsonInt("regionsFreed", pool.regionsFreed);
+    ReportJsonEndObject();
+}
+
+//
+// Reports how long each phase of installing the hooks took,
+// including any lazily installed batches, and the total for
+// each kind of phase.
+//
+static void ReportInstallProfile()
+{
+    static InstallPhaseRecord records[INSTALL_PROFILE_MAX_RECORDS];
+    const int numRecords = GetInstallProfile(records, ARRAYSIZE(records));
+
+    double totals[NUM_INSTALL_PHASES] = {0};
+    ReportText("* Hook install phases:\n");
+    ReportJsonBeginObject("installProfile");
+    ReportJsonBeginArray("phases");
+    for (int i = 0; i < numRecords; i++)
+    {
+        const InstallPhaseRecord &record = records[i];
+        totals[record.phase] += record.microseconds;
+        ReportText("    %12.1f us  %-14s %-16s %10.1f us",
+            record.startMicroseconds, GetInstallPhaseName(record.phase),
+            record.hookName ? record.hookName : "", record.microseconds);
+        if (record.phase == PHASE_UPDATE_THREADS)
+            ReportText("  (%d thread(s))", record.count);
+        ReportText("\n");
+
+        ReportJsonBeginObject(nullptr);
+        ReportJsonString("phase", GetInstallPhaseName(record.phase));
+        ReportJsonString("hook", record.hookName);
+        ReportJsonNumber("startMicroseconds", record.startMicroseconds);
+        ReportJsonNumber("microseconds", record.microseconds);
+        if (record.phase == PHASE_UPDATE_THREADS)
+            ReportJsonInt("threads", record.count);
+        ReportJsonEndObject();
+    }
+    ReportJsonEndArray();
+
+    ReportText("    Totals:");
+    ReportJsonBeginObject("totalMicroseconds");
+    for (int phase = 0; phase < NUM_INSTALL_PHASES; phase++)
+    {
+        ReportText("  %s %.1f us", GetInstallPhaseName(phase), totals[phase]);
+        ReportJsonNumber(GetInstallPhaseName(phase), totals[phase]);
+    }
+    ReportJsonEndObject();
+    ReportText("\n");
+
+    const bool full = numRecords == INSTALL_PROFILE_MAX_RECORDS;
+    if (full)
+        ReportText("    (profile is full; later phases were not recorded)\n");
+    ReportJsonBool("full", full);
+    ReportJsonEndObject();
+}
+
+//
+// Reports how the hooks rewrote the launches, if they did.
+//
+static void ReportLaunchRewrite()
+{
+    if (!*GetLaunchEnvironment() && !*GetCommandLineRewrite())
+        return;
+
+    LaunchRewriteStats stats;
+    GetLaunchRewriteStats(stats);
+    ReportText("* Launch rewrites:  %lld environment(s) built, %lld from the cache, %lld unchanged; %lld command line(s) rewritten; %lld failure(s)\n",
+        stats.environmentsBuilt, stats.environmentCacheHits, stats.environmentsUnchanged,
+        stats.commandLinesRewritten, stats.failures);
+
+    ReportJsonBeginObject("launchRewrite");
+    ReportJsonInt("environmentsBuilt", stats.environmentsBuilt);
+    ReportJsonInt("environmentCacheHits", stats.environmentCacheHits);
+    ReportJsonInt("environmentsUnchanged", stats.environmentsUnchanged);
+    ReportJsonInt("commandLinesRewritten", stats.commandLinesRewritten);
+    ReportJsonInt("failures", stats.failures);
+    ReportJsonEndObject();
+}
+
+//
+// Reports each launch the test made, as recorded while it ran.
+//
+static void ReportTestLaunches()
+{
+    if (!numTestLaunches)
+        return;
+
+    ReportText("* Test launches:\n");
+    ReportJsonBeginArray("launches");
+    for (int i = 0; i < numTestLaunches; i++)
+    {
+        const TestLaunch &launch = testLaunches[i];
+        const char *api = launch.wide ? "CreateProcessW" : "CreateProcessA";
+        ReportText(launch.wide ? "    %s \"%S\": " : "    %s \"%s\": ", api, launch.appname);
+        if (launch.processId)
+            ReportText("process ID %lu, killed\n", launch.processId);
+        else
+            ReportText("failed (error %lu)\n", launch.error);
+
+        ReportJsonBeginObject(nullptr);
+        ReportJsonString("api", api);
+        if (launch.wide)
+            ReportJsonWideString("commandLine", (const wchar_t *)launch.appname);
+        else
+            ReportJsonString("commandLine", (const char *)launch.appname);
+        ReportJsonInt("processId", launch.processId);
+        ReportJsonInt("error", launch.error);
+        ReportJsonEndObject();
+    }
+    ReportJsonEndArray();
+    if (numTestLaunches == MAX_TEST_LAUNCHES)
+        ReportText("    (only the first %d launches were recorded)\n", MAX_TEST_LAUNCHES);
+}
+
+//
+// Reports how the -hotswap test went.
+//
+static void ReportHotSwap()
+{
+    if (!useHotSwap)
+        return;
+
+    const long long numSwappedCalls = SwappedInCreateProcessW::numCalls + SwappedInCreateProcessA::numCalls;
+    ReportText("* Hot swap:  swapped in %.1f us and back in %.1f us, without suspending any threads; %lld launch(es) went through the swapped-in implementations\n",
+        swapInMicroseconds, swapOutMicroseconds, numSwappedCalls);
+
+    ReportJsonBeginObject("hotSwap");
+    ReportJsonNumber("swapInMicroseconds", swapInMicroseconds);
+    ReportJsonNumber("swapOutMicroseconds", swapOutMicroseconds);
+    ReportJsonInt("swappedInCalls", numSwappedCalls);
+    ReportJsonEndObject();
+}
+
+//
+// Reports the verdict of the test, and writes out the report.
+//
+static bool FinishResults(bool passed, const char *format, ...)
+{
+    char verdict[512];
+    va_list args;
+    va_start(args, format);
+    _vsnprintf_s(verdict, sizeof(verdict), _TRUNCATE, format, args);
+    va_end(args);
+
+    ReportText("\nTEST %s: %s\n", passed ? "PASS" : "FAIL", verdict);
+    ReportText("============================================================\n");
+    ReportJsonBool("passed", passed);
+    ReportJsonString("verdict", verdict);
+
+    FinishReport();
+    return passed;
+}
+
+//
+// Reports test results, to the console and to the JSON report
+// if there is one.  Returns true if test passes, false if test
+// fails.
+//
+static bool CheckResults(int numAppsRun)
+{
+    StartReport();
+    ReportText("\n============================================================\n");
+    ReportText("TEST RESULTS:\n");
+    ReportTestLaunches();
+    ReportHotSwap();
+
+    const long long numCallsToCreateProcessA = HookStatsGetCallCount(HOOK_CREATEPROCESSA);
+    const long long numCallsToCreateProcessW = HookStatsGetCallCount(HOOK_CREATEPROCESSW);
+    ReportText("* Number of CreateProcessA calls during test:  %lld\n", numCallsToCreateProcessA);
+    ReportText("* Number of CreateProcessW calls during test:  %lld\n", numCallsToCreateProcessW);
+    ReportJsonInt("appsRun", numAppsRun);
+    ReportJsonBeginObject("calls");
+    ReportJsonInt("CreateProcessA", numCallsToCreateProcessA);
+    ReportJsonInt("CreateProcessW", numCallsToCreateProcessW);
+    ReportJsonEndObject();
+
+    int mode;
+    DWORD rate;
+    const bool sampling = GetHookSampling(HOOK_CREATEPROCESSW, mode, rate) && mode != SAMPLE_ALL;
+    if (sampling)
+    {
+        const long long sampledA = HookStatsGetSampledCallCount(HOOK_CREATEPROCESSA);
+        const long long sampledW = HookStatsGetSampledCallCount(HOOK_CREATEPROCESSW);
+        ReportText(mode == SAMPLE_INTERVAL ?
+            "    (estimated from %lld and %lld sampled calls, one per %lu microseconds on each thread)\n" :
+            "    (estimated from %lld and %lld sampled calls, one in %lu calls)\n",
+            sampledA, sampledW, rate);
+
+        ReportJsonBeginObject("sampling");
+        ReportJsonString("mode", mode == SAMPLE_INTERVAL ? "interval" : "oneInN");
+        ReportJsonInt("rate", rate);
+        ReportJsonInt("sampledCreateProcessA", sampledA);
+        ReportJsonInt("sampledCreateProcessW", sampledW);
+        ReportJsonEndObject();
+    }
+
+    ReportJsonBeginObject("latencyMicroseconds");
+    ReportLatency("CreateProcessA", HOOK_CREATEPROCESSA);
+    ReportLatency("CreateProcessW", HOOK_CREATEPROCESSW);
+    ReportJsonEndObject();
+    ReportChildStartups();
+    ReportLaunchRewrite();
+    ReportCallsites();
+    ReportTrampolinePool();
+    if (useInstallProfile)
+        ReportInstallProfile();
+
+    // The filter decides which launches get counted, so there's
+    // no telling how many calls to expect.
+    const long long numHookCalls = numCallsToCreateProcessA + numCallsToCreateProcessW;
+    if (*GetLaunchFilter())
+        return FinishResults(true, "Launch filter \"%s\" is on, so not checking the number of hook calls.", GetLaunchFilter());
+
+    // Nor with sampling, since the counts are only estimates.
+    if (sampling)
+        return FinishResults(true, "Sampling is on, so not checking the number of hook calls.");
 
-    int numHookCalls = numCallsToCreateProcessA + numCallsToCreateProcessW;
     if (numAppsRun > numHookCalls)
+        return FinishResults(false, "Received %lld total hook calls, but expected at least %d!", numHookCalls, numAppsRun);
+
+    // Every injected app that started should have reported its
+    // startup, so each startup kind should have something in it.
+    if (useInjection && numAppsRun > 0)
     {
-        printf("\nTEST FAIL: Received %d total hook calls, but expected at least %d!\n", numHookCalls, numAppsRun);
-        printf("============================================================\n");
-        return false;
+        static const int startupKinds[] =
+        {
+            LATENCY_CHILD_LOAD, LATENCY_CHILD_INIT, LATENCY_CHILD_START, LATENCY_CHILD_TOTAL,
+        };
+
+        for (int i = 0; i < (int)ARRAYSIZE(startupKinds); i++)
+        {
+            LatencyPercentiles a, w;
+            HookStatsGetLatency(HOOK_CREATEPROCESSA, startupKinds[i], a);
+            HookStatsGetLatency(HOOK_CREATEPROCESSW, startupKinds[i], w);
+            if (!a.count && !w.count)
+                return FinishResults(false, "No injected child's startup was recorded, for latency kind %d!", startupKinds[i]);
+        }
     }
 
-    printf("\nTEST PASS: Received the expected number of hook calls.\n");
-    printf("============================================================\n");
-    return true;
+    return FinishResults(true, "Received the expected number of hook calls.");
 }
 
 //---------------------------------------------------------------
 
-int main()
+int main(int argc, char *argv[])
 {
-    if (!InstallHooks())
+    // Launched as a benchmark child; nothing to do.
+    if (argc == 2 && !_stricmp(argv[1], BENCHMARK_CHILD_OPTION))
+        return 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!_stricmp(argv[i], "-allthreads"))
+            useAllThreads = true;
+        else if (!_stricmp(argv[i], "-eventlog") && i + 1 < argc)
+            eventLogFile = argv[++i];
+        else if (!_stricmp(argv[i], "-trace") && i + 1 < argc)
+            traceFile = argv[++i];
+        else if (!_stricmp(argv[i], "-telemetry"))
+            useTelemetry = true;
+        else if (!_stricmp(argv[i], "-job"))
+            useChildJob = true;
+        else if (!_stricmp(argv[i], "-lazy"))
+            useLazyInstall = true;
+        else if (!_stricmp(argv[i], "-exportcache") && i + 1 < argc)
+        {
+            if (!SetExportCacheDirectory(argv[++i]))
+                return -1;
+        }
+        else if (!_stricmp(argv[i], "-benchmark") && i + 2 < argc)
+        {
+            benchmarkLaunches = atoi(argv[++i]);
+            benchmarkThreads = atoi(argv[++i]);
+            if (benchmarkLaunches <= 0 || benchmarkThreads <= 0 || benchmarkThreads > MAX_BENCHMARK_THREADS)
+            {
+                printf("ERROR: -benchmark needs at least one launch, and 1 to %d threads!\n", MAX_BENCHMARK_THREADS);
+                return -1;
+            }
+        }
+        else if (!_stricmp(argv[i], "-dispatchbench") && i + 2 < argc)
+        {
+            dispatchBenchCalls = _atoi64(argv[++i]);
+            dispatchBenchThreads = atoi(argv[++i]);
+        }
+        else if (!_stricmp(argv[i], "-filter") && i + 1 < argc)
+        {
+            if (!SetLaunchFilter(argv[++i]))
+                return -1;
+        }
+        else if (!_stricmp(argv[i], "-setenv") && i + 1 < argc)
+        {
+            if (!SetLaunchEnvironment(argv[++i]))
+                return -1;
+        }
+        else if (!_stricmp(argv[i], "-rewrite") && i + 1 < argc)
+        {
+            if (!SetCommandLineRewrite(argv[++i]))
+                return -1;
+        }
+        else if ((!_stricmp(argv[i], "-sample") || !_stricmp(argv[i], "-sampletime")) && i + 1 < argc)
+        {
+            const int mode = !_stricmp(argv[i], "-sample") ? SAMPLE_ONE_IN_N : SAMPLE_INTERVAL;
+            const long rate = atol(argv[++i]);
+            if (rate <= 0 || !SetHookSampling(ALL_HOOKS, mode, (DWORD)rate))
+            {
+                printf("ERROR: Sampling rate \"%s\" is not valid!\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (!_stricmp(argv[i], "-hotswap"))
+            useHotSwap = true;
+        else if (!_stricmp(argv[i], "-profile"))
+            useInstallProfile = true;
+        else if (!_stricmp(argv[i], "-json") && i + 1 < argc)
+            SetJsonReportFile(argv[++i]);
+        else if (!_stricmp(argv[i], "-inject"))
+        {
+            SetChildInjection(true);
+            useInjection = true;
+        }
+        else
+        {
+            printf("ERROR: Unknown option \"%s\"!\n", argv[i]);
+            return -1;
+        }
+    }
+
+    // Each case attaches and detaches its own hook, so the pool
+    // shows whether the cycles reused the same region.
+    if (dispatchBenchCalls)
+    {
+        const bool ok = RunDispatchBenchmark(dispatchBenchCalls, dispatchBenchThreads);
+        StartReport();
+        ReportTrampolinePool();
+        FinishReport();
+        return ok ? 0 : -1;
+    }
+
+    if (useTelemetry)
+    {
+        if (!PublishTelemetry())
+            return -1;
+        printf("Publishing telemetry as \"%s%lu\".\n", TELEMETRY_NAME_PREFIX, GetCurrentProcessId());
+    }
+
+    if ((eventLogFile || traceFile || useTelemetry) && !StartEventLog(eventLogFile, traceFile))
+    {
+        UnpublishTelemetry();
+        return -1;
+    }
+
+    if (benchmarkLaunches && !RunBaselineBenchmark())
+    {
+        StopEventLog();
+        UnpublishTelemetry();
+        return -1;
+    }
+
+    if (useChildJob && !StartChildJob())
+    {
+        StopEventLog();
+        UnpublishTelemetry();
+        return -1;
+    }
+
+    DWORD installFlags = 0;
+    if (useAllThreads)
+        installFlags |= INSTALL_ALL_THREADS;
+    if (useLazyInstall)
+        installFlags |= INSTALL_LAZY;
+
+    // Most of kernel32's APIs are forwarded, so make sure the
+    // export index follows forwarders before relying on it.
+    if (!CheckForwardedExportLookup() || !InstallHooks(installFlags))
+    {
+        CloseChildJob();
+        StopEventLog();
+        UnpublishTelemetry();
+        return -1;
+    }
+
+    if (!StartReaper())
+    {
+        RemoveHooks();
+        CloseChildJob();
+        StopEventLog();
+        UnpublishTelemetry();
         return -1;
+    }
 
     int numAppsRun = 0;
 
     try
     {
-        numAppsRun = RunAppsForTesting();
+        numAppsRun = benchmarkLaunches ? RunHookedBenchmark() : RunAppsForTesting();
     }
     catch(...)
     {
+        StopReaper(0);
         RemoveHooks();
+        CloseChildJob();
+        StopEventLog();
+        UnpublishTelemetry();
         printf("ERROR: Program aborting due to exception!\n");
         return -1;
     }
 
+    if (useChildJob)
+        TearDownChildJob();
+
+    const ReaperStats reaperStats = StopReaper(REAPER_STOP_TIMEOUT_MS);
+    printf("Reaped %d of %d child process(es), %d still running.\n",
+        reaperStats.numReaped, reaperStats.numTracked, reaperStats.numAbandoned);
+
+    // The test apps have all started by now, so every injected
+    // child that is going to report its startup has, and the
+    // rest are lost.
+    CollectChildStartups(true);
+
     RemoveHooks();
-    if (!CheckResults(numAppsRun))
+    CloseChildJob();
+    StopEventLog();
+    if (eventLogFile)
+        printf("Wrote event log to \"%s\" (%lld events dropped, %lld strings not interned).\n",
+            eventLogFile, GetDroppedEventCount(), GetStringTableMissCount());
+    if (traceFile)
+        printf("Wrote trace to \"%s\"; convert it with traceread.exe.\n", traceFile);
+
+    const bool passed = numAppsRun >= 0 && CheckResults(numAppsRun);
+    UnpublishTelemetry();
+    if (!passed)
         return -1;
 
     return 0;
@@ -0,0 +1,301 @@
+//
+// dispatchbench.cpp
+//
+// Microbenchmark of the raw cost of calling through a detour.
+// See dispatchbench.h for a description.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <intrin.h>
+#include "dispatchbench.h"
+#include "hookregistry.h"
+
+// Function signature of the function we hook.
+typedef int (WINAPI * BENCHTARGETFUNC)(int);
+
+// Written by BenchTarget, so its body can't be optimized away.
+static volatile int benchSink = 0;
+
+//
+// The function the benchmark hooks.  It does just enough work
+// that Detours has room to patch in its jump.
+//
+static __declspec(noinline) int WINAPI BenchTarget(int value)
+{
+    benchSink = value;
+    return value + 1;
+}
+
+// Trampoline to the original BenchTarget, set while hooked.
+static BENCHTARGETFUNC PtrBenchTarget = BenchTarget;
+
+// The benchmark calls BenchTarget through this, so the compiler
+// can't inline the calls or hoist them out of the loop.
+static BENCHTARGETFUNC volatile CallBenchTarget = BenchTarget;
+
+// Counters for each of the hooks below.
+static volatile CHAR busy = 0;
+static long long lockedCount = 0;
+static volatile LONG64 interlockedCount = 0;
+static thread_local long long threadCount = 0;
+
+//
+// Counts the call under a spinlock, like the original hooks.
+//
+static int WINAPI SpinlockHook(int value)
+{
+    while (InterlockedExchange8(&busy, 1)) { /* Intentionally empty */ }
+    lockedCount++;
+    busy = 0;
+
+    return PtrBenchTarget(value);
+}
+
+//
+// Counts the call with an interlocked increment of a counter
+// shared by every thread.
+//
+static int WINAPI InterlockedHook(int value)
+{
+    InterlockedIncrement64(&interlockedCount);
+    return PtrBenchTarget(value);
+}
+
+//
+// Counts the call in the calling thread's own counter.
+//
+static int WINAPI PerThreadHook(int value)
+{
+    threadCount++;
+    return PtrBenchTarget(value);
+}
+
+// One case of the benchmark.
+struct DispatchCase
+{
+    const char *name;
+    PVOID       detour;          // Null to leave BenchTarget unhooked.
+};
+
+static const DispatchCase dispatchCases[] =
+{
+    { "Unhooked",          nullptr },
+    { "Spinlock count",    (PVOID)SpinlockHook },
+    { "Interlocked count", (PVOID)InterlockedHook },
+    { "Per-thread count",  (PVOID)PerThreadHook },
+};
+
+// State of one benchmark thread.
+struct DispatchThread
+{
+    HANDLE             thread;
+    long long          numCalls;     // Calls this thread is to make.
+    long long          ticks;        // QueryPerformanceCounter ticks they took.
+    unsigned long long cycles;       // Timestamp counter cycles they took,
+                                     // where there is one.
+    long long          threadCalls;  // What PerThreadHook counted.
+};
+
+// Mean time of one case.
+struct DispatchTiming
+{
+    double nanoseconds;  // Per call, or negative if the case failed.
+    double cycles;       // Per call, or 0 with no cycle counter.
+};
+
+#if defined(_M_IX86) || defined(_M_X64)
+#define DISPATCH_HAS_CYCLES 1
+
+//
+// Returns the CPU's timestamp counter.
+//
+static unsigned long long ReadCycles()
+{
+    return __rdtsc();
+}
+#else
+#define DISPATCH_HAS_CYCLES 0
+
+static unsigned long long ReadCycles()
+{
+    return 0;
+}
+#endif
+
+//
+// Returns the name of the architecture for an
+// IMAGE_FILE_MACHINE_* value.
+//
+static const char *GetMachineName(USHORT machine)
+{
+    switch (machine)
+    {
+    case IMAGE_FILE_MACHINE_I386:   return "x86";
+    case IMAGE_FILE_MACHINE_AMD64:  return "x64";
+    case IMAGE_FILE_MACHINE_ARM64:  return "ARM64";
+    default:                        return "unknown";
+    }
+}
+
+//
+// Returns the name of the architecture this DLL was built for.
+//
+static const char *GetBuildMachineName()
+{
+#if defined(_M_IX86)
+    return GetMachineName(IMAGE_FILE_MACHINE_I386);
+#elif defined(_M_X64)
+    return GetMachineName(IMAGE_FILE_MACHINE_AMD64);
+#elif defined(_M_ARM64)
+    return GetMachineName(IMAGE_FILE_MACHINE_ARM64);
+#else
+    return GetMachineName(IMAGE_FILE_MACHINE_UNKNOWN);
+#endif
+}
+
+// Set to release all of the threads at once.
+static HANDLE startEvent = nullptr;
+
+//
+// Entry point of each benchmark thread.
+//
+static DWORD WINAPI DispatchThreadProc(LPVOID param)
+{
+    DispatchThread &state = *(DispatchThread *)param;
+    WaitForSingleObject(startEvent, INFINITE);
+
+    LARGE_INTEGER startTime, endTime;
+    QueryPerformanceCounter(&startTime);
+    const unsigned long long startCycles = ReadCycles();
+    for (long long i = 0; i < state.numCalls; i++)
+        CallBenchTarget((int)i);
+    state.cycles = ReadCycles() - startCycles;
+    QueryPerformanceCounter(&endTime);
+    state.ticks = endTime.QuadPart - startTime.QuadPart;
+
+    state.threadCalls = threadCount;
+    threadCount = 0;
+    return 0;
+}
+
+//
+// Runs one case, and returns its mean time per call, which is
+// negative if it failed.
+//
+static DispatchTiming RunDispatchCase(const DispatchCase &test, long long numCalls, int numThreads)
+{
+    DispatchTiming timing = { -1, 0 };
+    HookEntry hook = { "BenchTarget", nullptr, (PVOID)BenchTarget, test.detour,
+                       &(PVOID &)PtrBenchTarget, test.detour != nullptr, false };
+    if (!AttachHookTable(&hook, 1) || (test.detour && !hook.attached))
+        return timing;
+
+    lockedCount = 0;
+    interlockedCount = 0;
+    ResetEvent(startEvent);
+
+    DispatchThread threads[MAX_DISPATCH_THREADS] = {0};
+    HANDLE threadHandles[MAX_DISPATCH_THREADS];
+    int numStarted = 0;
+    for (; numStarted < numThreads; numStarted++)
+    {
+        DispatchThread &state = threads[numStarted];
+        state.numCalls = numCalls / numThreads + (numStarted < numCalls % numThreads ? 1 : 0);
+        state.thread = CreateThread(nullptr, 0, DispatchThreadProc, &state, 0, nullptr);
+        if (!state.thread)
+        {
+            printf("ERROR: Failed creating benchmark thread (error %lu)!\n", GetLastError());
+            break;
+        }
+        threadHandles[numStarted] = state.thread;
+    }
+
+    SetEvent(startEvent);
+    if (numStarted > 0)
+        WaitForMultipleObjects(numStarted, threadHandles, TRUE, INFINITE);
+
+    DetachHookTable(&hook, 1);
+
+    unsigned long long cycles = 0;
+    long long ticks = 0;
+    long long numCounted = lockedCount + interlockedCount;
+    for (int i = 0; i < numStarted; i++)
+    {
+        cycles += threads[i].cycles;
+        ticks += threads[i].ticks;
+        numCounted += threads[i].threadCalls;
+        CloseHandle(threads[i].thread);
+    }
+
+    if (numStarted < numThreads)
+        return timing;
+
+    // Every case but the baseline should have counted every call,
+    // or the counting isn't thread-safe.
+    if (test.detour && numCounted != numCalls)
+    {
+        printf("ERROR: %s hook counted %lld calls, expected %lld!\n", test.name, numCounted, numCalls);
+        return timing;
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    timing.nanoseconds = (double)ticks * 1000000000.0 / (double)frequency.QuadPart / numCalls;
+    timing.cycles = (double)cycles / numCalls;
+    return timing;
+}
+
+bool RunDispatchBenchmark(long long numCalls, int numThreads)
+{
+    if (numCalls <= 0 || numThreads <= 0 || numThreads > MAX_DISPATCH_THREADS)
+    {
+        printf("ERROR: Dispatch benchmark needs at least one call, and 1 to %d threads!\n", MAX_DISPATCH_THREADS);
+        return false;
+    }
+
+    startEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (!startEvent)
+    {
+        printf("ERROR: Failed creating benchmark event (error %lu)!\n", GetLastError());
+        return false;
+    }
+
+    // An x86 build may be running under WOW64, on x64 or ARM64.
+    USHORT processMachine, nativeMachine;
+    const char *buildMachine = GetBuildMachineName();
+    const char *machine = buildMachine;
+    if (IsWow64Process2(GetCurrentProcess(), &processMachine, &nativeMachine) &&
+        processMachine != IMAGE_FILE_MACHINE_UNKNOWN)
+        machine = GetMachineName(nativeMachine);
+
+    if (strcmp(machine, buildMachine))
+        printf("Dispatch benchmark (%s on %s): %lld calls from %d thread(s).\n", buildMachine, machine, numCalls, numThreads);
+    else
+        printf("Dispatch benchmark (%s): %lld calls from %d thread(s).\n", buildMachine, numCalls, numThreads);
+
+    bool ok = true;
+    DispatchTiming baseline = { 0, 0 };
+    for (int i = 0; i < (int)ARRAYSIZE(dispatchCases); i++)
+    {
+        const DispatchTiming timing = RunDispatchCase(dispatchCases[i], numCalls, numThreads);
+        if (timing.nanoseconds < 0)
+        {
+            ok = false;
+            break;
+        }
+
+        if (!dispatchCases[i].detour)
+            baseline = timing;
+        printf("* %-18s %8.2f ns/call  %+8.2f over unhooked",
+            dispatchCases[i].name, timing.nanoseconds, timing.nanoseconds - baseline.nanoseconds);
+#if DISPATCH_HAS_CYCLES
+        printf("  %8.1f cycles/call  %+8.1f over unhooked", timing.cycles, timing.cycles - baseline.cycles);
+#endif
+        printf("\n");
+    }
+
+    CloseHandle(startEvent);
+    startEvent = nullptr;
+    return ok;
+}
@@ -0,0 +1,51 @@
+//
+// dispatchbench.h
+//
+// Microbenchmark of the raw cost of calling through a detour.
+//
+// The process launch benchmark (benchmark.h) measures the hooks
+// the way they're really used, but the cost of the detour
+// itself is lost in the noise of creating a process.  This
+// instead hooks a trivial function in this DLL, with the same
+// AttachHookTable call InstallHooks uses, and calls it many
+// times from several threads.  It times each of these cases:
+//
+//   * The function unhooked, as a baseline.
+//   * A hook that counts calls under a spinlock, the way the
+//     hooks originally did.
+//   * A hook that counts calls with one interlocked increment
+//     of a shared counter.
+//   * A hook that counts calls in a per-thread counter, the way
+//     hookstats.cpp does.
+//
+// Each is reported in nanoseconds per call, timed with
+// QueryPerformanceCounter, and as nanoseconds over the unhooked
+// baseline, so it can be rerun after changes to the hooks as a
+// regression check.  On x86 and x64 it is also reported in
+// cycles of the CPU's timestamp counter; ARM64 has no cycle
+// counter readable from user mode, so there it is only timed.
+//
+// Detours patches each architecture with different code (a
+// JMP on x86 and x64, a branch through a register on ARM64),
+// so the results are headed with the architecture the DLL was
+// built for, and the machine's own architecture if that's
+// different, as for an x86 build running under WOW64.  Build
+// and run it for each with NMAKE bench (see the makefile) to
+// compare them.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Most threads a dispatch benchmark run can use.
+#define MAX_DISPATCH_THREADS    MAXIMUM_WAIT_OBJECTS
+
+// Runs every case of the dispatch benchmark with numCalls calls
+// split across numThreads threads, and prints the results.
+// Must not run while hooks are being installed or removed,
+// since Detours handles one transaction at a time.  Returns
+// true if successful.
+HOOKDLL_API bool RunDispatchBenchmark(long long numCalls, int numThreads);
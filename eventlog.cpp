@@ -0,0 +1,385 @@
+//
+// eventlog.cpp
+//
+// Lock-free log of intercepted process launches.
+// See eventlog.h for a description.
+//
+// The ring is a bounded multi-producer queue: each cell has a
+// sequence number that tells whether it is free for the
+// producer at a given position, or holds a record ready for
+// the consumer at that position (see telemetry.h).  Producers
+// claim positions by compare-exchange on the shared write
+// position, and only the drain thread ever hands cells back.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "eventlog.h"
+#include "hookstats.h"
+#include "stringtable.h"
+#include "telemetry.h"
+#include "tracefile.h"
+
+// How often the drain thread wakes up to write out events, in
+// milliseconds.  The hooks never signal it, since that would
+// cost a system call on every launch.
+#define DRAIN_INTERVAL_MS 50
+
+// The ring.  This is normally in our own data, but moves into
+// shared memory if telemetry is published.
+static TelemetryEventRing localEventRing;
+static TelemetryEventRing *eventRing = &localEventRing;
+
+// Next position the drain thread will write out, and the next
+// one it will hand back to producers.  Drained events are kept
+// in the ring until they are half a ring old, so readers of the
+// shared-memory telemetry can still see them.
+static LONG64 writtenPosition = 0;
+static LONG64 readPosition = 0;
+
+static volatile LONG64 droppedEvents = 0;
+static volatile LONG loggingEnabled = 0;
+
+static FILE *logFile = nullptr;
+static bool tracing = false;
+static HANDLE drainThread = nullptr;
+static HANDLE stopEvent = nullptr;
+static long long logStartTime = 0;
+static double microsecondsPerTick = 0.0;
+
+// Which interned strings have been written to the log file, by
+// ID.  Only the drain thread touches this.
+static bool stringWritten[STRING_TABLE_SIZE + 1];
+
+//
+// Writes an interned string to the log file, if it hasn't been
+// written already, so that the events that follow can refer to
+// it by ID.
+//
+static void WriteStringRecord(DWORD id)
+{
+    if (!id || id > STRING_TABLE_SIZE || stringWritten[id])
+        return;
+
+    InternedString string;
+    if (!GetInternedString(id, string))
+        return;
+
+    if (string.wide)
+        fprintf(logFile, "S\t%lu\t\"%.*S\"\n", id, (int)string.length, (const WCHAR *)string.chars);
+    else
+        fprintf(logFile, "S\t%lu\t\"%.*s\"\n", id, (int)string.length, (const char *)string.chars);
+    stringWritten[id] = true;
+}
+
+//
+// Writes one event to the log file as a line of text, preceded
+// by any strings it refers to that haven't been written yet.
+// Interned strings are written as @ and their ID.
+//
+static void WriteEvent(const LaunchEvent &event)
+{
+    const double time = (double)(event.timestamp - logStartTime) * microsecondsPerTick;
+    const double apiTime = (double)event.apiTicks * microsecondsPerTick;
+
+    WriteStringRecord(event.appNameId);
+    WriteStringRecord(event.programId);
+
+    fprintf(logFile, "E\t%.1f\t%lu\t%s\t%.1f\t%d\t%lu\t%lu\t0x%08lX\t",
+        time, event.threadId, GetHookName(event.hookId), apiTime,
+        event.result, event.error, event.processId, event.creationFlags);
+
+    if (event.appNameId)
+        fprintf(logFile, "@%lu\t", event.appNameId);
+    else if (event.wide)
+        fprintf(logFile, "\"%S\"\t", event.appName.w);
+    else
+        fprintf(logFile, "\"%s\"\t", event.appName.a);
+
+    if (event.programId)
+        fprintf(logFile, "@%lu", event.programId);
+
+    if (event.wide)
+        fprintf(logFile, "\t\"%S\"\n", event.commandLine.w);
+    else
+        fprintf(logFile, "\t\"%s\"\n", event.commandLine.a);
+}
+
+//
+// Writes out every event that is ready in the ring, then hands
+// back to producers the cells that are more than half a ring
+// behind the write position.  If final is true, no more events
+// are coming, so nothing needs handing back.  Only the drain
+// thread calls this.
+//
+static void DrainEvents(bool final)
+{
+    for (;;)
+    {
+        TelemetryEventCell &cell = eventRing->cells[writtenPosition & (EVENT_RING_SIZE - 1)];
+        if (ReadAcquire64(&cell.sequence) != writtenPosition + 1)
+            break;
+
+        if (logFile)
+            WriteEvent(cell.event);
+        if (tracing)
+            WriteTraceEvent(cell.event);
+        writtenPosition++;
+    }
+
+    if (logFile)
+        fflush(logFile);
+
+    if (final)
+        return;
+
+    const LONG64 keepFrom = ReadNoFence64(&eventRing->writePosition) - EVENT_RING_SIZE / 2;
+    while (readPosition < writtenPosition && readPosition < keepFrom)
+    {
+        TelemetryEventCell &cell = eventRing->cells[readPosition & (EVENT_RING_SIZE - 1)];
+        WriteRelease64(&cell.sequence, readPosition + EVENT_RING_SIZE);
+        readPosition++;
+    }
+}
+
+//
+// Body of the background thread that writes out events.
+//
+static DWORD WINAPI DrainThreadProc(LPVOID)
+{
+    while (WaitForSingleObject(stopEvent, DRAIN_INTERVAL_MS) == WAIT_TIMEOUT)
+        DrainEvents(false);
+
+    DrainEvents(true);
+    return 0;
+}
+
+bool StartEventLog(const char *filename, const char *traceFilename)
+{
+    if (drainThread)
+        return true;
+
+    if (filename)
+    {
+        if (fopen_s(&logFile, filename, "w") != 0 || !logFile)
+        {
+            printf("ERROR: Failed opening event log \"%s\"!\n", filename);
+            logFile = nullptr;
+            return false;
+        }
+
+        fprintf(logFile, "record\ttime_us\tthread\tapi\tapi_us\tresult\terror\tpid\tflags\tapplication\tprogram\targuments\n");
+    }
+
+    memset(stringWritten, 0, sizeof(stringWritten));
+
+    for (LONG64 i = 0; i < EVENT_RING_SIZE; i++)
+        eventRing->cells[i].sequence = i;
+    eventRing->writePosition = 0;
+    writtenPosition = 0;
+    readPosition = 0;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    microsecondsPerTick = 1000000.0 / (double)frequency.QuadPart;
+    logStartTime = HookStatsReadTimestamp();
+
+    tracing = traceFilename && OpenTraceFile(traceFilename, logStartTime);
+    if (traceFilename && !tracing)
+    {
+        if (logFile)
+            fclose(logFile);
+        logFile = nullptr;
+        return false;
+    }
+
+    stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    drainThread = stopEvent ? CreateThread(nullptr, 0, DrainThreadProc, nullptr, 0, nullptr) : nullptr;
+    if (!drainThread)
+    {
+        printf("ERROR: Failed starting event log thread!\n");
+        if (stopEvent)
+            CloseHandle(stopEvent);
+        stopEvent = nullptr;
+        if (tracing)
+            CloseTraceFile();
+        tracing = false;
+        if (logFile)
+            fclose(logFile);
+        logFile = nullptr;
+        return false;
+    }
+
+    InterlockedExchange(&loggingEnabled, 1);
+    return true;
+}
+
+void StopEventLog()
+{
+    if (!drainThread)
+        return;
+
+    // A hook that reserved a record just before this may commit
+    // it after the drain thread's final pass, in which case that
+    // record is simply never written out.
+    InterlockedExchange(&loggingEnabled, 0);
+    SetEvent(stopEvent);
+    WaitForSingleObject(drainThread, INFINITE);
+
+    CloseHandle(drainThread);
+    CloseHandle(stopEvent);
+    drainThread = nullptr;
+    stopEvent = nullptr;
+
+    if (logFile)
+        fclose(logFile);
+    logFile = nullptr;
+
+    if (tracing)
+        CloseTraceFile();
+    tracing = false;
+}
+
+void EventLogSetStorage(TelemetryEventRing *ring)
+{
+    eventRing = ring ? ring : &localEventRing;
+}
+
+bool EventLogEnabled()
+{
+    return ReadNoFence(&loggingEnabled) != 0;
+}
+
+LaunchEvent *ReserveLaunchEvent()
+{
+    if (!EventLogEnabled())
+        return nullptr;
+
+    LONG64 position = ReadNoFence64(&eventRing->writePosition);
+    for (;;)
+    {
+        TelemetryEventCell &cell = eventRing->cells[position & (EVENT_RING_SIZE - 1)];
+        const LONG64 difference = ReadAcquire64(&cell.sequence) - position;
+        if (difference == 0)
+        {
+            const LONG64 seen = InterlockedCompareExchange64(&eventRing->writePosition, position + 1, position);
+            if (seen == position)
+            {
+                cell.position = position;
+                return &cell.event;
+            }
+            position = seen;
+        }
+        else if (difference < 0)
+        {
+            // The drain thread hasn't caught up; drop the event
+            // rather than wait for it.
+            InterlockedIncrement64(&droppedEvents);
+            return nullptr;
+        }
+        else
+            position = ReadNoFence64(&eventRing->writePosition);
+    }
+}
+
+void CommitLaunchEvent(LaunchEvent *event)
+{
+    if (!event)
+        return;
+
+    TelemetryEventCell *cell = CONTAINING_RECORD(event, TelemetryEventCell, event);
+    WriteRelease64(&cell->sequence, cell->position + 1);
+}
+
+//
+// Copies a string into a fixed-size buffer, truncating and
+// terminating it.
+//
+template <typename CharT, size_t N>
+static void CopyEventString(CharT (&dest)[N], const CharT *src)
+{
+    size_t i = 0;
+    if (src)
+    {
+        for (; i < N - 1 && src[i]; i++)
+            dest[i] = src[i];
+    }
+    dest[i] = 0;
+}
+
+//
+// Returns the length of a string, but stops counting once it is
+// too long to intern.
+//
+template <typename CharT>
+static size_t BoundedLength(const CharT *s)
+{
+    size_t length = 0;
+    while (length <= STRING_MAX_CHARS && s[length])
+        length++;
+    return length;
+}
+
+//
+// Returns the length of the program at the start of a command
+// line: up to the closing quote if it's quoted, or else up to
+// the first space or tab.
+//
+template <typename CharT>
+static size_t ProgramNameLength(const CharT *commandLine)
+{
+    size_t length = 0;
+    if (commandLine[0] == '"')
+    {
+        for (length = 1; commandLine[length] && commandLine[length] != '"'; length++)
+            ;
+        if (commandLine[length] == '"')
+            length++;
+        return length;
+    }
+
+    while (commandLine[length] && commandLine[length] != ' ' && commandLine[length] != '\t')
+        length++;
+    return length;
+}
+
+//
+// Does the work of SetLaunchEventStrings for either kind of
+// string.  The arguments are kept exactly as they were, with
+// their leading space, so the program and the arguments put
+// together give back the original command line.
+//
+template <typename CharT, size_t AppN, size_t CmdN>
+static void SetEventStrings(LaunchEvent *event, CharT (&appNameOut)[AppN], CharT (&commandLineOut)[CmdN],
+                            const CharT *appName, const CharT *commandLine)
+{
+    event->appNameId = appName ? InternString(appName, BoundedLength(appName)) : 0;
+    CopyEventString(appNameOut, event->appNameId ? nullptr : appName);
+
+    event->programId = 0;
+    if (commandLine)
+    {
+        const size_t programLength = ProgramNameLength(commandLine);
+        event->programId = InternString(commandLine, programLength);
+        if (event->programId)
+            commandLine += programLength;
+    }
+    CopyEventString(commandLineOut, commandLine);
+}
+
+void SetLaunchEventStrings(LaunchEvent *event, const char *appName, const char *commandLine)
+{
+    event->wide = false;
+    SetEventStrings(event, event->appName.a, event->commandLine.a, appName, commandLine);
+}
+
+void SetLaunchEventStrings(LaunchEvent *event, const WCHAR *appName, const WCHAR *commandLine)
+{
+    event->wide = true;
+    SetEventStrings(event, event->appName.w, event->commandLine.w, appName, commandLine);
+}
+
+long long GetDroppedEventCount()
+{
+    return InterlockedCompareExchange64(&droppedEvents, 0, 0);
+}
@@ -0,0 +1,107 @@
+//
+// eventlog.h
+//
+// Lock-free log of the process launches our hooks intercept.
+//
+// The hooks write each launch into a preallocated record in a
+// fixed-size ring buffer.  Any number of threads can write at
+// once, and none of them ever allocates memory, takes a lock,
+// or does any I/O.  If the ring is full the event is dropped
+// and counted, rather than making the hooked call wait.  A
+// background thread drains the ring and writes the records to
+// a text file, a binary trace file, or both.  The ring can also
+// be published in shared memory; see telemetry.h.
+//
+// To keep the records small, the application name and the
+// program at the start of the command line are interned (see
+// stringtable.h), and an event only carries their IDs plus the
+// arguments that follow the program.  The log file then gets
+// each string once, the first time an event refers to it.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Longest application name and command-line arguments kept in
+// an event, in characters.  Longer strings are truncated.  The
+// application name is only kept in the event if it couldn't be
+// interned.
+#define EVENT_MAX_APPNAME   64
+#define EVENT_MAX_CMDLINE   160
+
+// Number of records in the ring buffer.  Must be a power of two.
+#define EVENT_RING_SIZE     1024
+
+// One intercepted process launch.
+struct LaunchEvent
+{
+    long long timestamp;     // QueryPerformanceCounter value at hook entry.
+    long long apiTicks;      // Time spent in the original API.
+    int       hookId;        // Which hook made the call (see HookId).
+    DWORD     threadId;      // Thread that made the call.
+    DWORD     creationFlags; // dwCreationFlags passed to the API.
+    BOOL      result;        // Value the API returned.
+    DWORD     error;         // GetLastError value if the API failed.
+    DWORD     processId;     // Process ID of the child, if created.
+    bool      wide;          // True if the strings are WCHAR.
+    DWORD     appNameId;     // Interned application name, or zero if
+                             // it is in appName instead.
+    DWORD     programId;     // Interned program at the start of the
+                             // command line, or zero if the whole
+                             // command line is in commandLine.
+
+    union
+    {
+        char  a[EVENT_MAX_APPNAME];
+        WCHAR w[EVENT_MAX_APPNAME];
+    } appName;
+
+    union
+    {
+        char  a[EVENT_MAX_CMDLINE];
+        WCHAR w[EVENT_MAX_CMDLINE];
+    } commandLine;
+};
+
+struct TelemetryEventRing;
+
+// Moves the ring into the given storage (see telemetry.h), or
+// back to our own data if null.  Only call this while the event
+// log is stopped.
+HOOKDLL_API void EventLogSetStorage(TelemetryEventRing *ring);
+
+// Starts the background thread that writes events to the given
+// text file, and to the given binary trace file (see
+// tracefile.h), and begins accepting events.  If both are null,
+// the events are only kept in the ring, for readers of the
+// shared-memory telemetry.  Returns true if successful.
+HOOKDLL_API bool StartEventLog(const char *filename, const char *traceFilename = nullptr);
+
+// Stops accepting events, writes out any that are left in the
+// ring, and stops the background thread.
+HOOKDLL_API void StopEventLog();
+
+// Returns true if events are being logged.
+HOOKDLL_API bool EventLogEnabled();
+
+// Reserves the next free record in the ring for the calling
+// thread to fill in.  Returns null if logging is disabled or
+// the ring is full.  Every reserved record must be passed to
+// CommitLaunchEvent.
+HOOKDLL_API LaunchEvent *ReserveLaunchEvent();
+
+// Publishes a record filled in after ReserveLaunchEvent, so the
+// background thread can write it out.
+HOOKDLL_API void CommitLaunchEvent(LaunchEvent *event);
+
+// Interns the launch strings and copies whatever isn't interned
+// into an event, truncating it if necessary.  Either string may
+// be null.
+HOOKDLL_API void SetLaunchEventStrings(LaunchEvent *event, const char *appName, const char *commandLine);
+HOOKDLL_API void SetLaunchEventStrings(LaunchEvent *event, const WCHAR *appName, const WCHAR *commandLine);
+
+// Returns the number of events dropped because the ring was full.
+HOOKDLL_API long long GetDroppedEventCount();
@@ -0,0 +1,520 @@
+//
+// exportindex.cpp
+//
+// Fast lookup of exported functions by name.  See exportindex.h
+// for a description.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include "exportindex.h"
+
+#define EXPORT_INDEX_MAGIC      0x58444945UL  // "EIDX"
+#define EXPORT_INDEX_VERSION    2
+
+// Most modules we keep an index for at once.  Lookups in any
+// further modules go straight to GetProcAddress.
+#define MAX_INDEXED_MODULES     64
+
+// Most slots an index can have, which is enough for a module
+// with half a million named exports.  A module with more isn't
+// indexed.
+#define MAX_EXPORT_SLOTS        (1024 * 1024)
+
+// One slot in a module's hash table.  Exports never have an RVA
+// of zero, so that marks an empty slot.
+struct ExportSlot
+{
+    DWORD hash;          // HashExportName of the name.
+    DWORD rva;           // RVA of the function, or of the forwarder
+                         // string if the export is forwarded.
+    DWORD nameOffset;    // Offset of the name in the names buffer.
+};
+
+// Start of a cached index file, followed by the slots and then
+// the names.  The module fields identify the exact build of the
+// module the index was made from.
+struct ExportIndexFileHeader
+{
+    DWORD magic;         // EXPORT_INDEX_MAGIC.
+    DWORD version;       // EXPORT_INDEX_VERSION.
+    DWORD timeDateStamp; // Module's link timestamp.
+    DWORD checkSum;      // Module's image checksum.
+    DWORD sizeOfImage;   // Module's image size.
+    DWORD numSlots;      // Number of ExportSlots.
+    DWORD namesSize;     // Size of the names, in bytes.
+};
+
+// The index of one module's exports.
+struct ModuleExportIndex
+{
+    HMODULE     module;
+    DWORD       exportStart;     // RVA range of the export directory,
+    DWORD       exportEnd;       // where forwarder strings live.
+    DWORD       numSlots;        // Always a power of two.
+    ExportSlot *slots;
+    char       *names;           // Every export's name, null-terminated.
+    DWORD       namesSize;
+};
+
+// Modules we have indexed so far.
+static ModuleExportIndex moduleIndexes[MAX_INDEXED_MODULES] = {0};
+static int numModuleIndexes = 0;
+
+// Directory for cached index files, or empty if off.
+static char exportCacheDirectory[MAX_PATH] = {0};
+
+// Identifies the build of a loaded module.
+struct ModuleImageInfo
+{
+    DWORD timeDateStamp;
+    DWORD checkSum;
+    DWORD sizeOfImage;
+    DWORD exportStart;
+    DWORD exportEnd;
+    DWORD numNames;      // Named exports, as the directory counts them.
+};
+
+// Collects the exports while walking a module's export table.
+// On the first walk only the counts are taken; on the second
+// the exports are added to the index.
+struct ExportWalk
+{
+    ModuleExportIndex *index;
+    HMODULE            module;
+    DWORD              numExports;
+    DWORD              namesSize;
+};
+
+//
+// Returns the FNV-1a hash of an export name.
+//
+static DWORD HashExportName(const char *name)
+{
+    DWORD hash = 2166136261UL;
+    for (; *name; name++)
+    {
+        hash ^= (BYTE)*name;
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
+//
+// Reads the parts of a loaded module's PE headers that identify
+// it and locate its export directory.  Returns false if the
+// module doesn't look like a PE image.
+//
+static bool GetModuleImageInfo(HMODULE module, ModuleImageInfo &info)
+{
+    const BYTE *base = (const BYTE *)module;
+    const IMAGE_DOS_HEADER *dosHeader = (const IMAGE_DOS_HEADER *)base;
+    if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+        return false;
+
+    const IMAGE_NT_HEADERS *ntHeaders = (const IMAGE_NT_HEADERS *)(base + dosHeader->e_lfanew);
+    if (ntHeaders->Signature != IMAGE_NT_SIGNATURE)
+        return false;
+
+    const IMAGE_DATA_DIRECTORY &exports =
+        ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+    info.timeDateStamp = ntHeaders->FileHeader.TimeDateStamp;
+    info.checkSum = ntHeaders->OptionalHeader.CheckSum;
+    info.sizeOfImage = ntHeaders->OptionalHeader.SizeOfImage;
+    info.exportStart = 0;
+    info.exportEnd = 0;
+    info.numNames = 0;
+
+    // An export directory that doesn't fit in the image is
+    // treated as no exports at all.
+    if (exports.VirtualAddress && exports.Size >= sizeof(IMAGE_EXPORT_DIRECTORY) &&
+        exports.VirtualAddress < info.sizeOfImage && exports.Size <= info.sizeOfImage - exports.VirtualAddress)
+    {
+        info.exportStart = exports.VirtualAddress;
+        info.exportEnd = exports.VirtualAddress + exports.Size;
+        info.numNames = ((const IMAGE_EXPORT_DIRECTORY *)(base + info.exportStart))->NumberOfNames;
+    }
+    return true;
+}
+
+//
+// Returns the number of slots an index needs for the given
+// number of exports: a power of two, at least 16, at most half
+// full.  Returns 0 if that would be more than MAX_EXPORT_SLOTS.
+//
+static DWORD GetIndexSlotCount(DWORD numExports)
+{
+    if (numExports > MAX_EXPORT_SLOTS / 2)
+        return 0;
+
+    DWORD numSlots = 16;
+    while (numSlots < numExports * 2)
+        numSlots *= 2;
+    return numSlots;
+}
+
+//
+// Adds an export to an index's hash table, which must have room.
+//
+static void InsertExport(ModuleExportIndex &index, DWORD hash, DWORD rva, DWORD nameOffset)
+{
+    const DWORD mask = index.numSlots - 1;
+    DWORD slot = hash & mask;
+    while (index.slots[slot].rva)
+        slot = (slot + 1) & mask;
+
+    index.slots[slot].hash = hash;
+    index.slots[slot].rva = rva;
+    index.slots[slot].nameOffset = nameOffset;
+}
+
+//
+// Walks the named exports of a module, counting them or adding
+// them to the index.  The export directory is read directly,
+// rather than with DetourEnumerateExports, which skips forwarded
+// exports: their RVA is that of the forwarder string, so they go
+// in the index too, and FindExportByName follows them.  Exports
+// by ordinal only can't be looked up by name, so they're left
+// out.
+//
+static void WalkExports(ExportWalk &walk, DWORD exportStart, DWORD exportEnd)
+{
+    if (!exportStart || exportEnd - exportStart < sizeof(IMAGE_EXPORT_DIRECTORY))
+        return;
+
+    const BYTE *base = (const BYTE *)walk.module;
+    const IMAGE_EXPORT_DIRECTORY *directory = (const IMAGE_EXPORT_DIRECTORY *)(base + exportStart);
+    const DWORD *functions = (const DWORD *)(base + directory->AddressOfFunctions);
+    const DWORD *names = (const DWORD *)(base + directory->AddressOfNames);
+    const WORD *ordinals = (const WORD *)(base + directory->AddressOfNameOrdinals);
+
+    for (DWORD i = 0; i < directory->NumberOfNames; i++)
+    {
+        if (ordinals[i] >= directory->NumberOfFunctions)
+            continue;
+
+        const DWORD rva = functions[ordinals[i]];
+        if (!rva)
+            continue;
+
+        const char *name = (const char *)(base + names[i]);
+        const DWORD nameSize = (DWORD)strlen(name) + 1;
+        if (walk.index)
+        {
+            memcpy(walk.index->names + walk.namesSize, name, nameSize);
+            InsertExport(*walk.index, HashExportName(name), rva, walk.namesSize);
+        }
+
+        walk.numExports++;
+        walk.namesSize += nameSize;
+    }
+}
+
+//
+// Allocates the empty slots and the names of an index.  This can
+// run in DllMain, so running out of memory just fails the index.
+// Returns false, with nothing allocated, if there isn't room.
+//
+static bool AllocateIndex(ModuleExportIndex &index, DWORD numSlots, DWORD namesSize)
+{
+    index.slots = new (std::nothrow) ExportSlot[numSlots];
+    index.names = new (std::nothrow) char[namesSize ? namesSize : 1];
+    if (!index.slots || !index.names)
+    {
+        delete [] index.slots;
+        delete [] index.names;
+        index.slots = nullptr;
+        index.names = nullptr;
+        return false;
+    }
+
+    memset(index.slots, 0, numSlots * sizeof(ExportSlot));
+    index.numSlots = numSlots;
+    index.namesSize = namesSize;
+    return true;
+}
+
+//
+// Frees the slots and names of an index.
+//
+static void FreeIndex(ModuleExportIndex &index)
+{
+    delete [] index.slots;
+    delete [] index.names;
+    index.slots = nullptr;
+    index.names = nullptr;
+    index.numSlots = 0;
+    index.namesSize = 0;
+}
+
+//
+// Builds an index by walking the module's export table.
+//
+static bool BuildIndex(ModuleExportIndex &index)
+{
+    ExportWalk walk = {0};
+    walk.module = index.module;
+    WalkExports(walk, index.exportStart, index.exportEnd);
+
+    const DWORD numSlots = GetIndexSlotCount(walk.numExports);
+    if (!numSlots || !AllocateIndex(index, numSlots, walk.namesSize))
+        return false;
+
+    walk.index = &index;
+    walk.numExports = 0;
+    walk.namesSize = 0;
+    WalkExports(walk, index.exportStart, index.exportEnd);
+    return true;
+}
+
+//
+// Builds the name of the cache file for a module.  Returns false
+// if the cache is off.
+//
+static bool GetCacheFileName(HMODULE module, const ModuleImageInfo &info, char *path, size_t pathSize)
+{
+    if (!exportCacheDirectory[0])
+        return false;
+
+    char modulePath[MAX_PATH];
+    if (!GetModuleFileNameA(module, modulePath, sizeof(modulePath)))
+        return false;
+
+    const char *moduleName = strrchr(modulePath, '\\');
+    moduleName = moduleName ? moduleName + 1 : modulePath;
+
+    return _snprintf_s(path, pathSize, _TRUNCATE, "%s\\%s_%08lX_%08lX_%08lX.exports",
+        exportCacheDirectory, moduleName, info.timeDateStamp, info.checkSum, info.sizeOfImage) > 0;
+}
+
+//
+// Reads exactly the given number of bytes from a file.
+//
+static bool ReadFully(HANDLE file, void *buffer, DWORD size)
+{
+    DWORD bytesRead = 0;
+    return ReadFile(file, buffer, size, &bytesRead, nullptr) && bytesRead == size;
+}
+
+//
+// Writes exactly the given number of bytes to a file.
+//
+static bool WriteFully(HANDLE file, const void *buffer, DWORD size)
+{
+    DWORD bytesWritten = 0;
+    return WriteFile(file, buffer, size, &bytesWritten, nullptr) && bytesWritten == size;
+}
+
+//
+// Checks the slots of an index loaded from the cache, so a
+// corrupt or stale file can't hand out a target outside the
+// module or a name outside the names: every entry's RVA must be
+// inside the image and its name inside the names, there can't
+// be more entries than the module has named exports, and at
+// least one slot must be empty, or a lookup that misses would
+// probe forever.
+//
+static bool CheckCachedSlots(const ModuleExportIndex &index, const ModuleImageInfo &info)
+{
+    DWORD numUsed = 0;
+    for (DWORD i = 0; i < index.numSlots; i++)
+    {
+        const ExportSlot &slot = index.slots[i];
+        if (!slot.rva)
+            continue;
+
+        if (slot.rva >= info.sizeOfImage || slot.nameOffset >= index.namesSize)
+            return false;
+        numUsed++;
+    }
+
+    return numUsed <= info.numNames && numUsed < index.numSlots;
+}
+
+//
+// Loads an index from the cache, if there is a cached index for
+// this exact build of the module.  The header's sizes are held
+// to what the module itself could need: no more slots than an
+// index built for its named exports, and no more names than fit
+// in its image.
+//
+static bool LoadCachedIndex(ModuleExportIndex &index, const ModuleImageInfo &info)
+{
+    char path[MAX_PATH];
+    if (!GetCacheFileName(index.module, info, path, sizeof(path)))
+        return false;
+
+    const HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    ExportIndexFileHeader header;
+    bool ok = ReadFully(file, &header, sizeof(header)) &&
+              header.magic == EXPORT_INDEX_MAGIC &&
+              header.version == EXPORT_INDEX_VERSION &&
+              header.timeDateStamp == info.timeDateStamp &&
+              header.checkSum == info.checkSum &&
+              header.sizeOfImage == info.sizeOfImage &&
+              header.numSlots >= 16 &&
+              (header.numSlots & (header.numSlots - 1)) == 0 &&
+              header.numSlots <= GetIndexSlotCount(info.numNames) &&
+              header.namesSize <= info.sizeOfImage;
+    if (ok && AllocateIndex(index, header.numSlots, header.namesSize))
+    {
+        ok = ReadFully(file, index.slots, header.numSlots * (DWORD)sizeof(ExportSlot)) &&
+             ReadFully(file, index.names, header.namesSize) &&
+             CheckCachedSlots(index, info);
+        if (ok && header.namesSize)
+            index.names[header.namesSize - 1] = '\0';
+        if (!ok)
+            FreeIndex(index);
+    }
+    else
+        ok = false;
+
+    CloseHandle(file);
+    return ok;
+}
+
+//
+// Saves an index to the cache, if the cache is on.  Failing to
+// save just means the next run builds the index again.
+//
+static void SaveCachedIndex(const ModuleExportIndex &index, const ModuleImageInfo &info)
+{
+    char path[MAX_PATH];
+    if (!GetCacheFileName(index.module, info, path, sizeof(path)))
+        return;
+
+    const HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, nullptr,
+                                    CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+
+    ExportIndexFileHeader header = {0};
+    header.magic = EXPORT_INDEX_MAGIC;
+    header.version = EXPORT_INDEX_VERSION;
+    header.timeDateStamp = info.timeDateStamp;
+    header.checkSum = info.checkSum;
+    header.sizeOfImage = info.sizeOfImage;
+    header.numSlots = index.numSlots;
+    header.namesSize = index.namesSize;
+
+    const bool ok = WriteFully(file, &header, sizeof(header)) &&
+                    WriteFully(file, index.slots, index.numSlots * sizeof(ExportSlot)) &&
+                    WriteFully(file, index.names, index.namesSize);
+    CloseHandle(file);
+
+    // Don't leave a partial file for the next run to reject.
+    if (!ok)
+        DeleteFileA(path);
+}
+
+//
+// Returns the index for a module, building it (or loading it
+// from the cache) the first time.  Returns null if the module
+// can't be indexed.
+//
+static const ModuleExportIndex *GetModuleIndex(HMODULE module)
+{
+    for (int i = 0; i < numModuleIndexes; i++)
+    {
+        if (moduleIndexes[i].module == module)
+            return &moduleIndexes[i];
+    }
+
+    if (numModuleIndexes >= MAX_INDEXED_MODULES)
+        return nullptr;
+
+    ModuleImageInfo info;
+    if (!GetModuleImageInfo(module, info))
+        return nullptr;
+
+    ModuleExportIndex &index = moduleIndexes[numModuleIndexes];
+    index.module = module;
+    index.exportStart = info.exportStart;
+    index.exportEnd = info.exportEnd;
+    if (!LoadCachedIndex(index, info))
+    {
+        if (!BuildIndex(index))
+            return nullptr;
+        SaveCachedIndex(index, info);
+    }
+
+    numModuleIndexes++;
+    return &index;
+}
+
+PVOID FindExportByName(HMODULE module, const char *name)
+{
+    if (!module || !name)
+        return nullptr;
+
+    const ModuleExportIndex *index = GetModuleIndex(module);
+    if (!index)
+        return (PVOID)GetProcAddress(module, name);
+
+    const DWORD hash = HashExportName(name);
+    const DWORD mask = index->numSlots - 1;
+    for (DWORD slot = hash & mask; index->slots[slot].rva; slot = (slot + 1) & mask)
+    {
+        const ExportSlot &entry = index->slots[slot];
+        if (entry.hash != hash || strcmp(index->names + entry.nameOffset, name) != 0)
+            continue;
+
+        // A forwarded export points at a "module.function" string
+        // inside the export directory; let the loader follow it.
+        if (entry.rva >= index->exportStart && entry.rva < index->exportEnd)
+            return (PVOID)GetProcAddress(module, name);
+
+        return (BYTE *)module + entry.rva;
+    }
+
+    return nullptr;
+}
+
+void ReleaseExportIndexes()
+{
+    for (int i = 0; i < numModuleIndexes; i++)
+        FreeIndex(moduleIndexes[i]);
+    numModuleIndexes = 0;
+}
+
+bool SetExportCacheDirectory(const char *directory)
+{
+    exportCacheDirectory[0] = '\0';
+    if (!directory)
+        return true;
+
+    if (strlen(directory) >= sizeof(exportCacheDirectory))
+    {
+        printf("ERROR: Export cache directory name is too long!\n");
+        return false;
+    }
+
+    strcpy_s(exportCacheDirectory, directory);
+    return true;
+}
+
+const char *GetExportCacheDirectory()
+{
+    return exportCacheDirectory;
+}
+
+bool CheckForwardedExportLookup()
+{
+    // Forwarded to ntdll's RtlAllocateHeap.
+    const HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+    const PVOID expected = kernel32 ? (PVOID)GetProcAddress(kernel32, "HeapAlloc") : nullptr;
+    const PVOID found = FindExportByName(kernel32, "HeapAlloc");
+    if (!expected || found != expected)
+    {
+        printf("ERROR: Export index resolved kernel32!HeapAlloc to %p, not %p!\n", found, expected);
+        return false;
+    }
+
+    return true;
+}
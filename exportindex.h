@@ -0,0 +1,56 @@
+//
+// exportindex.h
+//
+// Fast lookup of exported functions by name, for resolving hook
+// targets.
+//
+// The first time a module's exports are looked up, its export
+// directory is walked once into an open-addressed hash table
+// keyed by a hash of each name.  Forwarded exports are indexed
+// too, since kernel32 forwards many APIs to kernelbase and ntdll.
+// Every lookup after that is a probe or two into the table,
+// rather than a binary search of the export names, and never
+// falls back to loading symbols the way DetourFindFunction can.
+//
+// If a cache directory is set, each index is also saved to a
+// file named for the module, its link timestamp and checksum,
+// and later runs load the index from there instead of walking
+// the export table again.  Indexes hold RVAs rather than
+// addresses, so a cached index stays valid when the module is
+// loaded at a different base.  Only the process that sets the
+// directory uses it; injected children aren't given it, so they
+// don't read files while they start.
+//
+// None of this is thread-safe; the hook registry only calls it
+// with the hooks locked, or from DllMain.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Returns the address of the function the module exports under
+// the given name, or null if the module doesn't export it.
+// Forwarded exports are followed to the module they forward to.
+PVOID FindExportByName(HMODULE module, const char *name);
+
+// Frees every index built so far.  Lookups after this build the
+// indexes again.
+void ReleaseExportIndexes();
+
+// Sets the directory to save export indexes in and load them
+// from, or turns off the cache if null.  The directory must
+// already exist.  Returns true if successful.
+HOOKDLL_API bool SetExportCacheDirectory(const char *directory);
+
+// Returns the cache directory, or an empty string if the cache
+// is off.
+const char *GetExportCacheDirectory();
+
+// Checks that the index resolves a known forwarded export,
+// kernel32's HeapAlloc, to the same address GetProcAddress
+// does.  Only call this while the hooks are not installed.
+// Returns true if it does.
+HOOKDLL_API bool CheckForwardedExportLookup();
@@ -0,0 +1,151 @@
+//
+// fleetstats.cpp
+//
+// Hook counters summed over many processes, and the batches
+// they are shipped in.  See fleetstats.h for a description.
+//
+
+#include "fleetstats.h"
+
+//
+// Returns the fields of a FleetCounters as one flat array.
+//
+static long long *FleetFields(FleetCounters &counters)
+{
+    return &counters.calls[0];
+}
+
+static const long long *FleetFields(const FleetCounters &counters)
+{
+    return &counters.calls[0];
+}
+
+//
+// Appends a value as a varint: seven bits per byte, low bits
+// first, with the top bit set on every byte but the last.
+//
+static BYTE *WriteVarint(BYTE *out, unsigned long long value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (BYTE)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (BYTE)value;
+    return out;
+}
+
+//
+// Reads a varint.  Returns false if it runs past the end or is
+// too long.
+//
+static bool ReadVarint(const BYTE *&in, const BYTE *end, unsigned long long &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (in >= end)
+            return false;
+
+        const BYTE b = *in++;
+        value |= (unsigned long long)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void ReadFleetCounters(const TelemetryView &view, FleetCounters &counters)
+{
+    counters = FleetCounters();
+    if (!view.layout)
+        return;
+
+    for (int i = 0; i < TELEMETRY_COUNTER_BLOCKS; i++)
+    {
+        const TelemetryCounterBlock &block = view.layout->counterBlocks[i];
+        for (int h = 0; h < NUM_HOOK_IDS; h++)
+        {
+            counters.calls[h] += ReadNoFence64(&block.calls[h]);
+            counters.sampledCalls[h] += ReadNoFence64(&block.sampledCalls[h]);
+            for (int k = 0; k < NUM_LATENCY_KINDS; k++)
+            {
+                for (int b = 0; b < NUM_LATENCY_BUCKETS; b++)
+                    counters.latency[h][k][b] += ReadNoFence64(&block.latency[h][k][b]);
+            }
+        }
+    }
+}
+
+void AddFleetCounters(FleetCounters &total, const FleetCounters &more)
+{
+    long long *totalFields = FleetFields(total);
+    const long long *moreFields = FleetFields(more);
+    for (size_t i = 0; i < FLEET_NUM_FIELDS; i++)
+        totalFields[i] += moreFields[i];
+}
+
+bool DiffFleetCounters(const FleetCounters &current, const FleetCounters &previous, FleetCounters &change)
+{
+    const long long *currentFields = FleetFields(current);
+    const long long *previousFields = FleetFields(previous);
+    long long *changeFields = FleetFields(change);
+    bool changed = false;
+    for (size_t i = 0; i < FLEET_NUM_FIELDS; i++)
+    {
+        // The counters only go up, but the blocks are read one
+        // at a time while the process runs, so never ship a
+        // negative change.
+        const long long diff = currentFields[i] - previousFields[i];
+        changeFields[i] = diff > 0 ? diff : 0;
+        changed |= diff > 0;
+    }
+    return changed;
+}
+
+DWORD EncodeFleetPayload(const FleetCounters &change, BYTE *payload)
+{
+    const long long *fields = FleetFields(change);
+    BYTE *out = payload;
+    size_t next = 0;
+    for (size_t i = 0; i < FLEET_NUM_FIELDS; i++)
+    {
+        if (fields[i] <= 0)
+            continue;
+
+        out = WriteVarint(out, i - next);
+        out = WriteVarint(out, (unsigned long long)fields[i]);
+        next = i + 1;
+    }
+    return (DWORD)(out - payload);
+}
+
+bool DecodeFleetPayload(const BYTE *payload, DWORD size, FleetCounters &change)
+{
+    change = FleetCounters();
+    long long *fields = FleetFields(change);
+    const BYTE *in = payload;
+    const BYTE *end = payload + size;
+    unsigned long long next = 0;
+    while (in < end)
+    {
+        unsigned long long skip, value;
+        if (!ReadVarint(in, end, skip) || !ReadVarint(in, end, value))
+            return false;
+        if (skip >= FLEET_NUM_FIELDS - next || value > (unsigned long long)MAXLONGLONG)
+            return false;
+
+        next += skip;
+        fields[next++] = (long long)value;
+    }
+    return true;
+}
+
+bool IsValidFleetBatchHeader(const FleetBatchHeader &header)
+{
+    return header.magic == FLEET_BATCH_MAGIC &&
+           header.version == FLEET_BATCH_VERSION &&
+           header.headerSize == sizeof(FleetBatchHeader) &&
+           header.payloadSize <= FLEET_MAX_PAYLOAD &&
+           header.ticksPerSecond > 0;
+}
@@ -0,0 +1,88 @@
+//
+// fleetstats.h
+//
+// Hook counters summed over many processes, and the compact
+// batches collector.exe ships them in.
+//
+// Every counter in the telemetry (see telemetry.h) only ever
+// goes up, and a histogram is just a counter per bucket, so
+// counters from any number of processes combine by adding them
+// field by field.  That is associative and commutative, so a
+// node can sum its processes, an aggregator can sum the nodes,
+// in any order and grouping, and the histograms come out
+// exactly as if every call had been recorded in one process.
+//
+// A collector ships the change in its node's sums since the last
+// batch it sent.  A batch is a FleetBatchHeader followed by the
+// nonzero fields of the change as pairs of varints: the number
+// of zero fields skipped since the last pair, then the value.
+// An interval with a few launches in it takes a few dozen
+// bytes.  Batches are simply written one after another, to a
+// file or a named pipe (which can be on another machine).
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookstats.h"
+#include "telemetry.h"
+
+#define FLEET_BATCH_MAGIC       0x544C4648UL  // "HFLT"
+#define FLEET_BATCH_VERSION     2
+
+// Longest node name carried in a batch, including the null.
+#define FLEET_MAX_NODE_NAME     32
+
+// Counters summed over a set of processes.
+struct FleetCounters
+{
+    long long calls[NUM_HOOK_IDS];           // Estimated, if sampled.
+    long long sampledCalls[NUM_HOOK_IDS];    // Calls recorded.
+    long long latency[NUM_HOOK_IDS][NUM_LATENCY_KINDS][NUM_LATENCY_BUCKETS];
+};
+
+// Number of fields in FleetCounters.
+#define FLEET_NUM_FIELDS        (sizeof(FleetCounters) / sizeof(long long))
+
+// Most bytes the varints of one batch can take: two varints of
+// at most ten bytes for each field.
+#define FLEET_MAX_PAYLOAD       (FLEET_NUM_FIELDS * 20)
+
+// Start of every batch.
+struct FleetBatchHeader
+{
+    DWORD     magic;             // FLEET_BATCH_MAGIC.
+    WORD      version;           // FLEET_BATCH_VERSION.
+    WORD      headerSize;        // sizeof(FleetBatchHeader).
+    DWORD     payloadSize;       // Bytes of varints after the header.
+    DWORD     sequence;          // Batches the node sent before this one.
+    DWORD     numProcesses;      // Processes the node was collecting from.
+    DWORD     reserved;
+    long long ticksPerSecond;    // QueryPerformanceFrequency on the node,
+                                 // which the latencies are in.
+    long long time;              // FILETIME (UTC) the batch was made.
+    char      node[FLEET_MAX_NODE_NAME];  // Computer name of the node.
+};
+
+// Sums the counter blocks of a process's telemetry.
+void ReadFleetCounters(const TelemetryView &view, FleetCounters &counters);
+
+// Adds one set of counters into another.
+void AddFleetCounters(FleetCounters &total, const FleetCounters &more);
+
+// Sets change to current minus previous, field by field.
+// Returns true if anything changed.
+bool DiffFleetCounters(const FleetCounters &current, const FleetCounters &previous, FleetCounters &change);
+
+// Encodes the nonzero fields of a change into the payload for a
+// batch, which must have room for FLEET_MAX_PAYLOAD bytes.
+// Returns the number of bytes written.
+DWORD EncodeFleetPayload(const FleetCounters &change, BYTE *payload);
+
+// Decodes the payload of a batch into a change.  Returns false
+// if it is not valid.
+bool DecodeFleetPayload(const BYTE *payload, DWORD size, FleetCounters &change);
+
+// Returns true if a batch header is one we can read.
+bool IsValidFleetBatchHeader(const FleetBatchHeader &header);
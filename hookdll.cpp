@@ -0,0 +1,956 @@
+//
+// hookdll.cpp
+//
+// The API hooking code, built as hookdll64.dll (hookdll32.dll
+// for x86).
+//
+// The demo program loads this DLL and calls InstallHooks and
+// RemoveHooks to hook the CreateProcess APIs in its own
+// process.  When child injection is turned on, our hooks
+// launch each child through DetourCreateProcessWithDllEx, so
+// this DLL is loaded into the child before any of its own code
+// runs.  In the child, DllMain installs the same hooks, so the
+// whole process tree gets instrumented.
+//
+// Children get their configuration from the parent as a
+// Detours payload (HookConfigPayload), copied into the child
+// while it is still suspended, so the DLL never has to read a
+// file or the environment at load time.
+//
+// Hooks can also be installed lazily (INSTALL_LAZY).  Then an
+// API is only hooked once the DLL that exports it is loaded,
+// which we notice through a hook on LoadLibraryExW, so hooks
+// for DLLs the process never loads cost nothing.
+//
+// Hook counters, latencies and the launch event log live in
+// this DLL too (hookstats.cpp, eventlog.cpp, telemetry.cpp),
+// and are exported for the demo program to read.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <intrin.h>
+#include "hookdll.h"
+#include "detours.h"
+#include "callsites.h"
+#include "childjob.h"
+#include "childstartup.h"
+#include "eventlog.h"
+#include "exportindex.h"
+#include "hookgen.h"
+#include "hookregistry.h"
+#include "hookstats.h"
+#include "hookswap.h"
+#include "installprofile.h"
+#include "launchfilter.h"
+#include "launchrewrite.h"
+#include "telemetry.h"
+
+#pragma intrinsic(_ReturnAddress)
+
+// Function signature of CreateProcessW system API.
+typedef BOOL (WINAPI * CREATEPROCESSWFUNC)(LPCWSTR, LPWSTR,
+            LPSECURITY_ATTRIBUTES, LPSECURITY_ATTRIBUTES,
+            BOOL, DWORD, LPVOID, LPCWSTR, LPSTARTUPINFOW,
+            LPPROCESS_INFORMATION);
+
+// Function signature of CreateProcessA system API.
+typedef BOOL (WINAPI * CREATEPROCESSAFUNC)(LPCSTR, LPSTR,
+            LPSECURITY_ATTRIBUTES, LPSECURITY_ATTRIBUTES,
+            BOOL, DWORD, LPVOID, LPCSTR, LPSTARTUPINFOA,
+            LPPROCESS_INFORMATION);
+
+// Function signature of LoadLibraryExW system API.
+typedef HMODULE (WINAPI * LOADLIBRARYEXWFUNC)(LPCWSTR, HANDLE, DWORD);
+
+// Function signatures of the APIs that change our environment.
+typedef BOOL (WINAPI * SETENVIRONMENTVARIABLEWFUNC)(LPCWSTR, LPCWSTR);
+typedef BOOL (WINAPI * SETENVIRONMENTVARIABLEAFUNC)(LPCSTR, LPCSTR);
+typedef BOOL (WINAPI * SETENVIRONMENTSTRINGSWFUNC)(LPWCH);
+
+// Pointer to the LoadLibraryExW API, which the loader hook
+// calls through.  The CreateProcess hooks keep theirs in
+// CreateProcessHook.
+static LOADLIBRARYEXWFUNC PtrLoadLibraryExW = LoadLibraryExW;
+
+// Pointers to the APIs that change our environment, which the
+// environment hooks call through.
+static SETENVIRONMENTVARIABLEWFUNC PtrSetEnvironmentVariableW = SetEnvironmentVariableW;
+static SETENVIRONMENTVARIABLEAFUNC PtrSetEnvironmentVariableA = SetEnvironmentVariableA;
+static SETENVIRONMENTSTRINGSWFUNC PtrSetEnvironmentStringsW = SetEnvironmentStringsW;
+
+// Full path of this DLL, for injecting into child processes.
+static char hookDllPath[MAX_PATH] = {0};
+
+// True if our hooks should inject this DLL into the processes
+// they create.
+static volatile LONG injectChildren = 0;
+
+// True if DllMain installed the hooks, because we were injected
+// into this process by a parent.
+static bool installedByDllMain = false;
+
+// Configuration a parent passes to the children it injects,
+// identified by HookConfigGuid.  Must not contain pointers,
+// since it is read in another process.
+struct HookConfigPayload
+{
+    DWORD     version;           // HOOKCONFIG_VERSION.
+    DWORD     size;              // sizeof(HookConfigPayload).
+    DWORD     parentProcessId;   // Process that launched the child.
+    DWORD     flags;             // HOOKCONFIG_* flags below.
+    ULONGLONG hookMask;          // Bit N set to hook HookId N.
+    char      launchFilter[LAUNCH_FILTER_MAX_RULES]; // Empty if off.
+    LONG      samplingMode[NUM_HOOK_IDS];    // SAMPLE_* mode of each hook.
+    DWORD     samplingRate[NUM_HOOK_IDS];    // Its rate.
+    LONG      startupSlot;       // Slot to report the child's startup
+                                 // in (see childstartup.h), or -1.
+    char      launchEnvironment[LAUNCH_REWRITE_MAX_RULES];   // Empty if off.
+    char      commandLineRewrite[LAUNCH_REWRITE_MAX_RULES];  // Empty if off.
+};
+
+#define HOOKCONFIG_VERSION      7
+
+// Keep injecting into the child's own children.
+#define HOOKCONFIG_INJECT       0x00000001
+
+// Publish the child's counters and events in shared memory.
+// The mapping is named by TELEMETRY_NAME_PREFIX and the child's
+// own process ID, so the parent doesn't need to send a name.
+#define HOOKCONFIG_TELEMETRY    0x00000002
+
+// Install the child's hooks lazily, as their modules load.
+#define HOOKCONFIG_LAZY         0x00000004
+
+// {6B1F3D2E-8C4A-4E7B-9A15-3F0D2C7E5B91}
+static const GUID HookConfigGuid =
+    { 0x6b1f3d2e, 0x8c4a, 0x4e7b, { 0x9a, 0x15, 0x3f, 0x0d, 0x2c, 0x7e, 0x5b, 0x91 } };
+
+// Nonzero for each HookId whose monitoring is switched off (see
+// SetHookMonitoring).  Every hooked call reads this and it is
+// only written when monitoring is switched, so it gets a cache
+// line to itself.
+alignas(64) volatile LONG hookMonitoringOff[NUM_HOOK_IDS] = {0};
+
+// When the hooks inject into a child, this records the time the
+// original CreateProcess returned, before Detours started
+// patching the child.
+static thread_local long long createReturnTime = 0;
+
+// Where in the caller the hooked call being handled came from.
+// The detour records this before calling the implementation,
+// which may be swapped for one that doesn't call ours directly.
+static thread_local PVOID hookCallerAddress = nullptr;
+
+// Number of calls the hooked call being handled stands for, if
+// the hook samples its calls (see hooksampling.h).  Also set by
+// the detour.
+static thread_local long long hookCallWeight = 1;
+
+//---------------------------------------------------------------
+// API HOOKING CODE
+//---------------------------------------------------------------
+
+//
+// Writes a hooked launch into the event log, if logging is on.
+// This only copies into a preallocated ring buffer record; the
+// event log's own thread does the slow part of writing it out.
+//
+template <typename CharT>
+static void LogLaunchEvent(int hookId, const CharT *appName, const CharT *commandLine,
+    DWORD creationFlags, BOOL result, DWORD error,
+    const PROCESS_INFORMATION *processInfo, long long timestamp, long long apiTicks)
+{
+    LaunchEvent *event = ReserveLaunchEvent();
+    if (!event)
+        return;
+
+    event->timestamp = timestamp;
+    event->apiTicks = apiTicks;
+    event->hookId = hookId;
+    event->threadId = GetCurrentThreadId();
+    event->creationFlags = creationFlags;
+    event->result = result;
+    event->error = error;
+    event->processId = (result && processInfo) ? processInfo->dwProcessId : 0;
+    SetLaunchEventStrings(event, appName, commandLine);
+
+    CommitLaunchEvent(event);
+}
+
+static void FinishChildLaunch(const PROCESS_INFORMATION *processInfo, DWORD creationFlags, bool inject,
+    int hookId, long long hookStartTime);
+
+//
+// Everything that differs between the CreateProcessW and
+// CreateProcessA hooks, so CreateProcessHook can generate both
+// from one body.
+//
+template <typename CharT> struct CreateProcessApi;
+
+template <> struct CreateProcessApi<WCHAR>
+{
+    typedef CREATEPROCESSWFUNC Function;
+    typedef LPSTARTUPINFOW     StartupInfo;
+    static const int hookId = HOOK_CREATEPROCESSW;
+
+    static Function Target() { return CreateProcessW; }
+
+    static BOOL CreateWithDll(LPCWSTR lpApplicationName, LPWSTR lpCommandLine,
+        LPSECURITY_ATTRIBUTES lpProcessAttributes, LPSECURITY_ATTRIBUTES lpThreadAttributes,
+        BOOL bInheritHandles, DWORD dwCreationFlags, LPVOID lpEnvironment,
+        LPCWSTR lpCurrentDirectory, StartupInfo lpStartupInfo,
+        LPPROCESS_INFORMATION lpProcessInformation, Function create)
+    {
+        return DetourCreateProcessWithDllExW(lpApplicationName, lpCommandLine,
+            lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+            dwCreationFlags, lpEnvironment, lpCurrentDirectory,
+            lpStartupInfo, lpProcessInformation, hookDllPath, create);
+    }
+};
+
+template <> struct CreateProcessApi<char>
+{
+    typedef CREATEPROCESSAFUNC Function;
+    typedef LPSTARTUPINFOA     StartupInfo;
+    static const int hookId = HOOK_CREATEPROCESSA;
+
+    static Function Target() { return CreateProcessA; }
+
+    static BOOL CreateWithDll(LPCSTR lpApplicationName, LPSTR lpCommandLine,
+        LPSECURITY_ATTRIBUTES lpProcessAttributes, LPSECURITY_ATTRIBUTES lpThreadAttributes,
+        BOOL bInheritHandles, DWORD dwCreationFlags, LPVOID lpEnvironment,
+        LPCSTR lpCurrentDirectory, StartupInfo lpStartupInfo,
+        LPPROCESS_INFORMATION lpProcessInformation, Function create)
+    {
+        return DetourCreateProcessWithDllExA(lpApplicationName, lpCommandLine,
+            lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+            dwCreationFlags, lpEnvironment, lpCurrentDirectory,
+            lpStartupInfo, lpProcessInformation, hookDllPath, create);
+    }
+};
+
+//
+// The hook for CreateProcessW or CreateProcessA, depending on
+// the character type.  See hookgen.h for the shape of a
+// generated hook.
+//
+template <typename CharT>
+struct CreateProcessHook
+{
+    typedef CreateProcessApi<CharT> Api;
+
+    // Trampoline to the original API, set while the hook is
+    // attached.
+    static typename Api::Function original;
+
+    //
+    // Calls the original API, and records when it returned.
+    // This is also called by DetourCreateProcessWithDllEx in
+    // place of the original API, so we can tell how much of the
+    // launch time is the original API and how much is the
+    // injection.
+    //
+    static BOOL WINAPI Timed(
+        const CharT               *lpApplicationName,
+        CharT                     *lpCommandLine,
+        LPSECURITY_ATTRIBUTES     lpProcessAttributes,
+        LPSECURITY_ATTRIBUTES     lpThreadAttributes,
+        BOOL                      bInheritHandles,
+        DWORD                     dwCreationFlags,
+        LPVOID                    lpEnvironment,
+        const CharT               *lpCurrentDirectory,
+        typename Api::StartupInfo lpStartupInfo,
+        LPPROCESS_INFORMATION     lpProcessInformation
+        )
+    {
+        const BOOL result = original(lpApplicationName, lpCommandLine,
+            lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+            dwCreationFlags, lpEnvironment, lpCurrentDirectory,
+            lpStartupInfo, lpProcessInformation);
+        createReturnTime = HookStatsReadTimestamp();
+        return result;
+    }
+
+    //
+    // Calls the original API, loading this DLL into the child if
+    // injection is on.  If the child needs any setup before it
+    // runs, starts it suspended until that's done.  Sets error
+    // to the API's GetLastError value, and suspended to whether
+    // the child needed any setup.  If the call is being recorded,
+    // hookStartTime is when the hook was called, and an injected
+    // child's startup is tracked from then.
+    //
+    static BOOL Launch(
+        const CharT               *lpApplicationName,
+        CharT                     *lpCommandLine,
+        LPSECURITY_ATTRIBUTES     lpProcessAttributes,
+        LPSECURITY_ATTRIBUTES     lpThreadAttributes,
+        BOOL                      bInheritHandles,
+        DWORD                     dwCreationFlags,
+        LPVOID                    lpEnvironment,
+        const CharT               *lpCurrentDirectory,
+        typename Api::StartupInfo lpStartupInfo,
+        LPPROCESS_INFORMATION     lpProcessInformation,
+        DWORD                     &error,
+        bool                      &suspended,
+        long long                 hookStartTime = 0
+        )
+    {
+        const bool inject = ReadNoFence(&injectChildren) != 0;
+        const bool suspend = inject || IsChildJobStarted();
+        const DWORD launchFlags = suspend ? dwCreationFlags | CREATE_SUSPENDED : dwCreationFlags;
+        BOOL result;
+        if (inject)
+        {
+            result = Api::CreateWithDll(lpApplicationName, lpCommandLine,
+                lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+                launchFlags, lpEnvironment, lpCurrentDirectory,
+                lpStartupInfo, lpProcessInformation, Timed);
+        }
+        else
+        {
+            result = Timed(lpApplicationName, lpCommandLine,
+                lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+                launchFlags, lpEnvironment, lpCurrentDirectory,
+                lpStartupInfo, lpProcessInformation);
+        }
+        error = result ? NO_ERROR : GetLastError();
+        suspended = result && suspend;
+        if (suspended)
+            FinishChildLaunch(lpProcessInformation, dwCreationFlags, inject, Api::hookId, hookStartTime);
+        return result;
+    }
+
+    //
+    // Passes on a call we aren't recording.  The child still gets
+    // injected and put in the job, and its launch rewritten, so
+    // the process tree stays covered; if none of that is needed,
+    // this is just a call to the original API.
+    //
+    static BOOL PassThrough(
+        const CharT               *lpApplicationName,
+        CharT                     *lpCommandLine,
+        LPSECURITY_ATTRIBUTES     lpProcessAttributes,
+        LPSECURITY_ATTRIBUTES     lpThreadAttributes,
+        BOOL                      bInheritHandles,
+        DWORD                     dwCreationFlags,
+        LPVOID                    lpEnvironment,
+        const CharT               *lpCurrentDirectory,
+        typename Api::StartupInfo lpStartupInfo,
+        LPPROCESS_INFORMATION     lpProcessInformation
+        )
+    {
+        if (!ReadNoFence(&injectChildren) && !IsChildJobStarted() && !launchRewriteActive)
+        {
+            return original(lpApplicationName, lpCommandLine,
+                lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+                dwCreationFlags, lpEnvironment, lpCurrentDirectory,
+                lpStartupInfo, lpProcessInformation);
+        }
+
+        CharT *commandLine = lpCommandLine;
+        LPVOID environment = lpEnvironment;
+        DWORD creationFlags = dwCreationFlags;
+        if (launchRewriteActive)
+            RewriteLaunch(commandLine, environment, creationFlags);
+
+        DWORD error;
+        bool suspended;
+        const BOOL result = Launch(lpApplicationName, commandLine,
+            lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+            creationFlags, environment, lpCurrentDirectory,
+            lpStartupInfo, lpProcessInformation, error, suspended);
+        if (launchRewriteActive)
+            FinishLaunchRewrite();
+        SetLastError(error);
+        return result;
+    }
+
+    //
+    // The hook's built-in implementation, which the detour calls
+    // unless it has been swapped for another (see hookswap.h).
+    //
+    static BOOL WINAPI Monitor(
+        const CharT               *lpApplicationName,
+        CharT                     *lpCommandLine,
+        LPSECURITY_ATTRIBUTES     lpProcessAttributes,
+        LPSECURITY_ATTRIBUTES     lpThreadAttributes,
+        BOOL                      bInheritHandles,
+        DWORD                     dwCreationFlags,
+        LPVOID                    lpEnvironment,
+        const CharT               *lpCurrentDirectory,
+        typename Api::StartupInfo lpStartupInfo,
+        LPPROCESS_INFORMATION     lpProcessInformation
+        )
+    {
+        // With monitoring switched off, or for a launch the
+        // filter doesn't want, skip all of our own work.
+        if (!HookMonitoringOn(Api::hookId) || !LaunchFilterPasses(lpApplicationName, lpCommandLine))
+        {
+            return PassThrough(lpApplicationName, lpCommandLine,
+                lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+                dwCreationFlags, lpEnvironment, lpCurrentDirectory,
+                lpStartupInfo, lpProcessInformation);
+        }
+
+        DWORD error;
+        bool suspended;
+        const long long hookStartTime = HookStatsReadTimestamp();
+
+        const PVOID returnAddress = hookCallerAddress;
+
+        // Keep track of how many times we were called, or if
+        // this call was sampled, how many calls it stands for.
+        // The counters are per-thread, so this doesn't need a
+        // lock.
+        HookStatsCountCall(Api::hookId, hookCallWeight);
+
+        // Rewrite the child's environment and command line, if
+        // that's on.  This counts as our own work, not the API's.
+        // The caller's strings are still the ones logged.
+        CharT *commandLine = lpCommandLine;
+        LPVOID environment = lpEnvironment;
+        DWORD creationFlags = dwCreationFlags;
+        if (launchRewriteActive)
+            RewriteLaunch(commandLine, environment, creationFlags);
+
+        // Pass-thru call to the original API that we hooked into.
+        const long long apiStartTime = HookStatsReadTimestamp();
+        const BOOL result = Launch(lpApplicationName, commandLine,
+            lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+            creationFlags, environment, lpCurrentDirectory,
+            lpStartupInfo, lpProcessInformation, error, suspended, hookStartTime);
+        const long long apiEndTime = HookStatsReadTimestamp();
+        const long long apiReturnTime = createReturnTime;
+        if (launchRewriteActive)
+            FinishLaunchRewrite();
+
+        // Record how long the original API took, how long our
+        // own work before it took, and how long injecting the
+        // child (and adding it to the job) took.
+        HookStatsRecordLatency(Api::hookId, LATENCY_API, apiReturnTime - apiStartTime);
+        HookStatsRecordLatency(Api::hookId, LATENCY_HOOK, apiStartTime - hookStartTime);
+        if (suspended)
+            HookStatsRecordLatency(Api::hookId, LATENCY_INJECT, apiEndTime - apiReturnTime);
+        RecordCallsite(returnAddress, Api::hookId, apiEndTime - hookStartTime);
+
+        // Children launched earlier may have reported their
+        // startup by now.  Pick those up here, where it isn't
+        // counted in any of the latencies above.
+        if (suspended)
+            CollectChildStartups();
+
+        LogLaunchEvent(Api::hookId, lpApplicationName, lpCommandLine, dwCreationFlags,
+            result, error, lpProcessInformation, hookStartTime, apiReturnTime - apiStartTime);
+
+        SetLastError(error);
+        return result;
+    }
+
+    //
+    // Windows will call this hook function whenever the API is
+    // called.  It hands the call to the hook's current
+    // implementation, which can be swapped while the hook stays
+    // attached.
+    //
+    static BOOL WINAPI Detour(
+        const CharT               *lpApplicationName,
+        CharT                     *lpCommandLine,
+        LPSECURITY_ATTRIBUTES     lpProcessAttributes,
+        LPSECURITY_ATTRIBUTES     lpThreadAttributes,
+        BOOL                      bInheritHandles,
+        DWORD                     dwCreationFlags,
+        LPVOID                    lpEnvironment,
+        const CharT               *lpCurrentDirectory,
+        typename Api::StartupInfo lpStartupInfo,
+        LPPROCESS_INFORMATION     lpProcessInformation
+        )
+    {
+        // With monitoring switched off, or for a call that isn't
+        // sampled, don't bother with the implementation at all.
+        // An unsampled call only costs a thread-local decrement.
+        long long weight;
+        if (!HookMonitoringOn(Api::hookId) || !HookSampleCall(Api::hookId, weight))
+        {
+            return PassThrough(lpApplicationName, lpCommandLine,
+                lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+                dwCreationFlags, lpEnvironment, lpCurrentDirectory,
+                lpStartupInfo, lpProcessInformation);
+        }
+        hookCallWeight = weight;
+
+        // Our detour is jumped to, not called, so this is where
+        // in the caller the call to the API came from.
+        hookCallerAddress = _ReturnAddress();
+
+        const HookSwapTicket ticket = EnterHookImplementation(Api::hookId);
+        const BOOL result = ((typename Api::Function)ticket.implementation)(lpApplicationName,
+            lpCommandLine, lpProcessAttributes, lpThreadAttributes, bInheritHandles,
+            dwCreationFlags, lpEnvironment, lpCurrentDirectory,
+            lpStartupInfo, lpProcessInformation);
+        LeaveHookImplementation(ticket);
+        return result;
+    }
+};
+
+template <typename CharT>
+typename CreateProcessApi<CharT>::Function CreateProcessHook<CharT>::original = CreateProcessApi<CharT>::Target();
+
+typedef CreateProcessHook<WCHAR> CreateProcessWHook;
+typedef CreateProcessHook<char>  CreateProcessAHook;
+
+// The implementation behind each hook, in HookId order.  Each
+// starts out as the hook's built-in one.
+HookImplementationSlot hookImplementations[NUM_HOOK_IDS] =
+{
+    { (PVOID)CreateProcessWHook::Monitor },
+    { (PVOID)CreateProcessAHook::Monitor },
+};
+
+// Table of the APIs we hook.  To hook another API, add its
+// entry here; InstallHooks and RemoveHooks handle the rest.  An
+// API that only needs its calls counted can use a PassThruHook
+// (see hookgen.h) instead of a hand-written hook function.
+// Targets are looked up by module and name when the hooks are
+// installed.  Entries are in HookId order, since the hook mask
+// in HookConfigPayload is indexed by HookId.
+static HookEntry hookTable[] =
+{
+    { "CreateProcessW", "kernel32.dll", nullptr, (PVOID)CreateProcessWHook::Detour, &(PVOID &)CreateProcessWHook::original, true, false },
+    { "CreateProcessA", "kernel32.dll", nullptr, (PVOID)CreateProcessAHook::Detour, &(PVOID &)CreateProcessAHook::original, true, false },
+};
+
+// Serializes installing and removing hooks, since lazy installs
+// can happen on any thread that loads a DLL.
+static SRWLOCK hookTableLock = SRWLOCK_INIT;
+
+// Number of entries in hookTable waiting for their module to
+// load.  Checked without the lock on every LoadLibraryExW call,
+// so DLL loads are nearly free once everything is hooked.
+static volatile LONG numPendingHooks = 0;
+
+// True on a thread that is installing pending hooks, since
+// looking up their targets loads DLLs too.
+static thread_local bool installingPendingHooks = false;
+
+static void InstallPendingHooks();
+
+//
+// Windows will call this hook function whenever a DLL is loaded
+// by name.  The other LoadLibrary variants all end up here.
+// Once the original API returns, any hooks for the DLL that was
+// just loaded (or for the DLLs it pulled in) are installed.
+//
+HMODULE WINAPI HookedLoadLibraryExW(
+    LPCWSTR lpLibFileName,
+    HANDLE  hFile,
+    DWORD   dwFlags
+    )
+{
+    const HMODULE module = PtrLoadLibraryExW(lpLibFileName, hFile, dwFlags);
+    if (!module || ReadNoFence(&numPendingHooks) == 0 || installingPendingHooks)
+        return module;
+
+    // Don't let our own work change what the caller sees.
+    const DWORD error = GetLastError();
+    InstallPendingHooks();
+    SetLastError(error);
+    return module;
+}
+
+// The hook that drives lazy installation.  This is kept out of
+// hookTable since it isn't counted or timed like the others.
+static HookEntry loaderHookTable[] =
+{
+    { "LoadLibraryExW", "kernel32.dll", nullptr, HookedLoadLibraryExW, &(PVOID &)PtrLoadLibraryExW, true, false },
+};
+
+//
+// Windows will call these hook functions whenever our own
+// environment is changed, so the launch rewrite stage knows to
+// fetch it again (see launchrewrite.h).  The CRT's putenv ends
+// up here too.
+//
+BOOL WINAPI HookedSetEnvironmentVariableW(
+    LPCWSTR lpName,
+    LPCWSTR lpValue
+    )
+{
+    const BOOL result = PtrSetEnvironmentVariableW(lpName, lpValue);
+    NoteEnvironmentChanged();
+    return result;
+}
+
+BOOL WINAPI HookedSetEnvironmentVariableA(
+    LPCSTR lpName,
+    LPCSTR lpValue
+    )
+{
+    const BOOL result = PtrSetEnvironmentVariableA(lpName, lpValue);
+    NoteEnvironmentChanged();
+    return result;
+}
+
+BOOL WINAPI HookedSetEnvironmentStringsW(
+    LPWCH NewEnvironment
+    )
+{
+    const BOOL result = PtrSetEnvironmentStringsW(NewEnvironment);
+    NoteEnvironmentChanged();
+    return result;
+}
+
+// The hooks that tell the launch rewrite stage our environment
+// changed.  Like the loader hook, these aren't counted or timed,
+// and they are only attached if there are variables to set.
+static HookEntry environmentHookTable[] =
+{
+    { "SetEnvironmentVariableW", "kernel32.dll", nullptr, HookedSetEnvironmentVariableW, &(PVOID &)PtrSetEnvironmentVariableW, true, false },
+    { "SetEnvironmentVariableA", "kernel32.dll", nullptr, HookedSetEnvironmentVariableA, &(PVOID &)PtrSetEnvironmentVariableA, true, false },
+    { "SetEnvironmentStringsW", "kernel32.dll", nullptr, HookedSetEnvironmentStringsW, &(PVOID &)PtrSetEnvironmentStringsW, true, false },
+};
+
+//
+// Attaches the environment hooks, if there are variables to set,
+// and tells the launch rewrite stage whether it can rely on them.
+// If they don't all attach, the stage just fetches our
+// environment every time, so this never fails.
+//
+static void AttachEnvironmentHooks(const HookThreadSet *threads)
+{
+    if (!*GetLaunchEnvironment())
+        return;
+
+    ResolveHookTargets(environmentHookTable, ARRAYSIZE(environmentHookTable), true);
+    bool tracked = AttachHookTable(environmentHookTable, ARRAYSIZE(environmentHookTable), threads);
+    for (int i = 0; i < (int)ARRAYSIZE(environmentHookTable); i++)
+        tracked = tracked && environmentHookTable[i].attached;
+    TrackEnvironmentChanges(tracked);
+}
+
+// Threads that get suspended while hooks are installed and
+// removed, when InstallHooks is asked to update all threads.
+// The same snapshot is used for both.
+static HookThreadSet hookThreads = {0};
+static bool useAllThreads = false;
+
+// True if hooks are only installed once their module loads.
+static bool lazyInstall = false;
+
+//
+// Prints how long the last hook transaction kept threads
+// suspended, or when only the current thread was updated, how
+// long the commit took.
+//
+static void PrintHookPauseTime()
+{
+    const HookTransactionStats &stats = GetLastHookTransactionStats();
+    if (stats.currentThreadOnly)
+        printf("Updated the current thread only, no threads suspended; commit took %.1f microseconds.\n",
+            stats.suspendMicroseconds);
+    else
+        printf("Updated %d thread(s), suspended for %.1f microseconds.\n",
+            stats.numThreadsUpdated, stats.suspendMicroseconds);
+    if (stats.numHooksFailed)
+        printf("Left out %d hook(s) that failed, in %d attempt(s) and one commit.\n",
+            stats.numHooksFailed, stats.numAttempts);
+}
+
+//
+// Installs the hooks in hookTable whose modules have been loaded
+// since the last time we looked.
+//
+static void InstallPendingHooks()
+{
+    installingPendingHooks = true;
+    AcquireSRWLockExclusive(&hookTableLock);
+
+    if (ResolveHookTargets(hookTable, ARRAYSIZE(hookTable), false) > 0)
+    {
+        // The threads can't be the same ones captured when the
+        // hooks were first installed, so take a fresh snapshot.
+        HookThreadSet threads = {0};
+        if (!useAllThreads || CaptureProcessThreads(threads))
+        {
+            AttachHookTable(hookTable, ARRAYSIZE(hookTable), useAllThreads ? &threads : nullptr);
+            ReleaseProcessThreads(threads);
+        }
+    }
+    InterlockedExchange(&numPendingHooks, CountPendingHooks(hookTable, ARRAYSIZE(hookTable)));
+
+    ReleaseSRWLockExclusive(&hookTableLock);
+    installingPendingHooks = false;
+}
+
+//
+// Looks up the hook targets and attaches them, and in lazy mode
+// the loader hook that picks up the rest later.  Must be called
+// with hookTableLock held.
+//
+static bool AttachHooks(const HookThreadSet *threads)
+{
+    // First, so the transaction whose pause time is reported is
+    // the one for hookTable.
+    AttachEnvironmentHooks(threads);
+
+    ResolveHookTargets(hookTable, ARRAYSIZE(hookTable), !lazyInstall);
+    if (!AttachHookTable(hookTable, ARRAYSIZE(hookTable), threads))
+        return false;
+
+    const int numPending = CountPendingHooks(hookTable, ARRAYSIZE(hookTable));
+    if (numPending > 0)
+    {
+        ResolveHookTargets(loaderHookTable, ARRAYSIZE(loaderHookTable), true);
+        if (!AttachHookTable(loaderHookTable, ARRAYSIZE(loaderHookTable), threads))
+            return false;
+    }
+    InterlockedExchange(&numPendingHooks, numPending);
+    return true;
+}
+
+//
+// Removes the hooks, the loader hook and the environment hooks.
+// Must be called with hookTableLock held.
+//
+static void DetachHooks(const HookThreadSet *threads)
+{
+    InterlockedExchange(&numPendingHooks, 0);
+    TrackEnvironmentChanges(false);
+    DetachHookTable(environmentHookTable, ARRAYSIZE(environmentHookTable), threads);
+    DetachHookTable(loaderHookTable, ARRAYSIZE(loaderHookTable), threads);
+    DetachHookTable(hookTable, ARRAYSIZE(hookTable), threads);
+}
+
+//
+// Copies our configuration into a child that was just created
+// suspended with our DLL injected.
+//
+static void SendChildConfig(const PROCESS_INFORMATION *processInfo, int startupSlot)
+{
+    HookConfigPayload config = {0};
+    config.version = HOOKCONFIG_VERSION;
+    config.size = sizeof(config);
+    config.parentProcessId = GetCurrentProcessId();
+    if (ReadNoFence(&injectChildren))
+        config.flags |= HOOKCONFIG_INJECT;
+    if (IsTelemetryPublished())
+        config.flags |= HOOKCONFIG_TELEMETRY;
+    if (lazyInstall)
+        config.flags |= HOOKCONFIG_LAZY;
+    for (int i = 0; i < (int)ARRAYSIZE(hookTable); i++)
+    {
+        if (hookTable[i].enabled)
+            config.hookMask |= 1ULL << i;
+    }
+    strcpy_s(config.launchFilter, GetLaunchFilter());
+    strcpy_s(config.launchEnvironment, GetLaunchEnvironment());
+    strcpy_s(config.commandLineRewrite, GetCommandLineRewrite());
+    for (int i = 0; i < NUM_HOOK_IDS; i++)
+    {
+        int mode;
+        GetHookSampling(i, mode, config.samplingRate[i]);
+        config.samplingMode[i] = mode;
+    }
+    config.startupSlot = startupSlot;
+
+    // If the copy fails, the child just runs with the defaults.
+    DetourCopyPayloadToProcessEx(processInfo->hProcess, HookConfigGuid, &config, sizeof(config));
+}
+
+//
+// Sets up a child that the hooks created suspended: sends it
+// our configuration if we injected it, and adds it to the child
+// job if that's on.  Then lets the child run, unless the caller
+// asked for it to stay suspended.
+//
+// An injected child's startup is tracked if the launch is being
+// recorded (hookStartTime is nonzero).  If the caller keeps the
+// child suspended, its slot is held until the caller says it is
+// resuming the child (see childstartup.h), so the caller's own
+// wait isn't counted as startup time.
+//
+static void FinishChildLaunch(const PROCESS_INFORMATION *processInfo, DWORD creationFlags, bool inject,
+    int hookId, long long hookStartTime)
+{
+    int startupSlot = -1;
+    if (inject && hookStartTime)
+        startupSlot = BeginChildStartup(processInfo->dwProcessId, hookId, hookStartTime, createReturnTime);
+
+    if (inject)
+        SendChildConfig(processInfo, startupSlot);
+
+    // If the child can't be put in the job, it still runs, just
+    // uncontained; the failure shows in the job accounting.
+    if (IsChildJobStarted())
+        AddToChildJob(processInfo->hProcess);
+
+    if (creationFlags & CREATE_SUSPENDED)
+        HoldChildStartup(startupSlot);
+    else
+    {
+        ResumeChildStartup(startupSlot);
+        ResumeThread(processInfo->hThread);
+    }
+}
+
+//
+// Applies the configuration our parent copied into this process,
+// if there is one, and returns it.  Otherwise every hook is
+// installed and we keep injecting into our own children.
+//
+static const HookConfigPayload *ApplyChildConfig()
+{
+    DWORD size = 0;
+    const HookConfigPayload *config = (const HookConfigPayload *)DetourFindPayloadEx(HookConfigGuid, &size);
+    if (!config || size < sizeof(*config) || config->version != HOOKCONFIG_VERSION)
+    {
+        SetChildInjection(true);
+        return nullptr;
+    }
+
+    SetChildInjection((config->flags & HOOKCONFIG_INJECT) != 0);
+    lazyInstall = (config->flags & HOOKCONFIG_LAZY) != 0;
+    for (int i = 0; i < (int)ARRAYSIZE(hookTable); i++)
+        hookTable[i].enabled = (config->hookMask & (1ULL << i)) != 0;
+
+    // The children record and sample the same launches the
+    // parent does, and rewrite their own children's launches the
+    // same way.  They don't get the export cache directory: the
+    // configuration keeps a child's startup free of disk I/O, so
+    // a child builds its indexes in memory instead.
+    if (memchr(config->launchFilter, '\0', sizeof(config->launchFilter)))
+        SetLaunchFilter(config->launchFilter);
+    if (memchr(config->launchEnvironment, '\0', sizeof(config->launchEnvironment)))
+        SetLaunchEnvironment(config->launchEnvironment);
+    if (memchr(config->commandLineRewrite, '\0', sizeof(config->commandLineRewrite)))
+        SetCommandLineRewrite(config->commandLineRewrite);
+    for (int i = 0; i < NUM_HOOK_IDS; i++)
+        SetHookSampling(i, config->samplingMode[i], config->samplingRate[i]);
+
+    // There's no one to read a log file in the child, but the
+    // events still go to the shared-memory ring.
+    if ((config->flags & HOOKCONFIG_TELEMETRY) && PublishTelemetry())
+        StartEventLog(nullptr);
+    return config;
+}
+
+bool InstallHooks(DWORD flags)
+{
+    printf("Installing API hooks%s.\n", (flags & INSTALL_LAZY) ? " lazily" : "");
+
+    AcquireSRWLockExclusive(&hookTableLock);
+    StartInstallProfile();
+    useAllThreads = (flags & INSTALL_ALL_THREADS) != 0;
+    lazyInstall = (flags & INSTALL_LAZY) != 0;
+
+    bool ok = !useAllThreads || CaptureProcessThreads(hookThreads);
+    if (ok && !AttachHooks(useAllThreads ? &hookThreads : nullptr))
+    {
+        DetachHooks(useAllThreads ? &hookThreads : nullptr);
+        ReleaseProcessThreads(hookThreads);
+        ok = false;
+    }
+    ReleaseSRWLockExclusive(&hookTableLock);
+
+    if (ok)
+        PrintHookPauseTime();
+    return ok;
+}
+
+void RemoveHooks()
+{
+    printf("Removing API hooks.\n");
+
+    AcquireSRWLockExclusive(&hookTableLock);
+    DetachHooks(useAllThreads ? &hookThreads : nullptr);
+    PrintHookPauseTime();
+    ReleaseProcessThreads(hookThreads);
+    ReleaseExportIndexes();
+    ReleaseSRWLockExclusive(&hookTableLock);
+}
+
+void SetChildInjection(bool enable)
+{
+    InterlockedExchange(&injectChildren, enable ? 1 : 0);
+}
+
+bool SetHookMonitoring(int hookId, bool enable)
+{
+    if (hookId == ALL_HOOKS)
+    {
+        for (int i = 0; i < NUM_HOOK_IDS; i++)
+            InterlockedExchange(&hookMonitoringOff[i], enable ? 0 : 1);
+        return true;
+    }
+
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS)
+        return false;
+
+    InterlockedExchange(&hookMonitoringOff[hookId], enable ? 0 : 1);
+    return true;
+}
+
+bool IsHookMonitored(int hookId)
+{
+    return hookId >= 0 && hookId < NUM_HOOK_IDS && HookMonitoringOn(hookId);
+}
+
+PVOID SwapHookImplementation(int hookId, PVOID implementation)
+{
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS || !implementation)
+        return nullptr;
+
+    return ReplaceHookImplementation(hookImplementations[hookId], implementation);
+}
+
+PVOID GetHookImplementation(int hookId)
+{
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS)
+        return nullptr;
+
+    return ReadPointerAcquire(&hookImplementations[hookId].implementation);
+}
+
+BOOL WINAPI DllMain(HINSTANCE hinst, DWORD reason, LPVOID)
+{
+    // When Detours injects a DLL into a process of the other
+    // bitness, it runs a helper process that loads us just to
+    // call DetourFinishHelperProcess; do nothing else there.
+    if (DetourIsHelperProcess())
+        return TRUE;
+
+    if (reason == DLL_PROCESS_ATTACH)
+    {
+        const long long attachTime = HookStatsReadTimestamp();
+        DisableThreadLibraryCalls(hinst);
+        GetModuleFileNameA(hinst, hookDllPath, sizeof(hookDllPath));
+
+        // DetourRestoreAfterWith only finds something to restore
+        // if a parent injected us with DetourCreateProcessWithDllEx.
+        // In that case nobody is going to call InstallHooks, so
+        // hook the child's APIs now as the parent configured,
+        // quietly since the child may share the parent's console.
+        if (DetourRestoreAfterWith())
+        {
+            StartInstallProfile();
+            const HookConfigPayload *config = ApplyChildConfig();
+            installedByDllMain = AttachHooks(nullptr);
+
+            // Tell the parent how long the loader took to get
+            // here and how long the hooks took to install.
+            if (config && config->startupSlot >= 0)
+                ReportChildStartup(config->parentProcessId, config->startupSlot, attachTime);
+        }
+    }
+    else if (reason == DLL_PROCESS_DETACH)
+    {
+        if (installedByDllMain)
+            DetachHooks(nullptr);
+        StopInstallProfiling();
+        StopChildStartupTracking();
+        StopLaunchRewrite();
+    }
+
+    return TRUE;
+}
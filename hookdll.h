@@ -0,0 +1,71 @@
+//
+// hookdll.h
+//
+// Functions exported by hookdll64.dll (hookdll32.dll in a 32-bit
+// build), which holds all of the API hooking code.  See
+// hookdll.cpp for a description.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Marks functions exported by hookdll64.dll or hookdll32.dll.
+// The DLL's own sources are compiled with HOOKDLL_EXPORTS
+// defined.
+#ifdef HOOKDLL_EXPORTS
+#define HOOKDLL_API __declspec(dllexport)
+#else
+#define HOOKDLL_API __declspec(dllimport)
+#endif
+
+// Flags for InstallHooks.
+
+// Suspend every thread in the process while the hooks are
+// patched in, rather than only the current one.
+#define INSTALL_ALL_THREADS     0x00000001
+
+// Only hook each API once the DLL that exports it is loaded,
+// instead of loading every such DLL up front.
+#define INSTALL_LAZY            0x00000002
+
+// Installs our API function hooks in the current process, as
+// controlled by the INSTALL_* flags.  Returns true if
+// successful.
+HOOKDLL_API bool InstallHooks(DWORD flags);
+
+// Removes the hooks installed by InstallHooks.
+HOOKDLL_API void RemoveHooks();
+
+// Turns on or off injecting this DLL into the child processes
+// our hooks create.
+HOOKDLL_API void SetChildInjection(bool enable);
+
+// Passed to SetHookMonitoring to switch every hook at once.
+#define ALL_HOOKS               (-1)
+
+// Switches the monitoring done by a hook (one of the HookId
+// values, or ALL_HOOKS) on or off, without touching the code
+// patches.  A hook with monitoring off passes its calls
+// straight through, so this is cheap enough to do at any time.
+// Monitoring starts out on.  Returns false if the hook ID is
+// not valid.
+HOOKDLL_API bool SetHookMonitoring(int hookId, bool enable);
+
+// Returns true if monitoring is on for the given hook.
+HOOKDLL_API bool IsHookMonitored(int hookId);
+
+// Replaces the implementation behind a hook (one of the HookId
+// values) while the hook stays attached, so no calls are missed
+// and no threads are suspended.  The implementation has the
+// same signature as the hooked API.  Returns the implementation
+// it replaced, once no thread is still running it, or null if
+// the hook ID or the implementation is not valid.  Must not be
+// called from inside a hook implementation.
+HOOKDLL_API PVOID SwapHookImplementation(int hookId, PVOID implementation);
+
+// Returns the implementation currently behind a hook, which a
+// replacement can call to pass its calls on, or null if the
+// hook ID is not valid.
+HOOKDLL_API PVOID GetHookImplementation(int hookId);
@@ -0,0 +1,78 @@
+//
+// hookgen.h
+//
+// Templates that generate hook functions, so each new API we
+// hook doesn't need its own hand-written detour.
+//
+// A generated hook is a class with a static Detour function to
+// put in the HookEntry, and a static original pointer that
+// receives the trampoline:
+//
+//     typedef PassThruHook<HOOK_FOO, FOOFUNC> FooHook;
+//     { "Foo", "bar.dll", nullptr, (PVOID)FooHook::Detour,
+//       &(PVOID &)FooHook::original, true, false },
+//
+// Each instantiation has its own trampoline pointer, and all of
+// the dispatch is resolved at compile time.  Hooks that need to
+// do more than count their calls, like the CreateProcess hooks
+// in hookdll.cpp, follow the same shape with their own body.
+// Every generated hook checks HookMonitoringOn first, so with
+// monitoring switched off only the pass-through is left, and
+// then HookSampleCall, so calls that aren't sampled only cost a
+// thread-local decrement on top of it.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hooksampling.h"
+#include "hookstats.h"
+
+// Nonzero for each HookId whose monitoring is switched off.
+// Defined in hookdll.cpp.
+extern volatile LONG hookMonitoringOff[NUM_HOOK_IDS];
+
+//
+// Returns true if the hook for a HookId should do its monitoring
+// work, or false if it should only pass the call through (see
+// SetHookMonitoring).  This is a single read, cheap enough for
+// every hooked call.
+//
+inline bool HookMonitoringOn(int hookId)
+{
+    return ReadNoFence(&hookMonitoringOff[hookId]) == 0;
+}
+
+template <int Id, typename Function> struct PassThruHook;
+
+//
+// A hook that only counts its calls (or, if sampling, the
+// calls it samples) and then passes them through.  The call to
+// the original API is the last thing it does, so the compiler
+// can make it a tail jump, and the hook costs little more than
+// the counter.
+//
+template <int Id, typename Result, typename... Args>
+struct PassThruHook<Id, Result (WINAPI *)(Args...)>
+{
+    static_assert(Id >= 0 && Id < NUM_HOOK_IDS, "PassThruHook needs a HookId");
+
+    typedef Result (WINAPI *Function)(Args...);
+
+    // Trampoline to the original API, set while the hook is
+    // attached.
+    static Function original;
+
+    static Result WINAPI Detour(Args... args)
+    {
+        long long weight;
+        if (HookMonitoringOn(Id) && HookSampleCall(Id, weight))
+            HookStatsCountCall(Id, weight);
+        return original(args...);
+    }
+};
+
+template <int Id, typename Result, typename... Args>
+typename PassThruHook<Id, Result (WINAPI *)(Args...)>::Function
+    PassThruHook<Id, Result (WINAPI *)(Args...)>::original = nullptr;
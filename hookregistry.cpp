@@ -0,0 +1,348 @@
+//
+// hookregistry.cpp
+//
+// Table-driven installation of API hooks with Detours.
+// See hookregistry.h for a description.
+//
+
+#include <stdio.h>
+#include "hookregistry.h"
+#include <tlhelp32.h>
+#include "detours.h"
+#include "exportindex.h"
+#include "installprofile.h"
+#include "trampolinepool.h"
+
+// Timing of the most recent transaction.
+static HookTransactionStats lastTransactionStats = {0};
+
+// QueryPerformanceCounter value when the current transaction
+// started suspending threads.
+static LONGLONG transactionStartTime = 0;
+
+//
+// Returns the current QueryPerformanceCounter value.
+//
+static LONGLONG ReadTimestamp()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+//
+// Registers the threads to suspend with the open transaction,
+// and starts timing how long they stay suspended.
+//
+static void UpdateTransactionThreads(const HookThreadSet *threads)
+{
+    transactionStartTime = ReadTimestamp();
+    lastTransactionStats.numThreadsUpdated = 0;
+    lastTransactionStats.currentThreadOnly = !threads;
+
+    if (!threads)
+    {
+        DetourUpdateThread(GetCurrentThread());
+        lastTransactionStats.numThreadsUpdated = 1;
+        EndInstallPhase(PHASE_UPDATE_THREADS, transactionStartTime, nullptr, 1);
+        return;
+    }
+
+    // Detours suspends each thread as it is registered, and
+    // resumes them all at commit.  Threads that exited since the
+    // snapshot was taken fail here, which is harmless.
+    for (int i = 0; i < threads->numThreads; i++)
+    {
+        if (DetourUpdateThread(threads->threads[i]) == NO_ERROR)
+            lastTransactionStats.numThreadsUpdated++;
+    }
+
+    EndInstallPhase(PHASE_UPDATE_THREADS, transactionStartTime, nullptr,
+                    lastTransactionStats.numThreadsUpdated);
+}
+
+//
+// Records how long the threads were suspended for the
+// transaction that just ended.
+//
+static void EndTransactionTiming()
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    lastTransactionStats.suspendMicroseconds =
+        (double)(ReadTimestamp() - transactionStartTime) * 1000000.0 / (double)frequency.QuadPart;
+}
+
+//
+// Returns true if a hook should be attached by the next
+// AttachHookTable call.
+//
+static bool IsReadyToAttach(const HookEntry &hook)
+{
+    return hook.enabled && !hook.attached && hook.target;
+}
+
+int ResolveHookTargets(HookEntry *hooks, int numHooks, bool loadModules)
+{
+    int numResolved = 0;
+    for (int i = 0; i < numHooks; i++)
+    {
+        HookEntry &hook = hooks[i];
+        if (!hook.enabled || hook.target || !hook.module)
+            continue;
+
+        const long long start = StartInstallPhase();
+
+        // A module we load ourselves stays loaded, since nothing
+        // ever frees our reference.  One that was already loaded
+        // gets pinned.
+        HMODULE module = nullptr;
+        if (loadModules)
+            module = LoadLibraryA(hook.module);
+        else if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_PIN, hook.module, &module))
+        {
+            EndInstallPhase(PHASE_RESOLVE, start, hook.name);
+            continue;
+        }
+
+        // The export index answers almost every lookup.  Only
+        // fall back on DetourFindFunction, which may load symbols,
+        // for functions the module doesn't export by name.
+        if (module)
+            hook.target = FindExportByName(module, hook.name);
+        if (!hook.target)
+            hook.target = DetourFindFunction(hook.module, hook.name);
+        EndInstallPhase(PHASE_RESOLVE, start, hook.name);
+
+        if (hook.target)
+            numResolved++;
+        else
+            hook.enabled = false;
+    }
+
+    return numResolved;
+}
+
+int CountPendingHooks(const HookEntry *hooks, int numHooks)
+{
+    int numPending = 0;
+    for (int i = 0; i < numHooks; i++)
+    {
+        if (hooks[i].enabled && !hooks[i].target)
+            numPending++;
+    }
+
+    return numPending;
+}
+
+//
+// Leaves the entry with the given trampoline pointer out of the
+// next attempt to attach the table, since attaching it failed.
+// Returns false if no entry waiting to be attached has that
+// pointer.
+//
+static bool LeaveOutFailedHook(HookEntry *hooks, int numHooks, PVOID *failedPointer, LONG error)
+{
+    for (int i = 0; i < numHooks; i++)
+    {
+        HookEntry &hook = hooks[i];
+        if (hook.trampoline != failedPointer || !IsReadyToAttach(hook))
+            continue;
+
+        printf("ERROR: Failed hooking %s (error %ld); leaving it out!\n", hook.name, error);
+        hook.enabled = false;
+        lastTransactionStats.numHooksFailed++;
+        return true;
+    }
+
+    return false;
+}
+
+//
+// Makes one attempt at attaching every entry that is ready, in
+// one transaction.  Returns NO_ERROR if they were all attached.
+// Otherwise the transaction is aborted, so none of them are,
+// and failedPointer is the trampoline pointer of the entry that
+// failed, or null if it isn't known.
+//
+static LONG TryAttachHookTable(HookEntry *hooks, int numHooks, const HookThreadSet *threads, PVOID *&failedPointer)
+{
+    failedPointer = nullptr;
+    long long start = StartInstallPhase();
+    LONG error = DetourTransactionBegin();
+    EndInstallPhase(PHASE_BEGIN, start);
+    if (error != NO_ERROR)
+        return error;
+
+    // Once one attach fails, Detours fails the rest and the
+    // commit, so give up on this attempt straight away.  No
+    // threads have been suspended yet, so an attempt that stops
+    // here costs the rest of the process nothing.
+    for (int i = 0; i < numHooks; i++)
+    {
+        HookEntry &hook = hooks[i];
+        if (!IsReadyToAttach(hook))
+            continue;
+
+        *hook.trampoline = hook.target;
+        start = StartInstallPhase();
+        error = DetourAttach(hook.trampoline, hook.detour);
+        EndInstallPhase(PHASE_ATTACH, start, hook.name);
+        if (error != NO_ERROR)
+        {
+            failedPointer = hook.trampoline;
+            start = StartInstallPhase();
+            DetourTransactionAbort();
+            EndInstallPhase(PHASE_ABORT, start, hook.name);
+            return error;
+        }
+    }
+
+    // The commit patches the code and resumes the threads, so it
+    // is the tail end of the time they are suspended for.
+    UpdateTransactionThreads(threads);
+    start = StartInstallPhase();
+    error = DetourTransactionCommitEx(&failedPointer);
+    EndInstallPhase(PHASE_COMMIT, start);
+    EndTransactionTiming();
+    return error;
+}
+
+bool AttachHookTable(HookEntry *hooks, int numHooks, const HookThreadSet *threads)
+{
+    if (!hooks || numHooks <= 0)
+        return true;
+
+    StartTrampolinePool();
+    lastTransactionStats.numAttempts = 0;
+    lastTransactionStats.numHooksFailed = 0;
+
+    // Each failed attempt leaves out the entry that failed and
+    // tries again with the rest, so this ends after at most one
+    // attempt per entry.  Only the last attempt gets as far as
+    // suspending threads and committing.
+    for (;;)
+    {
+        lastTransactionStats.numAttempts++;
+        PVOID *failedPointer = nullptr;
+        const LONG error = TryAttachHookTable(hooks, numHooks, threads, failedPointer);
+        if (error == NO_ERROR)
+            break;
+
+        if (!failedPointer || !LeaveOutFailedHook(hooks, numHooks, failedPointer, error))
+        {
+            printf("ERROR: Failed committing hooks (error %ld)!\n", error);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < numHooks; i++)
+    {
+        HookEntry &hook = hooks[i];
+        if (!IsReadyToAttach(hook))
+            continue;
+
+        hook.attached = true;
+        hook.trampolineCode = *hook.trampoline;
+        NoteTrampolineAttached(hook.trampolineCode);
+    }
+
+    return true;
+}
+
+void DetachHookTable(HookEntry *hooks, int numHooks, const HookThreadSet *threads)
+{
+    if (!hooks || numHooks <= 0)
+        return;
+
+    if (DetourTransactionBegin() != NO_ERROR)
+        return;
+    UpdateTransactionThreads(threads);
+    lastTransactionStats.numAttempts = 1;
+    lastTransactionStats.numHooksFailed = 0;
+
+    for (int i = 0; i < numHooks; i++)
+    {
+        if (hooks[i].attached)
+            DetourDetach(hooks[i].trampoline, hooks[i].detour);
+    }
+
+    const LONG error = DetourTransactionCommit();
+    EndTransactionTiming();
+    if (error == NO_ERROR)
+    {
+        for (int i = 0; i < numHooks; i++)
+        {
+            HookEntry &hook = hooks[i];
+            if (!hook.attached)
+                continue;
+
+            hook.attached = false;
+            NoteTrampolineDetached(hook.trampolineCode);
+            hook.trampolineCode = nullptr;
+        }
+    }
+}
+
+bool CaptureProcessThreads(HookThreadSet &set)
+{
+    set.threads = nullptr;
+    set.numThreads = 0;
+
+    const HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+    {
+        printf("ERROR: Failed taking thread snapshot (error %lu)!\n", GetLastError());
+        return false;
+    }
+
+    const DWORD processId = GetCurrentProcessId();
+    const DWORD currentThreadId = GetCurrentThreadId();
+    int maxThreads = 0;
+
+    THREADENTRY32 entry = {0};
+    entry.dwSize = sizeof(entry);
+    for (BOOL more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry))
+    {
+        // The snapshot covers every thread in the system, so skip
+        // those in other processes.  Detours never suspends the
+        // calling thread, so skip it too.
+        if (entry.th32OwnerProcessID != processId || entry.th32ThreadID == currentThreadId)
+            continue;
+
+        const HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT |
+                                         THREAD_SET_CONTEXT | THREAD_QUERY_INFORMATION,
+                                         FALSE, entry.th32ThreadID);
+        if (!thread)
+            continue;
+
+        if (set.numThreads == maxThreads)
+        {
+            maxThreads = maxThreads ? maxThreads * 2 : 16;
+            HANDLE *grown = new HANDLE[maxThreads];
+            for (int i = 0; i < set.numThreads; i++)
+                grown[i] = set.threads[i];
+            delete [] set.threads;
+            set.threads = grown;
+        }
+        set.threads[set.numThreads++] = thread;
+    }
+
+    CloseHandle(snapshot);
+    return true;
+}
+
+void ReleaseProcessThreads(HookThreadSet &set)
+{
+    for (int i = 0; i < set.numThreads; i++)
+        CloseHandle(set.threads[i]);
+
+    delete [] set.threads;
+    set.threads = nullptr;
+    set.numThreads = 0;
+}
+
+const HookTransactionStats &GetLastHookTransactionStats()
+{
+    return lastTransactionStats;
+}
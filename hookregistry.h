@@ -0,0 +1,111 @@
+//
+// hookregistry.h
+//
+// Table-driven installation of API hooks with Detours.
+//
+// Rather than hand-writing a DetourAttach and DetourDetach
+// call for every API we hook, callers describe each hook with
+// a HookEntry and pass the whole table in.  All entries are
+// attached (or detached) in a single Detours transaction, so
+// threads only get suspended for one commit no matter how
+// many APIs are in the table.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Describes one API hook.
+struct HookEntry
+{
+    const char *name;        // Name of the hooked API, as exported.
+    const char *module;      // DLL that exports the API, for looking
+                             // up the target by name.
+    PVOID       target;      // API function to hook.  If null, it is
+                             // looked up by ResolveHookTargets.
+    PVOID       detour;      // Our hook function that replaces it.
+    PVOID      *trampoline;  // Receives the pointer our hook calls
+                             // to pass through to the original API.
+    bool        enabled;     // False to leave this API unhooked.
+    bool        attached;    // True while the hook is installed.
+    PVOID       trampolineCode;  // Trampoline Detours allocated for the
+                                 // hook while it is attached.
+};
+
+// The set of threads to suspend while a hook transaction
+// patches code.  Capture it once with CaptureProcessThreads,
+// then pass it to both AttachHookTable and DetachHookTable so
+// the process only gets enumerated once.  Threads created
+// after the capture are not included.
+struct HookThreadSet
+{
+    HANDLE *threads;         // Open handles to the threads.
+    int     numThreads;      // Number of handles in the array.
+};
+
+// Timing of the most recent hook transaction.
+struct HookTransactionStats
+{
+    int    numThreadsUpdated;    // Threads registered with DetourUpdateThread.
+    bool   currentThreadOnly;    // True if only the calling thread was
+                                 // updated, so nothing was suspended.
+    double suspendMicroseconds;  // Time from the first thread being
+                                 // suspended until the commit resumed
+                                 // them, or with currentThreadOnly,
+                                 // from updating the calling thread
+                                 // until the commit finished.
+    int    numAttempts;          // Transactions it took, counting those
+                                 // abandoned because an entry failed.
+    int    numHooksFailed;       // Entries left out because they failed.
+};
+
+// Looks up the target of each enabled entry that doesn't have
+// one yet, by module and export name, through the export index
+// (see exportindex.h).  If loadModules is true,
+// each module is loaded if it isn't already.  Otherwise only
+// modules that are already loaded are looked in, and entries
+// for the rest are left for a later call, which is how hooks
+// get installed lazily as modules load.  Either way, each
+// module that a hook resolves in is pinned, since unloading
+// it would leave the detour pointing nowhere (and the module's
+// export index stale).  Entries whose module is loaded but
+// doesn't export the API are disabled.
+// Returns the number of targets resolved.
+int ResolveHookTargets(HookEntry *hooks, int numHooks, bool loadModules);
+
+// Returns the number of enabled entries still waiting for their
+// module to load.
+int CountPendingHooks(const HookEntry *hooks, int numHooks);
+
+// Attaches all of the hooks in the table in one transaction.
+// Entries that are disabled, already attached, or don't have a
+// target yet are skipped.  The trampolines go in regions kept
+// by the trampoline pool (see trampolinepool.h).
+// If an entry fails to attach, the transaction is aborted, an
+// error message is printed, the entry is disabled, and the rest
+// are attached in a fresh transaction.  Threads are only
+// suspended once every attach has succeeded, so however many
+// entries fail, only one transaction gets committed.
+// If threads is null, only the current thread is updated.
+// Returns true if every entry left was attached.  On failure,
+// which only happens if Detours fails in a way that can't be
+// traced to an entry, no hooks are attached and an error
+// message is printed.
+bool AttachHookTable(HookEntry *hooks, int numHooks, const HookThreadSet *threads = nullptr);
+
+// Detaches all of the attached hooks in the table in one
+// transaction.  If threads is null, only the current thread is
+// updated.
+void DetachHookTable(HookEntry *hooks, int numHooks, const HookThreadSet *threads = nullptr);
+
+// Takes a Toolhelp snapshot of all other threads in the current
+// process and opens a handle to each one.
+// Returns true if successful.
+bool CaptureProcessThreads(HookThreadSet &set);
+
+// Closes the thread handles from CaptureProcessThreads.
+void ReleaseProcessThreads(HookThreadSet &set);
+
+// Returns the timing of the most recent attach or detach.
+const HookTransactionStats &GetLastHookTransactionStats();
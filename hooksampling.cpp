@@ -0,0 +1,113 @@
+//
+// hooksampling.cpp
+//
+// Sampling of the calls each hook records.  See hooksampling.h
+// for a description.
+//
+
+#include "hooksampling.h"
+
+// How one hook samples its calls.
+struct HookSamplingConfig
+{
+    volatile LONG mode;          // SAMPLE_* mode.
+    volatile LONG rate;          // Calls or microseconds, by mode.
+};
+
+static HookSamplingConfig samplingConfig[NUM_HOOK_IDS] = {0};
+
+// QueryPerformanceCounter ticks per microsecond, set once
+// SAMPLE_INTERVAL is first used.
+static double ticksPerMicrosecond = 0.0;
+
+thread_local HookSampleState hookSampleStates[NUM_HOOK_IDS] = {0};
+
+//
+// Returns the next number from a thread's random number state,
+// seeding it on first use.
+//
+static ULONG NextRandom(HookSampleState &state)
+{
+    ULONG x = state.random;
+    if (!x)
+        x = ((GetCurrentThreadId() * 2654435761UL) ^ (ULONG)HookStatsReadTimestamp()) | 1;
+
+    // Xorshift32.
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state.random = x;
+    return x;
+}
+
+long long StartNextSampleStride(int hookId, HookSampleState &state)
+{
+    // The first call on a thread has no countdown behind it.
+    const long long weight = state.stride > 0 ? state.stride : 1;
+
+    const LONG mode = ReadNoFence(&samplingConfig[hookId].mode);
+    const LONG rate = ReadNoFence(&samplingConfig[hookId].rate);
+    LONG stride = 1;
+    if (mode == SAMPLE_ONE_IN_N && rate > 1)
+    {
+        // Evenly spread over 1 to 2 * rate - 1, so the mean is
+        // the rate.
+        stride = 1 + (LONG)(NextRandom(state) % (ULONG)(2 * rate - 1));
+    }
+    else if (mode == SAMPLE_INTERVAL)
+    {
+        const long long now = HookStatsReadTimestamp();
+        if (state.lastSampleTime && now > state.lastSampleTime)
+        {
+            // Calls per microsecond over the last countdown,
+            // times the microseconds we want the next one to
+            // take.
+            const double calls = (double)weight * rate * ticksPerMicrosecond / (double)(now - state.lastSampleTime);
+            stride = calls < 1.0 ? 1 : calls > SAMPLE_MAX_STRIDE ? SAMPLE_MAX_STRIDE : (LONG)calls;
+        }
+        state.lastSampleTime = now;
+    }
+
+    state.stride = stride;
+    state.countdown = stride;
+    return weight;
+}
+
+bool SetHookSampling(int hookId, int mode, DWORD rate)
+{
+    if (mode != SAMPLE_ALL && mode != SAMPLE_ONE_IN_N && mode != SAMPLE_INTERVAL)
+        return false;
+    if (mode == SAMPLE_ONE_IN_N && (rate < 1 || rate > SAMPLE_MAX_STRIDE))
+        return false;
+    if (mode == SAMPLE_INTERVAL && (rate < 1 || rate > MAXLONG))
+        return false;
+
+    if (mode == SAMPLE_INTERVAL && ticksPerMicrosecond == 0.0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        ticksPerMicrosecond = (double)frequency.QuadPart / 1000000.0;
+    }
+
+    const int first = hookId == ALL_HOOKS ? 0 : hookId;
+    const int last = hookId == ALL_HOOKS ? NUM_HOOK_IDS - 1 : hookId;
+    if (first < 0 || last >= NUM_HOOK_IDS)
+        return false;
+
+    for (int i = first; i <= last; i++)
+    {
+        InterlockedExchange(&samplingConfig[i].rate, mode == SAMPLE_ALL ? 0 : (LONG)rate);
+        InterlockedExchange(&samplingConfig[i].mode, mode);
+    }
+    return true;
+}
+
+bool GetHookSampling(int hookId, int &mode, DWORD &rate)
+{
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS)
+        return false;
+
+    mode = (int)ReadNoFence(&samplingConfig[hookId].mode);
+    rate = (DWORD)ReadNoFence(&samplingConfig[hookId].rate);
+    return true;
+}
@@ -0,0 +1,86 @@
+//
+// hooksampling.h
+//
+// Sampling of the calls each hook records, for APIs called too
+// often to record every call.
+//
+// Each thread keeps a countdown per hook.  An unsampled call
+// only decrements it; the call that takes it to zero is
+// recorded with a weight of the number of calls the countdown
+// covered, and starts the next countdown.  Adding up the
+// weights of the recorded calls gives an estimate of the total
+// that is exact but for the calls in each thread's unfinished
+// countdown, whatever the sampling mode.  Latency histograms
+// and the event log only hold the recorded calls.
+//
+// In SAMPLE_ONE_IN_N mode each countdown is a random length
+// averaging the rate, so calls that come in a regular pattern
+// can't line up with the samples.  In SAMPLE_INTERVAL mode each
+// thread sizes its next countdown from how many calls it made
+// over the last one, aiming for one sample per rate
+// microseconds.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+#include "hookstats.h"
+
+// Sampling modes for SetHookSampling.
+#define SAMPLE_ALL              0    // Record every call.
+#define SAMPLE_ONE_IN_N         1    // Record one call in every rate, on
+                                     // average.
+#define SAMPLE_INTERVAL         2    // Record about one call per rate
+                                     // microseconds on each thread.
+
+// Longest countdown, in calls, so that an idle stretch in
+// SAMPLE_INTERVAL mode can't stop a thread sampling for good.
+#define SAMPLE_MAX_STRIDE       (1 << 20)
+
+// One thread's sampling state for one hook.
+struct HookSampleState
+{
+    LONG      countdown;         // Calls left until the next sample.
+    LONG      stride;            // Calls the current countdown covers.
+    long long lastSampleTime;    // QueryPerformanceCounter value at the
+                                 // last sample, for SAMPLE_INTERVAL.
+    ULONG     random;            // Random number state, for
+                                 // SAMPLE_ONE_IN_N.
+};
+
+// The calling thread's sampling state for each HookId.
+extern thread_local HookSampleState hookSampleStates[NUM_HOOK_IDS];
+
+// Starts a thread's next countdown for a hook, as configured,
+// and returns the weight of the call that ended the last one.
+long long StartNextSampleStride(int hookId, HookSampleState &state);
+
+//
+// Returns true if the calling thread should record this call
+// to a hook, and sets weight to the number of calls it stands
+// for.  Otherwise the call should only be passed through.  For
+// calls that aren't sampled, this is a single decrement of a
+// thread-local counter.
+//
+inline bool HookSampleCall(int hookId, long long &weight)
+{
+    HookSampleState &state = hookSampleStates[hookId];
+    if (--state.countdown > 0)
+        return false;
+
+    weight = StartNextSampleStride(hookId, state);
+    return true;
+}
+
+// Sets how a hook (one of the HookId values, or ALL_HOOKS)
+// samples its calls: one of the SAMPLE_* modes, and the rate
+// for it, which SAMPLE_ALL ignores.  Each thread switches over
+// once its current countdown runs out.  Sampling starts out as
+// SAMPLE_ALL.  Returns false if an argument is not valid.
+HOOKDLL_API bool SetHookSampling(int hookId, int mode, DWORD rate);
+
+// Gets how a hook samples its calls.  Returns false if the hook
+// ID is not valid.
+HOOKDLL_API bool GetHookSampling(int hookId, int &mode, DWORD &rate);
@@ -0,0 +1,200 @@
+//
+// hookstats.cpp
+//
+// Per-thread call counters and latency histograms for the API
+// hook functions.  See hookstats.h for a description.
+//
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <intrin.h>
+#include "hookstats.h"
+#include "telemetry.h"
+
+// The counter blocks.  These are normally in our own data, but
+// move into shared memory if telemetry is published.
+static TelemetryCounterBlock localCounterBlocks[TELEMETRY_COUNTER_BLOCKS];
+static TelemetryCounterBlock *counterBlocks = localCounterBlocks;
+
+// Index of the last counter block handed out.
+static volatile LONG lastCounterBlock = -1;
+
+// The calling thread's counter block, or null if the thread
+// hasn't called a hook yet.
+static thread_local TelemetryCounterBlock *threadCounterBlock = nullptr;
+
+//
+// Returns the counter block for the calling thread, assigning
+// one if this is the thread's first hooked call.
+//
+static TelemetryCounterBlock *GetThreadCounterBlock()
+{
+    TelemetryCounterBlock *block = threadCounterBlock;
+    if (!block)
+    {
+        const LONG index = InterlockedIncrement(&lastCounterBlock);
+        block = &counterBlocks[(ULONG)index % TELEMETRY_COUNTER_BLOCKS];
+        threadCounterBlock = block;
+    }
+
+    return block;
+}
+
+//
+// Returns the index of the highest set bit in a nonzero value.
+//
+static int HighestBit(unsigned long long value)
+{
+    unsigned long index;
+    if (_BitScanReverse(&index, (unsigned long)(value >> 32)))
+        return (int)index + 32;
+
+    _BitScanReverse(&index, (unsigned long)value);
+    return (int)index;
+}
+
+//
+// Returns the histogram bucket for a latency.  Values below 4
+// get a bucket each; above that, the two bits below the
+// highest set bit pick one of four buckets for that power of
+// two.
+//
+static int LatencyBucket(unsigned long long ticks)
+{
+    if (ticks < 4)
+        return (int)ticks;
+
+    const int bit = HighestBit(ticks);
+    const int bucket = (bit - 1) * 4 + (int)((ticks >> (bit - 2)) & 3);
+    return bucket < NUM_LATENCY_BUCKETS ? bucket : NUM_LATENCY_BUCKETS - 1;
+}
+
+//
+// Returns the largest latency that falls into a bucket.
+//
+static unsigned long long LatencyBucketLimit(int bucket)
+{
+    if (bucket < 4)
+        return (unsigned long long)bucket;
+
+    const int bit = bucket / 4 + 1;
+    const unsigned long long low = (unsigned long long)(4 + bucket % 4) << (bit - 2);
+    return low + ((1ULL << (bit - 2)) - 1);
+}
+
+void HookStatsSetStorage(TelemetryCounterBlock *blocks)
+{
+    counterBlocks = blocks ? blocks : localCounterBlocks;
+}
+
+const char *GetHookName(int hookId)
+{
+    return HookIdName(hookId);
+}
+
+void HookStatsCountCall(int hookId, long long weight)
+{
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS)
+        return;
+
+    // The block is normally owned by this thread alone, so the
+    // interlocked adds never contend with another core.
+    TelemetryCounterBlock *block = GetThreadCounterBlock();
+    InterlockedAdd64(&block->calls[hookId], weight);
+    InterlockedIncrement64(&block->sampledCalls[hookId]);
+}
+
+long long HookStatsGetCallCount(int hookId)
+{
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS)
+        return 0;
+
+    long long total = 0;
+    for (int i = 0; i < TELEMETRY_COUNTER_BLOCKS; i++)
+        total += InterlockedCompareExchange64(&counterBlocks[i].calls[hookId], 0, 0);
+
+    return total;
+}
+
+long long HookStatsGetSampledCallCount(int hookId)
+{
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS)
+        return 0;
+
+    long long total = 0;
+    for (int i = 0; i < TELEMETRY_COUNTER_BLOCKS; i++)
+        total += InterlockedCompareExchange64(&counterBlocks[i].sampledCalls[hookId], 0, 0);
+
+    return total;
+}
+
+long long HookStatsReadTimestamp()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void HookStatsRecordLatency(int hookId, int kind, long long ticks)
+{
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS || kind < 0 || kind >= NUM_LATENCY_KINDS)
+        return;
+
+    if (ticks < 0)
+        ticks = 0;
+
+    InterlockedIncrement64(&GetThreadCounterBlock()->latency[hookId][kind][LatencyBucket(ticks)]);
+}
+
+void HookStatsGetLatency(int hookId, int kind, LatencyPercentiles &percentiles)
+{
+    percentiles = LatencyPercentiles{0};
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS || kind < 0 || kind >= NUM_LATENCY_KINDS)
+        return;
+
+    long long buckets[NUM_LATENCY_BUCKETS] = {0};
+    for (int i = 0; i < TELEMETRY_COUNTER_BLOCKS; i++)
+    {
+        for (int b = 0; b < NUM_LATENCY_BUCKETS; b++)
+        {
+            buckets[b] += InterlockedCompareExchange64(&counterBlocks[i].latency[hookId][kind][b], 0, 0);
+        }
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    ComputeLatencyPercentiles(buckets, frequency.QuadPart, percentiles);
+}
+
+void ComputeLatencyPercentiles(const long long *buckets, long long ticksPerSecond, LatencyPercentiles &percentiles)
+{
+    percentiles = LatencyPercentiles{0};
+    for (int b = 0; b < NUM_LATENCY_BUCKETS; b++)
+        percentiles.count += buckets[b];
+    if (!percentiles.count || ticksPerSecond <= 0)
+        return;
+
+    const double microsecondsPerTick = 1000000.0 / (double)ticksPerSecond;
+
+    // Report the upper limit of the bucket each percentile falls
+    // in, so the figures never understate the latency.
+    const double fractions[3] = { 0.50, 0.99, 0.999 };
+    double *results[3] = { &percentiles.p50, &percentiles.p99, &percentiles.p999 };
+    for (int p = 0; p < 3; p++)
+    {
+        long long rank = (long long)(fractions[p] * (double)percentiles.count);
+        if (rank < 1)
+            rank = 1;
+
+        long long seen = 0;
+        for (int b = 0; b < NUM_LATENCY_BUCKETS; b++)
+        {
+            seen += buckets[b];
+            if (seen >= rank)
+            {
+                *results[p] = (double)LatencyBucketLimit(b) * microsecondsPerTick;
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,122 @@
+//
+// hookstats.h
+//
+// Call counters and latency histograms for the API hook
+// functions.
+//
+// Each thread that calls a hook gets its own cache-line
+// aligned block of counters, so hooked calls made at the
+// same moment on different threads never fight over the
+// same cache line and never take a lock.  The per-thread
+// blocks are only summed when someone asks for a total,
+// such as when the test results are printed.
+//
+// Latencies are measured in QueryPerformanceCounter ticks
+// and recorded into log-bucketed histograms: each power of
+// two is split into four buckets, so any recorded value is
+// within 25% of its bucket's bounds.  Recording never
+// allocates or locks.
+//
+
+#pragma once
+
+#include "hookdll.h"
+
+// Identifies each API that we hook, for indexing the counters.
+enum HookId
+{
+    HOOK_CREATEPROCESSW = 0,
+    HOOK_CREATEPROCESSA,
+    NUM_HOOK_IDS
+};
+
+// Returns the name of the API for a hook ID, or "unknown".
+// Defined here, rather than only exported, so tools that read
+// traces offline (see traceread.cpp) don't need the DLL.
+inline const char *HookIdName(int hookId)
+{
+    static const char *const hookNames[NUM_HOOK_IDS] =
+    {
+        "CreateProcessW",
+        "CreateProcessA",
+    };
+
+    if (hookId < 0 || hookId >= NUM_HOOK_IDS)
+        return "unknown";
+
+    return hookNames[hookId];
+}
+
+// Returns the name of the API for a hook ID.
+HOOKDLL_API const char *GetHookName(int hookId);
+
+// Identifies which part of a hooked call a latency was
+// measured for.
+enum HookLatencyKind
+{
+    LATENCY_API = 0,         // Pass-through call to the original API.
+    LATENCY_HOOK,            // Our own work in the hook before it.
+    LATENCY_INJECT,          // Injecting our DLL into a child process,
+                             // and adding it to the child job.
+    LATENCY_CHILD_LOAD,      // From resuming an injected child until
+                             // the loader runs our DllMain in it.
+    LATENCY_CHILD_INIT,      // Installing the child's hooks in DllMain.
+    LATENCY_CHILD_START,     // From then until the child's entry point.
+    LATENCY_CHILD_TOTAL,     // From the hook being called until the
+                             // child's entry point (see childstartup.h).
+    NUM_LATENCY_KINDS
+};
+
+// Number of buckets in each latency histogram.  The last one
+// also collects anything too large for the others.
+#define NUM_LATENCY_BUCKETS 164
+
+// Percentiles from a latency histogram, in microseconds.
+struct LatencyPercentiles
+{
+    long long count;         // Number of latencies recorded.
+    double    p50;
+    double    p99;
+    double    p999;
+};
+
+struct TelemetryCounterBlock;
+
+// Moves the counters into the given array of
+// TELEMETRY_COUNTER_BLOCKS blocks (see telemetry.h), or back to
+// our own data if null.  Only call this while no hooks are
+// installed.
+HOOKDLL_API void HookStatsSetStorage(TelemetryCounterBlock *blocks);
+
+// Counts one recorded call to the given hook on the calling
+// thread, which stands for weight calls if the hook samples its
+// calls (see hooksampling.h).
+HOOKDLL_API void HookStatsCountCall(int hookId, long long weight = 1);
+
+// Returns the total number of calls to the given hook, summed
+// across all threads.  If the hook samples its calls, this is
+// the estimate from the weights of the calls recorded.
+HOOKDLL_API long long HookStatsGetCallCount(int hookId);
+
+// Returns the number of calls to the given hook that were
+// recorded, summed across all threads.  This is the same as
+// HookStatsGetCallCount unless the hook samples its calls.
+HOOKDLL_API long long HookStatsGetSampledCallCount(int hookId);
+
+// Returns the current QueryPerformanceCounter value, for
+// timing the parts of a hooked call.
+HOOKDLL_API long long HookStatsReadTimestamp();
+
+// Records a latency, in QueryPerformanceCounter ticks, for the
+// given hook on the calling thread.
+HOOKDLL_API void HookStatsRecordLatency(int hookId, int kind, long long ticks);
+
+// Computes percentiles of the latencies recorded for the given
+// hook, summed across all threads.
+HOOKDLL_API void HookStatsGetLatency(int hookId, int kind, LatencyPercentiles &percentiles);
+
+// Computes percentiles of a latency histogram of
+// NUM_LATENCY_BUCKETS buckets, such as one summed from another
+// process's telemetry, whose ticks are at the given
+// QueryPerformanceFrequency.
+HOOKDLL_API void ComputeLatencyPercentiles(const long long *buckets, long long ticksPerSecond, LatencyPercentiles &percentiles);
@@ -0,0 +1,55 @@
+//
+// hookswap.cpp
+//
+// Replacing hook implementations while the hooks stay attached.
+// See hookswap.h for a description.
+//
+
+#include "hookswap.h"
+
+// Serializes swaps, so each one's epoch flips don't get mixed up
+// with another's.
+static SRWLOCK swapLock = SRWLOCK_INIT;
+
+// Spins before a waiting swap starts giving up its time slice.
+#define SWAP_SPIN_COUNT         1000
+
+//
+// Sends new calls to the other set of counters, then waits for
+// every call counted in the set they were going to, to return.
+//
+static void FlipAndDrain(HookImplementationSlot &slot)
+{
+    const LONG set = InterlockedIncrement(&slot.epoch) - 1;
+    HookSwapStripe *stripes = slot.stripes[set & 1];
+
+    for (int i = 0; i < HOOK_SWAP_STRIPES; i++)
+    {
+        // Most calls are over in microseconds, but one that's
+        // creating a process can take a while.
+        for (int spins = 0; ReadAcquire(&stripes[i].inFlight) != 0; spins++)
+        {
+            if (spins < SWAP_SPIN_COUNT)
+                YieldProcessor();
+            else if (spins < SWAP_SPIN_COUNT * 2)
+                SwitchToThread();
+            else
+                Sleep(1);
+        }
+    }
+}
+
+PVOID ReplaceHookImplementation(HookImplementationSlot &slot, PVOID implementation)
+{
+    AcquireSRWLockExclusive(&swapLock);
+
+    // Once this is done, any call that counts itself in after
+    // this point reads the new implementation, so only calls
+    // already counted in either set can be running the old one.
+    const PVOID previous = InterlockedExchangePointer(&slot.implementation, implementation);
+    FlipAndDrain(slot);
+    FlipAndDrain(slot);
+
+    ReleaseSRWLockExclusive(&swapLock);
+    return previous;
+}
@@ -0,0 +1,100 @@
+//
+// hookswap.h
+//
+// Lets a hook's implementation be replaced while the hook stays
+// attached, so the hook logic can be upgraded without the gap
+// between RemoveHooks and InstallHooks, when launches would go
+// unseen, and without suspending any threads.
+//
+// Each hook's detour is only a stub.  It reads the hook's
+// current implementation from a HookImplementationSlot and
+// calls it.  Swapping publishes a new implementation in the
+// slot, and the next call picks it up.  Calls that already
+// picked up the old implementation may still be running it,
+// though, and CreateProcess can take a long time, so the old
+// one is only handed back to the caller once they have all
+// returned.  After that nothing can call it again, and it can
+// be unloaded.
+//
+// Each slot keeps two sets of in-flight counters, and an epoch
+// whose low bit says which set new calls count themselves in.
+// A swap flips the epoch and waits for the other set to drain,
+// then does the same for the first set.  Since new calls always
+// go to the set that isn't being waited on, a steady stream of
+// calls can't hold a swap up.  The counters are striped by
+// thread across cache lines, so threads calling the same hook
+// rarely touch the same line.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookstats.h"
+
+// Number of counter stripes per set.  A power of two.
+#define HOOK_SWAP_STRIPES       16
+
+// One stripe of in-flight counters, on its own cache line.
+struct alignas(64) HookSwapStripe
+{
+    volatile LONG inFlight;
+};
+
+// The implementation of one hook, and who is running it.
+struct HookImplementationSlot
+{
+    PVOID volatile implementation;
+    volatile LONG  epoch;
+    HookSwapStripe stripes[2][HOOK_SWAP_STRIPES];
+};
+
+// Slot for each HookId.  Defined in hookdll.cpp, which starts
+// each one out with the hook's built-in implementation.
+extern HookImplementationSlot hookImplementations[NUM_HOOK_IDS];
+
+// What a call needs to remember between entering and leaving
+// a hook's implementation.
+struct HookSwapTicket
+{
+    PVOID          implementation;    // The implementation to call.
+    volatile LONG *inFlight;          // Counter to decrement when done.
+};
+
+//
+// Counts the calling thread as running the hook's current
+// implementation, and returns that implementation.  Pass the
+// ticket to LeaveHookImplementation once it returns.
+//
+inline HookSwapTicket EnterHookImplementation(int hookId)
+{
+    HookImplementationSlot &slot = hookImplementations[hookId];
+
+    // Thread IDs are multiples of four.
+    const DWORD stripe = (GetCurrentThreadId() >> 2) & (HOOK_SWAP_STRIPES - 1);
+    const LONG set = ReadNoFence(&slot.epoch) & 1;
+
+    // The increment is a full barrier, so either a swap waiting
+    // on this set sees it, or the read below sees the swap's new
+    // implementation.
+    HookSwapTicket ticket;
+    ticket.inFlight = &slot.stripes[set][stripe].inFlight;
+    InterlockedIncrement(ticket.inFlight);
+    ticket.implementation = ReadPointerAcquire(&slot.implementation);
+    return ticket;
+}
+
+//
+// Counts the calling thread as done with the implementation it
+// entered.  Doesn't change the last error value.
+//
+inline void LeaveHookImplementation(const HookSwapTicket &ticket)
+{
+    InterlockedDecrement(ticket.inFlight);
+}
+
+// Publishes a new implementation in a slot, then waits until no
+// thread is running the one it replaced.  Returns the replaced
+// implementation.  Swaps are serialized; calling this from
+// inside a hook implementation would wait forever.
+PVOID ReplaceHookImplementation(HookImplementationSlot &slot, PVOID implementation);
@@ -0,0 +1,134 @@
+//
+// installprofile.cpp
+//
+// Profile of the phases of installing hooks.  See
+// installprofile.h for a description.
+//
+
+#include "installprofile.h"
+
+#ifdef HOOKDLL_TRACELOGGING
+#include <TraceLoggingProvider.h>
+
+// The name hashes to the GUID, as ETW expects of TraceLogging
+// providers, so tools can enable it by name.
+TRACELOGGING_DEFINE_PROVIDER(installProvider, "DetoursDemo.HookInstall",
+    (0xb3e00e80, 0x0883, 0x5bcf, 0x6c, 0xf0, 0x0e, 0xd7, 0x8e, 0x97, 0x37, 0xbf));
+
+static bool providerRegistered = false;
+#endif
+
+// A phase as recorded, in ticks.
+struct PhaseTiming
+{
+    int         phase;
+    const char *hookName;
+    int         count;
+    long long   start;
+    long long   ticks;
+};
+
+static PhaseTiming phaseTimings[INSTALL_PROFILE_MAX_RECORDS];
+
+// Only one thread installs hooks at a time, but a lazy install
+// can be on a different thread than InstallHooks was.
+static volatile LONG numPhaseTimings = 0;
+
+// When the profile started.
+static long long profileStart = 0;
+
+void StartInstallProfile()
+{
+#ifdef HOOKDLL_TRACELOGGING
+    if (!providerRegistered)
+        providerRegistered = SUCCEEDED(TraceLoggingRegister(installProvider));
+#endif
+
+    InterlockedExchange(&numPhaseTimings, 0);
+    profileStart = StartInstallPhase();
+}
+
+long long StartInstallPhase()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void EndInstallPhase(int phase, long long start, const char *hookName, int count)
+{
+    const long long ticks = StartInstallPhase() - start;
+
+#ifdef HOOKDLL_TRACELOGGING
+    TraceLoggingWrite(installProvider, "HookInstallPhase",
+        TraceLoggingString(GetInstallPhaseName(phase), "Phase"),
+        TraceLoggingString(hookName ? hookName : "", "Hook"),
+        TraceLoggingInt32(count, "Count"),
+        TraceLoggingInt64(ticks, "DurationTicks"));
+#endif
+
+    const LONG index = InterlockedIncrement(&numPhaseTimings) - 1;
+    if (index >= INSTALL_PROFILE_MAX_RECORDS)
+    {
+        InterlockedExchange(&numPhaseTimings, INSTALL_PROFILE_MAX_RECORDS);
+        return;
+    }
+
+    PhaseTiming &timing = phaseTimings[index];
+    timing.phase = phase;
+    timing.hookName = hookName;
+    timing.count = count;
+    timing.start = start;
+    timing.ticks = ticks;
+}
+
+void StopInstallProfiling()
+{
+#ifdef HOOKDLL_TRACELOGGING
+    if (providerRegistered)
+        TraceLoggingUnregister(installProvider);
+    providerRegistered = false;
+#endif
+}
+
+const char *GetInstallPhaseName(int phase)
+{
+    static const char *const phaseNames[NUM_INSTALL_PHASES] =
+    {
+        "Resolve",
+        "Begin",
+        "Attach",
+        "UpdateThreads",
+        "Commit",
+        "Abort",
+    };
+
+    if (phase < 0 || phase >= NUM_INSTALL_PHASES)
+        return "unknown";
+
+    return phaseNames[phase];
+}
+
+int GetInstallProfile(InstallPhaseRecord *records, int maxRecords)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    const double microsecondsPerTick = 1000000.0 / (double)frequency.QuadPart;
+
+    int numRecords = (int)ReadAcquire(&numPhaseTimings);
+    if (numRecords > maxRecords)
+        numRecords = maxRecords;
+
+    for (int i = 0; i < numRecords; i++)
+    {
+        const PhaseTiming &timing = phaseTimings[i];
+        InstallPhaseRecord &record = records[i];
+        record.phase = timing.phase;
+        record.hookName = timing.hookName;
+        record.count = timing.count;
+        record.startMicroseconds = (double)(timing.start - profileStart) * microsecondsPerTick;
+        record.microseconds = (double)timing.ticks * microsecondsPerTick;
+    }
+
+    return numRecords;
+}
@@ -0,0 +1,82 @@
+//
+// installprofile.h
+//
+// Profile of where the time goes while hooks are installed,
+// before the first hooked call can happen: looking up each
+// target, DetourTransactionBegin, each DetourAttach, registering
+// (and so suspending) the threads, and DetourTransactionCommit,
+// which patches the code and resumes the threads.
+//
+// Each phase is timed with QueryPerformanceCounter into a fixed
+// array of records, from the start of InstallHooks (or of
+// DllMain in an injected child) until the array fills up, so
+// lazily installed batches show up too.
+//
+// If the DLL is built with HOOKDLL_TRACELOGGING defined (run
+// NMAKE TRACELOGGING=1), each phase is also written as a
+// TraceLogging event from the DetoursDemo.HookInstall provider
+// ({b3e00e80-0883-5bcf-6cf0-0ed78e9737bf}), so hook install
+// regressions can be seen in WPA alongside the host's own
+// startup trace.  Record with, for example:
+//
+//     wpr -start GeneralProfile
+//     tracelog -start hooks -guid *DetoursDemo.HookInstall -f hooks.etl
+//
+// With no session listening, each event costs a single check.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Phases of installing hooks.
+enum InstallPhase
+{
+    PHASE_RESOLVE = 0,       // Looking up one hook's target.
+    PHASE_BEGIN,             // DetourTransactionBegin.
+    PHASE_ATTACH,            // DetourAttach for one hook.
+    PHASE_UPDATE_THREADS,    // DetourUpdateThread for every thread
+                             // to suspend.
+    PHASE_COMMIT,            // DetourTransactionCommit.
+    PHASE_ABORT,             // DetourTransactionAbort, after an
+                             // attach failed.
+    NUM_INSTALL_PHASES
+};
+
+// Most phase records kept.
+#define INSTALL_PROFILE_MAX_RECORDS 256
+
+// One timed phase.
+struct InstallPhaseRecord
+{
+    int         phase;               // InstallPhase.
+    const char *hookName;            // Hook the phase was for, or null.
+    int         count;               // Threads updated, for
+                                     // PHASE_UPDATE_THREADS.
+    double      startMicroseconds;   // When the phase started, since the
+                                     // profile did.
+    double      microseconds;        // How long it took.
+};
+
+// Starts a new profile, throwing away the old one.
+void StartInstallProfile();
+
+// Returns a timestamp for the start of a phase.
+long long StartInstallPhase();
+
+// Records a phase that started at the given timestamp and just
+// ended.
+void EndInstallPhase(int phase, long long start, const char *hookName = nullptr, int count = 0);
+
+// Unregisters the TraceLogging provider, if there is one.
+// Called when the DLL unloads.
+void StopInstallProfiling();
+
+// Returns the name of a phase.
+HOOKDLL_API const char *GetInstallPhaseName(int phase);
+
+// Copies up to maxRecords records of the current profile, in
+// the order the phases ended.  Returns the number copied.
+HOOKDLL_API int GetInstallProfile(InstallPhaseRecord *records, int maxRecords);
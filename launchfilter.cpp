@@ -0,0 +1,285 @@
+//
+// launchfilter.cpp
+//
+// Filter that decides which process launches the hooks record.
+// See launchfilter.h for a description.
+//
+// Characters are mapped to classes first, so the DFA only needs
+// a column for each distinct character that appears in a rule,
+// plus one for everything else.  Upper and lower case letters
+// share a class, as do / and \.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "launchfilter.h"
+
+// Most DFA states there can be.  Each character of a rule adds
+// at most one state to the root, which is why this is bounded
+// by the length of the rules.
+#define FILTER_MAX_STATES       LAUNCH_FILTER_MAX_RULES
+
+// Most character classes there can be: one for each printable
+// ASCII character once case and slashes are folded, and one for
+// every other character.
+#define FILTER_MAX_CLASSES      72
+
+// Marks a transition not yet filled in while the DFA is built.
+#define FILTER_NO_STATE         0xFFFF
+
+// What a state says about a launch once the DFA reaches it.
+#define FILTER_ALLOW            0x01    // Matched an allow rule.
+#define FILTER_DENY             0x02    // Matched a deny rule.
+
+// The compiled filter.
+struct LaunchFilterDfa
+{
+    BYTE charClass[128];                 // Class of each ASCII character.
+    WORD next[FILTER_MAX_STATES][FILTER_MAX_CLASSES];
+    BYTE output[FILTER_MAX_STATES];      // FILTER_* flags of each state.
+    BYTE stopMask;                       // Flags that decide the outcome
+                                         // as soon as they are seen.
+    bool hasAllowRules;
+    int  numStates;
+    int  numClasses;
+};
+
+static LaunchFilterDfa filterDfa;
+static char filterRules[LAUNCH_FILTER_MAX_RULES] = {0};
+
+bool launchFilterActive = false;
+
+//
+// Returns the class of a rule character, giving it a new class
+// if it hasn't been seen before, or -1 if there are no classes
+// left.
+//
+static int ClassifyRuleChar(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        c = c - 'A' + 'a';
+    else if (c == '/')
+        c = '\\';
+
+    BYTE &charClass = filterDfa.charClass[(BYTE)c];
+    if (!charClass)
+    {
+        if (filterDfa.numClasses >= FILTER_MAX_CLASSES)
+            return -1;
+
+        const BYTE newClass = (BYTE)filterDfa.numClasses++;
+        filterDfa.charClass[(BYTE)c] = newClass;
+        if (c >= 'a' && c <= 'z')
+            filterDfa.charClass[c - 'a' + 'A'] = newClass;
+        else if (c == '\\')
+            filterDfa.charClass['/'] = newClass;
+    }
+
+    return charClass;
+}
+
+//
+// Adds a new state to the DFA with no transitions yet, and
+// returns its number.
+//
+static WORD AddFilterState()
+{
+    const WORD state = (WORD)filterDfa.numStates++;
+    for (int i = 0; i < FILTER_MAX_CLASSES; i++)
+        filterDfa.next[state][i] = FILTER_NO_STATE;
+    filterDfa.output[state] = 0;
+    return state;
+}
+
+//
+// Adds one rule to the trie the DFA is built from.  Returns
+// false if the rule is not valid.
+//
+static bool AddFilterRule(const char *rule, size_t length)
+{
+    BYTE flag = FILTER_ALLOW;
+    if (*rule == '+' || *rule == '-')
+    {
+        flag = (*rule == '-') ? FILTER_DENY : FILTER_ALLOW;
+        rule++;
+        length--;
+    }
+
+    if (!length)
+    {
+        printf("ERROR: Launch filter has an empty rule!\n");
+        return false;
+    }
+
+    WORD state = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (rule[i] < ' ' || rule[i] > '~')
+        {
+            printf("ERROR: Launch filter rules must be printable ASCII!\n");
+            return false;
+        }
+
+        const int charClass = ClassifyRuleChar(rule[i]);
+        if (charClass < 0)
+        {
+            printf("ERROR: Launch filter uses too many different characters!\n");
+            return false;
+        }
+
+        if (filterDfa.next[state][charClass] == FILTER_NO_STATE)
+            filterDfa.next[state][charClass] = AddFilterState();
+        state = filterDfa.next[state][charClass];
+    }
+
+    filterDfa.output[state] |= flag;
+    if (flag == FILTER_ALLOW)
+        filterDfa.hasAllowRules = true;
+    return true;
+}
+
+//
+// Turns the trie into a complete DFA by following the
+// Aho-Corasick failure links, breadth first, so every state
+// has a transition for every class and carries the outputs of
+// every rule that ends there.
+//
+static void BuildFilterDfa()
+{
+    WORD fail[FILTER_MAX_STATES];
+    WORD queue[FILTER_MAX_STATES];
+    int head = 0, tail = 0;
+
+    for (int c = 0; c < filterDfa.numClasses; c++)
+    {
+        WORD &next = filterDfa.next[0][c];
+        if (next == FILTER_NO_STATE)
+            next = 0;
+        else
+        {
+            fail[next] = 0;
+            queue[tail++] = next;
+        }
+    }
+
+    while (head < tail)
+    {
+        const WORD state = queue[head++];
+        filterDfa.output[state] |= filterDfa.output[fail[state]];
+        for (int c = 0; c < filterDfa.numClasses; c++)
+        {
+            WORD &next = filterDfa.next[state][c];
+            const WORD fallback = filterDfa.next[fail[state]][c];
+            if (next == FILTER_NO_STATE)
+                next = fallback;
+            else
+            {
+                fail[next] = fallback;
+                queue[tail++] = next;
+            }
+        }
+    }
+}
+
+bool SetLaunchFilter(const char *rules)
+{
+    launchFilterActive = false;
+    filterRules[0] = '\0';
+    if (!rules || !*rules)
+        return true;
+
+    if (strlen(rules) >= sizeof(filterRules))
+    {
+        printf("ERROR: Launch filter is longer than %d characters!\n", LAUNCH_FILTER_MAX_RULES - 1);
+        return false;
+    }
+
+    memset(&filterDfa, 0, sizeof(filterDfa));
+    filterDfa.numClasses = 1;
+    AddFilterState();
+
+    for (const char *rule = rules; *rule; )
+    {
+        const char *end = strchr(rule, ';');
+        const size_t length = end ? (size_t)(end - rule) : strlen(rule);
+        if (length && !AddFilterRule(rule, length))
+            return false;
+
+        rule += length;
+        if (*rule == ';')
+            rule++;
+    }
+
+    if (filterDfa.numStates == 1)
+        return true;
+
+    BuildFilterDfa();
+
+    // With no deny rules, the first allow match settles it.
+    bool hasDenyRules = false;
+    for (int i = 0; i < filterDfa.numStates; i++)
+        hasDenyRules = hasDenyRules || (filterDfa.output[i] & FILTER_DENY) != 0;
+    filterDfa.stopMask = hasDenyRules ? FILTER_DENY : FILTER_DENY | FILTER_ALLOW;
+
+    strcpy_s(filterRules, rules);
+    launchFilterActive = true;
+    return true;
+}
+
+const char *GetLaunchFilter()
+{
+    return filterRules;
+}
+
+//
+// Returns a string character as an unsigned code.
+//
+static ULONG FilterCharCode(char c)     { return (BYTE)c; }
+static ULONG FilterCharCode(WCHAR c)    { return c; }
+
+//
+// Runs the DFA over one string, adding the FILTER_* flags it
+// finds to those found so far.  Stops early once the flags
+// decide the outcome.
+//
+template <typename CharT>
+static BYTE ScanLaunchString(const CharT *s, BYTE found)
+{
+    if (!s || (found & filterDfa.stopMask))
+        return found;
+
+    WORD state = 0;
+    for (; *s; s++)
+    {
+        const ULONG c = FilterCharCode(*s);
+        state = filterDfa.next[state][c < 128 ? filterDfa.charClass[c] : 0];
+        found |= filterDfa.output[state];
+        if (found & filterDfa.stopMask)
+            break;
+    }
+
+    return found;
+}
+
+//
+// Does the work of RunLaunchFilter for either kind of string.
+//
+template <typename CharT>
+static bool RunFilter(const CharT *appName, const CharT *commandLine)
+{
+    const BYTE found = ScanLaunchString(commandLine, ScanLaunchString(appName, (BYTE)0));
+    if (found & FILTER_DENY)
+        return false;
+
+    return !filterDfa.hasAllowRules || (found & FILTER_ALLOW) != 0;
+}
+
+bool RunLaunchFilter(const char *appName, const char *commandLine)
+{
+    return RunFilter(appName, commandLine);
+}
+
+bool RunLaunchFilter(const WCHAR *appName, const WCHAR *commandLine)
+{
+    return RunFilter(appName, commandLine);
+}
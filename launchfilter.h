@@ -0,0 +1,63 @@
+//
+// launchfilter.h
+//
+// Filter that decides which process launches the hooks record.
+//
+// The filter is a list of rules separated by semicolons.  Each
+// rule is a string to look for anywhere in a launch's
+// application name or command line, ignoring case and treating
+// / and \ alike, prefixed with + to allow the launches it
+// matches or - to deny them:
+//
+//     -\windows\system32\;+cl.exe;+link.exe
+//
+// A launch is recorded if it matches no deny rule, and either
+// matches an allow rule or there are no allow rules.  A rule
+// with no prefix is an allow rule.
+//
+// The rules are compiled once, when the filter is set, into an
+// Aho-Corasick automaton laid out as a complete DFA table: the
+// hooks look up one table entry per character, never
+// backtrack, and stop as soon as the outcome is known, however
+// many rules there are.  Calls the filter rejects are passed
+// straight through without being counted, timed or logged.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Longest rule list SetLaunchFilter accepts, including the
+// terminating null.  This also bounds the size of the DFA.
+#define LAUNCH_FILTER_MAX_RULES 512
+
+// Sets the filter to the given rules, or clears it if rules is
+// null or empty.  Only call this while the hooks are not
+// installed.  Returns false, leaving the filter cleared, if a
+// rule is not valid.  Rules must be ASCII.
+HOOKDLL_API bool SetLaunchFilter(const char *rules);
+
+// Returns the rules the filter was set to, or an empty string
+// if there is no filter.  Injected children are given the same
+// rules.
+HOOKDLL_API const char *GetLaunchFilter();
+
+// True if a filter is set.  Only changed by SetLaunchFilter.
+extern bool launchFilterActive;
+
+// Runs the filter over a launch's strings.  Either may be null.
+// Returns true if the launch should be recorded.
+bool RunLaunchFilter(const char *appName, const char *commandLine);
+bool RunLaunchFilter(const WCHAR *appName, const WCHAR *commandLine);
+
+//
+// Returns true if a launch should be recorded, which is always
+// the case if there is no filter.
+//
+template <typename CharT>
+inline bool LaunchFilterPasses(const CharT *appName, const CharT *commandLine)
+{
+    return !launchFilterActive || RunLaunchFilter(appName, commandLine);
+}
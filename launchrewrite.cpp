@@ -0,0 +1,783 @@
+//
+// launchrewrite.cpp
+//
+// Stage that rewrites a launch's environment block and command
+// line.  See launchrewrite.h for a description.
+//
+// Each thread's arena is a single VirtualAlloc region, kept in a
+// fiber-local storage slot.  Hooked threads can come and go at
+// any time, and DllMain doesn't get thread notifications, so the
+// slot's callback is what frees the arena when the thread exits.
+// The slot is the arena's only owner; nothing else holds on to
+// it, so a fiber that goes away takes its arena with it.
+//
+// Cached environment blocks are allocated from the bottom of the
+// arena and stay until the arena fills up.  The command line is
+// allocated above them and given back after each launch.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "launchrewrite.h"
+
+// Most variables or rules there can be.  Each takes at least two
+// characters and a separator.
+#define LAUNCH_REWRITE_MAX_ITEMS    (LAUNCH_REWRITE_MAX_RULES / 2)
+
+// Longest command line CreateProcess accepts, including the
+// terminating null.
+#define MAX_COMMAND_LINE            32768
+
+// One variable to set, pointing into environmentVariables.
+struct LaunchVariable
+{
+    const char *text;        // NAME=value, not null-terminated.
+    size_t      nameLength;
+    size_t      length;
+};
+
+// One command line rewrite rule, pointing into commandLineRules.
+struct RewriteRule
+{
+    const char *find;
+    size_t      findLength;
+    const char *replace;
+    size_t      replaceLength;
+};
+
+static char environmentVariables[LAUNCH_REWRITE_MAX_RULES] = {0};
+static LaunchVariable launchVariables[LAUNCH_REWRITE_MAX_ITEMS];
+static int numLaunchVariables = 0;
+
+// Characters all the variables add to a block, with their nulls.
+static size_t launchVariablesLength = 0;
+
+static char commandLineRules[LAUNCH_REWRITE_MAX_RULES] = {0};
+static RewriteRule rewriteRules[LAUNCH_REWRITE_MAX_ITEMS];
+static int numRewriteRules = 0;
+
+// True for each ASCII character that starts some rule's string,
+// either case, so most characters are rejected with one lookup.
+static bool ruleStartChar[128] = {0};
+
+bool launchRewriteActive = false;
+
+// Changes whenever the variables do, so every thread's cached
+// blocks go stale at once.
+static volatile LONG rewriteGeneration = 0;
+
+// Changes whenever our own environment does, as seen by the
+// hooks on the APIs that change it, so a launch that inherits
+// our environment only has to fetch it again after that.
+static volatile LONG environmentGeneration = 0;
+
+// True while those hooks are attached.  Otherwise our environment
+// is fetched for every launch that inherits it.
+static volatile LONG environmentTracked = 0;
+
+// How the launches seen so far were rewritten.
+static volatile LONG64 numEnvironmentsBuilt = 0;
+static volatile LONG64 numEnvironmentCacheHits = 0;
+static volatile LONG64 numEnvironmentsUnchanged = 0;
+static volatile LONG64 numCommandLinesRewritten = 0;
+static volatile LONG64 numRewriteFailures = 0;
+
+// One cached environment block.  An entry with no block records
+// a source block that needed no change.  The hash only narrows
+// the search; a hit is confirmed against the copy of the source.
+struct RewriteCacheEntry
+{
+    bool        valid;
+    bool        wide;
+    LONG        generation;
+    ULONGLONG   hash;            // Of the source block's contents.
+    size_t      sourceLength;    // In characters, with every null.
+    const void *source;          // Copy of the source block.
+    const void *block;
+};
+
+// A thread's arena and the blocks it has cached.
+struct LaunchRewriteArena
+{
+    RewriteCacheEntry cache[LAUNCH_REWRITE_CACHE_SIZE];
+    int    nextCacheEntry;
+    size_t used;                 // Bytes allocated so far.
+    size_t scratchStart;         // Where the command line starts.
+
+    // What our own environment was rewritten to, for launches that
+    // inherit it: a cached block, or null if it needed no change.
+    bool        inheritedValid;
+    LONG        inheritedGeneration;         // environmentGeneration.
+    LONG        inheritedRewriteGeneration;  // rewriteGeneration.
+    const void *inheritedBlock;
+    alignas(16) BYTE memory[LAUNCH_REWRITE_ARENA_SIZE];
+};
+
+// Fiber-local storage slot that holds, and frees, each thread's
+// arena.
+static DWORD arenaFlsIndex = FLS_OUT_OF_INDEXES;
+static INIT_ONCE arenaFlsOnce = INIT_ONCE_STATIC_INIT;
+
+//
+// Returns a string character as an unsigned code.
+//
+static ULONG RewriteCharCode(char c)    { return (BYTE)c; }
+static ULONG RewriteCharCode(WCHAR c)   { return c; }
+
+//
+// Returns a string character as an unsigned code, with ASCII
+// letters in upper case.
+//
+template <typename CharT>
+static ULONG FoldedCharCode(CharT c)
+{
+    const ULONG code = RewriteCharCode(c);
+    return (code >= 'a' && code <= 'z') ? code - 'a' + 'A' : code;
+}
+
+//
+// Returns true if a string is printable ASCII.
+//
+static bool IsPrintableAscii(const char *s, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (s[i] < ' ' || s[i] > '~')
+            return false;
+    }
+
+    return true;
+}
+
+//
+// Compares the names of two variables, ignoring case.
+//
+static int CompareVariableNames(const LaunchVariable &a, const LaunchVariable &b)
+{
+    const size_t length = a.nameLength < b.nameLength ? a.nameLength : b.nameLength;
+    for (size_t i = 0; i < length; i++)
+    {
+        const ULONG ca = FoldedCharCode(a.text[i]), cb = FoldedCharCode(b.text[i]);
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+
+    return a.nameLength == b.nameLength ? 0 : (a.nameLength < b.nameLength ? -1 : 1);
+}
+
+//
+// Compares a variable's name with an environment block entry's,
+// ignoring case.
+//
+template <typename EnvChar>
+static int CompareEntryName(const LaunchVariable &variable, const EnvChar *entry, size_t nameLength)
+{
+    const size_t length = variable.nameLength < nameLength ? variable.nameLength : nameLength;
+    for (size_t i = 0; i < length; i++)
+    {
+        const ULONG cv = FoldedCharCode(variable.text[i]), ce = FoldedCharCode(entry[i]);
+        if (cv != ce)
+            return cv < ce ? -1 : 1;
+    }
+
+    return variable.nameLength == nameLength ? 0 : (variable.nameLength < nameLength ? -1 : 1);
+}
+
+bool SetLaunchEnvironment(const char *variables)
+{
+    InterlockedIncrement(&rewriteGeneration);
+    environmentVariables[0] = '\0';
+    numLaunchVariables = 0;
+    launchVariablesLength = 0;
+    launchRewriteActive = numRewriteRules > 0;
+    if (!variables || !*variables)
+        return true;
+
+    if (strlen(variables) >= sizeof(environmentVariables))
+    {
+        printf("ERROR: Launch environment is longer than %d characters!\n", LAUNCH_REWRITE_MAX_RULES - 1);
+        return false;
+    }
+    strcpy_s(environmentVariables, variables);
+
+    for (const char *item = environmentVariables; *item; )
+    {
+        const char *end = strchr(item, ';');
+        const size_t length = end ? (size_t)(end - item) : strlen(item);
+        if (length)
+        {
+            const char *equals = (const char *)memchr(item, '=', length);
+            if (!equals || equals == item || !IsPrintableAscii(item, length))
+            {
+                printf("ERROR: Launch environment variables must be printable ASCII NAME=value pairs!\n");
+                SetLaunchEnvironment(nullptr);
+                return false;
+            }
+
+            // Keep them sorted by name, so a block can be merged
+            // with them in one pass.
+            LaunchVariable variable = { item, (size_t)(equals - item), length };
+            int i = numLaunchVariables;
+            for (; i > 0 && CompareVariableNames(variable, launchVariables[i - 1]) < 0; i--)
+                launchVariables[i] = launchVariables[i - 1];
+
+            if (i > 0 && !CompareVariableNames(variable, launchVariables[i - 1]))
+            {
+                printf("ERROR: Launch environment sets %.*s more than once!\n", (int)variable.nameLength, item);
+                SetLaunchEnvironment(nullptr);
+                return false;
+            }
+
+            launchVariables[i] = variable;
+            numLaunchVariables++;
+            launchVariablesLength += length + 1;
+        }
+
+        item += length;
+        if (*item == ';')
+            item++;
+    }
+
+    launchRewriteActive = numLaunchVariables > 0 || numRewriteRules > 0;
+    return true;
+}
+
+const char *GetLaunchEnvironment()
+{
+    return environmentVariables;
+}
+
+bool SetCommandLineRewrite(const char *rules)
+{
+    commandLineRules[0] = '\0';
+    numRewriteRules = 0;
+    memset(ruleStartChar, 0, sizeof(ruleStartChar));
+    launchRewriteActive = numLaunchVariables > 0;
+    if (!rules || !*rules)
+        return true;
+
+    if (strlen(rules) >= sizeof(commandLineRules))
+    {
+        printf("ERROR: Command line rewrite is longer than %d characters!\n", LAUNCH_REWRITE_MAX_RULES - 1);
+        return false;
+    }
+    strcpy_s(commandLineRules, rules);
+
+    for (const char *item = commandLineRules; *item; )
+    {
+        const char *end = strchr(item, ';');
+        const size_t length = end ? (size_t)(end - item) : strlen(item);
+        if (length)
+        {
+            const char *arrow = strstr(item, "=>");
+            if (!arrow || arrow == item || arrow + 2 > item + length || !IsPrintableAscii(item, length))
+            {
+                printf("ERROR: Command line rewrite rules must be printable ASCII find=>replace pairs!\n");
+                SetCommandLineRewrite(nullptr);
+                return false;
+            }
+
+            RewriteRule &rule = rewriteRules[numRewriteRules++];
+            rule.find = item;
+            rule.findLength = (size_t)(arrow - item);
+            rule.replace = arrow + 2;
+            rule.replaceLength = length - rule.findLength - 2;
+
+            const char first = item[0];
+            ruleStartChar[(BYTE)first] = true;
+            if (first >= 'a' && first <= 'z')
+                ruleStartChar[first - 'a' + 'A'] = true;
+            else if (first >= 'A' && first <= 'Z')
+                ruleStartChar[first - 'A' + 'a'] = true;
+        }
+
+        item += length;
+        if (*item == ';')
+            item++;
+    }
+
+    launchRewriteActive = numLaunchVariables > 0 || numRewriteRules > 0;
+    return true;
+}
+
+const char *GetCommandLineRewrite()
+{
+    return commandLineRules;
+}
+
+void GetLaunchRewriteStats(LaunchRewriteStats &stats)
+{
+    stats.environmentsBuilt = ReadNoFence64(&numEnvironmentsBuilt);
+    stats.environmentCacheHits = ReadNoFence64(&numEnvironmentCacheHits);
+    stats.environmentsUnchanged = ReadNoFence64(&numEnvironmentsUnchanged);
+    stats.commandLinesRewritten = ReadNoFence64(&numCommandLinesRewritten);
+    stats.failures = ReadNoFence64(&numRewriteFailures);
+}
+
+//
+// Frees a thread's arena, when the thread exits or its
+// fiber-local storage slot is freed.
+//
+static VOID WINAPI FreeRewriteArena(PVOID arena)
+{
+    if (arena)
+        VirtualFree(arena, 0, MEM_RELEASE);
+}
+
+//
+// Allocates the fiber-local storage slot.  Called once, by
+// InitOnceExecuteOnce.
+//
+static BOOL CALLBACK AllocateArenaSlot(PINIT_ONCE, PVOID, PVOID *)
+{
+    arenaFlsIndex = FlsAlloc(FreeRewriteArena);
+    return TRUE;
+}
+
+//
+// Returns the calling thread's arena, allocating it if this is
+// the thread's first rewritten launch, or null if it can't be.
+//
+static LaunchRewriteArena *GetRewriteArena()
+{
+    InitOnceExecuteOnce(&arenaFlsOnce, AllocateArenaSlot, nullptr, nullptr);
+    if (arenaFlsIndex == FLS_OUT_OF_INDEXES)
+        return nullptr;
+
+    LaunchRewriteArena *arena = (LaunchRewriteArena *)FlsGetValue(arenaFlsIndex);
+    if (arena)
+        return arena;
+
+    arena = (LaunchRewriteArena *)VirtualAlloc(nullptr, sizeof(LaunchRewriteArena), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!arena)
+        return nullptr;
+
+    if (!FlsSetValue(arenaFlsIndex, arena))
+    {
+        VirtualFree(arena, 0, MEM_RELEASE);
+        return nullptr;
+    }
+
+    return arena;
+}
+
+//
+// Allocates from an arena, or returns null if there isn't room.
+//
+static void *AllocateFromArena(LaunchRewriteArena *arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (size > sizeof(arena->memory) - arena->used)
+        return nullptr;
+
+    void *p = arena->memory + arena->used;
+    arena->used += size;
+    return p;
+}
+
+//
+// Empties an arena, throwing away its cached blocks.
+//
+static void ResetRewriteArena(LaunchRewriteArena *arena)
+{
+    for (int i = 0; i < LAUNCH_REWRITE_CACHE_SIZE; i++)
+        arena->cache[i].valid = false;
+    arena->inheritedValid = false;
+    arena->nextCacheEntry = 0;
+    arena->used = 0;
+    arena->scratchStart = 0;
+}
+
+//
+// Copies one NAME=value variable into a block, with its null.
+//
+template <typename EnvChar>
+static EnvChar *CopyVariable(EnvChar *out, const LaunchVariable &variable)
+{
+    for (size_t i = 0; i < variable.length; i++)
+        *out++ = (EnvChar)variable.text[i];
+    *out++ = 0;
+    return out;
+}
+
+//
+// Returns true if an environment block entry already has a
+// variable's value.  Values are compared exactly.
+//
+template <typename EnvChar>
+static bool HasVariableValue(const EnvChar *entry, size_t entryLength, const LaunchVariable &variable)
+{
+    if (entryLength != variable.length)
+        return false;
+
+    for (size_t i = variable.nameLength; i < entryLength; i++)
+    {
+        if (RewriteCharCode(entry[i]) != RewriteCharCode(variable.text[i]))
+            return false;
+    }
+
+    return true;
+}
+
+//
+// Returns the index of the variable with an environment block
+// entry's name, or -1 if there isn't one.
+//
+template <typename EnvChar>
+static int FindVariable(const EnvChar *entry, size_t nameLength)
+{
+    int low = 0, high = numLaunchVariables - 1;
+    while (low <= high)
+    {
+        const int middle = (low + high) / 2;
+        const int order = CompareEntryName(launchVariables[middle], entry, nameLength);
+        if (!order)
+            return middle;
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+
+    return -1;
+}
+
+//
+// Merges the variables into a copy of a source block, keeping
+// the source's order and putting each new variable where it
+// sorts.  Entries for variables we set are replaced, including
+// any duplicates an unsorted block has.  Returns true if the
+// copy differs from the source.
+//
+template <typename EnvChar>
+static bool MergeEnvironment(const EnvChar *source, EnvChar *out)
+{
+    bool changed = false;
+    int next = 0;
+    for (const EnvChar *entry = source; *entry; )
+    {
+        size_t entryLength = 0;
+        while (entry[entryLength])
+            entryLength++;
+
+        // Names like =C: that hold each drive's current directory
+        // start with =, so the name ends at the next one.
+        size_t nameLength = 1;
+        while (nameLength < entryLength && entry[nameLength] != '=')
+            nameLength++;
+
+        const int match = FindVariable(entry, nameLength);
+        while (next < numLaunchVariables && CompareEntryName(launchVariables[next], entry, nameLength) < 0)
+        {
+            out = CopyVariable(out, launchVariables[next++]);
+            changed = true;
+        }
+
+        if (match < 0)
+        {
+            memcpy(out, entry, (entryLength + 1) * sizeof(EnvChar));
+            out += entryLength + 1;
+        }
+        else if (match == next)
+        {
+            if (!HasVariableValue(entry, entryLength, launchVariables[match]))
+                changed = true;
+            out = CopyVariable(out, launchVariables[next++]);
+        }
+        else
+            changed = true;
+
+        entry += entryLength + 1;
+    }
+
+    while (next < numLaunchVariables)
+    {
+        out = CopyVariable(out, launchVariables[next++]);
+        changed = true;
+    }
+    *out = 0;
+    return changed;
+}
+
+//
+// Finds or builds the rewritten copy of an environment block,
+// and sets block to it, or to null if the source needs no
+// change.  Returns false if there was no room to build it.
+//
+template <typename EnvChar>
+static bool RewriteEnvironment(LaunchRewriteArena *arena, const EnvChar *source, const void *&block)
+{
+    // One read-only pass over the source, to hash it and find its
+    // end.  A caller can change its block in place between
+    // launches, so only the contents can be trusted as a key.
+    ULONGLONG hash = 14695981039346656037ULL;
+    const EnvChar *p = source;
+    while (*p)
+    {
+        for (; *p; p++)
+            hash = (hash ^ RewriteCharCode(*p)) * 1099511628211ULL;
+        hash = hash * 1099511628211ULL;
+        p++;
+    }
+    const size_t sourceLength = (size_t)(p - source) + 1;
+
+    const bool wide = sizeof(EnvChar) != 1;
+    const LONG generation = ReadNoFence(&rewriteGeneration);
+    for (int i = 0; i < LAUNCH_REWRITE_CACHE_SIZE; i++)
+    {
+        const RewriteCacheEntry &entry = arena->cache[i];
+        if (entry.valid && entry.wide == wide && entry.generation == generation &&
+            entry.hash == hash && entry.sourceLength == sourceLength &&
+            !memcmp(entry.source, source, sourceLength * sizeof(EnvChar)))
+        {
+            block = entry.block;
+            InterlockedIncrement64(block ? &numEnvironmentCacheHits : &numEnvironmentsUnchanged);
+            return true;
+        }
+    }
+
+    // The copy of the source goes first, then the merged block,
+    // which is given back if it turns out to be the same.
+    const size_t sourceSize = sourceLength * sizeof(EnvChar);
+    const size_t size = (sourceLength + launchVariablesLength) * sizeof(EnvChar);
+    EnvChar *sourceCopy = (EnvChar *)AllocateFromArena(arena, sourceSize);
+    EnvChar *merged = sourceCopy ? (EnvChar *)AllocateFromArena(arena, size) : nullptr;
+    if (!merged)
+    {
+        ResetRewriteArena(arena);
+        sourceCopy = (EnvChar *)AllocateFromArena(arena, sourceSize);
+        merged = sourceCopy ? (EnvChar *)AllocateFromArena(arena, size) : nullptr;
+        if (!merged)
+        {
+            arena->used = 0;
+            return false;
+        }
+    }
+    const size_t mark = (size_t)((BYTE *)merged - arena->memory);
+    memcpy(sourceCopy, source, sourceSize);
+
+    if (MergeEnvironment(source, merged))
+    {
+        block = merged;
+        InterlockedIncrement64(&numEnvironmentsBuilt);
+    }
+    else
+    {
+        arena->used = mark;
+        block = nullptr;
+        InterlockedIncrement64(&numEnvironmentsUnchanged);
+    }
+
+    RewriteCacheEntry &entry = arena->cache[arena->nextCacheEntry];
+    arena->nextCacheEntry = (arena->nextCacheEntry + 1) % LAUNCH_REWRITE_CACHE_SIZE;
+    entry.valid = true;
+    entry.wide = wide;
+    entry.generation = generation;
+    entry.hash = hash;
+    entry.sourceLength = sourceLength;
+    entry.source = sourceCopy;
+    entry.block = block;
+    return true;
+}
+
+//
+// Finds or builds the rewritten copy of our own environment, for
+// a launch that inherits it, like RewriteEnvironment.  While the
+// environment hooks are attached, the result is kept until our
+// environment changes, so a launch storm doesn't copy it out
+// every time.
+//
+static bool RewriteInheritedEnvironment(LaunchRewriteArena *arena, const void *&block)
+{
+    const bool tracked = ReadNoFence(&environmentTracked) != 0;
+    const LONG generation = ReadNoFence(&environmentGeneration);
+    const LONG rewrite = ReadNoFence(&rewriteGeneration);
+    if (tracked && arena->inheritedValid && arena->inheritedGeneration == generation &&
+        arena->inheritedRewriteGeneration == rewrite)
+    {
+        block = arena->inheritedBlock;
+        InterlockedIncrement64(block ? &numEnvironmentCacheHits : &numEnvironmentsUnchanged);
+        return true;
+    }
+
+    WCHAR *inherited = GetEnvironmentStringsW();
+    const bool ok = inherited && RewriteEnvironment(arena, (const WCHAR *)inherited, block);
+    if (inherited)
+        FreeEnvironmentStringsW(inherited);
+
+    // Building the block may have emptied the arena, so this is
+    // only recorded afterwards.
+    arena->inheritedValid = ok && tracked;
+    arena->inheritedGeneration = generation;
+    arena->inheritedRewriteGeneration = rewrite;
+    arena->inheritedBlock = block;
+    return ok;
+}
+
+//
+// Returns the rule whose string the command line has at the
+// given position, ignoring case, or null if there isn't one.
+//
+template <typename CharT>
+static const RewriteRule *MatchRewriteRule(const CharT *s)
+{
+    const ULONG first = RewriteCharCode(*s);
+    if (first >= 128 || !ruleStartChar[first])
+        return nullptr;
+
+    for (int i = 0; i < numRewriteRules; i++)
+    {
+        const RewriteRule &rule = rewriteRules[i];
+        size_t j = 0;
+        while (j < rule.findLength && s[j] && FoldedCharCode(s[j]) == FoldedCharCode(rule.find[j]))
+            j++;
+        if (j == rule.findLength)
+            return &rule;
+    }
+
+    return nullptr;
+}
+
+//
+// Returns the rewritten copy of a command line, in the arena, or
+// null if no rule matches it or the copy doesn't fit.
+//
+template <typename CharT>
+static CharT *RewriteCommandLine(LaunchRewriteArena *arena, const CharT *commandLine)
+{
+    // The first pass only measures, so a command line no rule
+    // matches is never copied.
+    size_t length = 0;
+    bool matched = false;
+    for (const CharT *p = commandLine; *p; )
+    {
+        const RewriteRule *rule = MatchRewriteRule(p);
+        if (rule)
+        {
+            length += rule->replaceLength;
+            p += rule->findLength;
+            matched = true;
+        }
+        else
+        {
+            length++;
+            p++;
+        }
+    }
+
+    if (!matched)
+        return nullptr;
+
+    CharT *rewritten = (length < MAX_COMMAND_LINE) ?
+        (CharT *)AllocateFromArena(arena, (length + 1) * sizeof(CharT)) : nullptr;
+    if (!rewritten)
+    {
+        InterlockedIncrement64(&numRewriteFailures);
+        return nullptr;
+    }
+
+    CharT *out = rewritten;
+    for (const CharT *p = commandLine; *p; )
+    {
+        const RewriteRule *rule = MatchRewriteRule(p);
+        if (rule)
+        {
+            for (size_t i = 0; i < rule->replaceLength; i++)
+                *out++ = (CharT)rule->replace[i];
+            p += rule->findLength;
+        }
+        else
+            *out++ = *p++;
+    }
+    *out = 0;
+
+    InterlockedIncrement64(&numCommandLinesRewritten);
+    return rewritten;
+}
+
+//
+// Does the work of RewriteLaunch for either kind of string.
+//
+template <typename CharT>
+static void Rewrite(CharT *&commandLine, LPVOID &environment, DWORD &creationFlags)
+{
+    LaunchRewriteArena *arena = GetRewriteArena();
+    if (!arena)
+    {
+        InterlockedIncrement64(&numRewriteFailures);
+        return;
+    }
+    arena->scratchStart = arena->used;
+
+    if (numLaunchVariables)
+    {
+        // The block is Unicode if the caller says so, whichever
+        // API it called.  With no block, the child would inherit
+        // ours, so that is what gets rewritten.
+        const void *block = nullptr;
+        bool ok;
+        if (!environment)
+        {
+            ok = RewriteInheritedEnvironment(arena, block);
+            if (block)
+                creationFlags |= CREATE_UNICODE_ENVIRONMENT;
+        }
+        else if (creationFlags & CREATE_UNICODE_ENVIRONMENT)
+            ok = RewriteEnvironment(arena, (const WCHAR *)environment, block);
+        else
+            ok = RewriteEnvironment(arena, (const char *)environment, block);
+
+        if (!ok)
+            InterlockedIncrement64(&numRewriteFailures);
+        else if (block)
+            environment = (LPVOID)block;
+        arena->scratchStart = arena->used;
+    }
+
+    // CreateProcessW can write to its command line, so the
+    // rewritten copy is writable too.
+    if (numRewriteRules && commandLine)
+    {
+        CharT *rewritten = RewriteCommandLine(arena, commandLine);
+        if (rewritten)
+            commandLine = rewritten;
+    }
+}
+
+void RewriteLaunch(char *&commandLine, LPVOID &environment, DWORD &creationFlags)
+{
+    Rewrite(commandLine, environment, creationFlags);
+}
+
+void RewriteLaunch(WCHAR *&commandLine, LPVOID &environment, DWORD &creationFlags)
+{
+    Rewrite(commandLine, environment, creationFlags);
+}
+
+void FinishLaunchRewrite()
+{
+    // Finds nothing if Rewrite couldn't get an arena either.
+    LaunchRewriteArena *arena = (LaunchRewriteArena *)FlsGetValue(arenaFlsIndex);
+    if (arena)
+        arena->used = arena->scratchStart;
+}
+
+void NoteEnvironmentChanged()
+{
+    InterlockedIncrement(&environmentGeneration);
+}
+
+void TrackEnvironmentChanges(bool tracked)
+{
+    InterlockedIncrement(&environmentGeneration);
+    InterlockedExchange(&environmentTracked, tracked ? 1 : 0);
+}
+
+void StopLaunchRewrite()
+{
+    // Freeing the slot calls FreeRewriteArena for every thread
+    // that has an arena.
+    if (arenaFlsIndex != FLS_OUT_OF_INDEXES)
+        FlsFree(arenaFlsIndex);
+    arenaFlsIndex = FLS_OUT_OF_INDEXES;
+}
@@ -0,0 +1,133 @@
+//
+// launchrewrite.h
+//
+// Stage that rewrites a launch's environment block and command
+// line before the hooks pass it on to the original CreateProcess,
+// for instance to hand every child some tracing configuration.
+//
+// The environment is a list of variables separated by
+// semicolons, each set in every child, replacing any variable of
+// the same name (ignoring case) the child would have inherited:
+//
+//     TRACE_LEVEL=3;TRACE_DIR=c:\traces
+//
+// The command line rewrite is a list of rules separated by
+// semicolons, each replacing every occurrence of a string in the
+// command line, ignoring case, with another:
+//
+//     cl.exe =>cl.exe /Bt ;link.exe =>link.exe /time
+//
+// Both must be printable ASCII.
+//
+// Launch storms, such as a build system starting thousands of
+// compilers, tend to pass the same environment every time, so
+// the stage avoids work it has done before:
+//
+//   * Nothing is copied unless something actually changes.  A
+//     command line no rule matches, or an environment that
+//     already has every variable set to the same value, is passed
+//     on as it is.
+//
+//   * Each thread has its own arena, so building a block never
+//     allocates or locks.  A new environment block is merged in
+//     one pass from the caller's block and the variables, which
+//     are kept sorted by name.
+//
+//   * Each thread caches the environment blocks it has built,
+//     keyed by the contents of the block they were built from,
+//     so a launch with the same environment as an earlier one
+//     only has to hash the caller's block, and compare it with
+//     the cached copy of the block the hash matches, to find its
+//     rewritten block, or to find that it needed none.
+//
+// A launch with no environment block inherits ours, which then
+// stands in for the caller's block, and gets a Unicode block if
+// it is rewritten.  Fetching our environment means copying it,
+// so each thread keeps what it was rewritten to, until one of
+// the APIs that change our environment is called (the hooks on
+// them call NoteEnvironmentChanged).  Without those hooks, it is
+// fetched for every such launch.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Longest variable list or rule list accepted, including the
+// terminating null.
+#define LAUNCH_REWRITE_MAX_RULES    512
+
+// Size of each thread's arena, which holds the thread's cached
+// environment blocks and the current launch's command line.
+// When it fills up, the thread's cache is thrown away.
+#define LAUNCH_REWRITE_ARENA_SIZE   (256 * 1024)
+
+// Number of environment blocks each thread caches.
+#define LAUNCH_REWRITE_CACHE_SIZE   8
+
+// How the launches the stage has seen were rewritten.
+struct LaunchRewriteStats
+{
+    long long environmentsBuilt;      // New environment blocks merged.
+    long long environmentCacheHits;   // Launches given a cached block.
+    long long environmentsUnchanged;  // Launches whose environment
+                                      // needed no change.
+    long long commandLinesRewritten;  // Command lines a rule matched.
+    long long failures;               // Launches passed on as they
+                                      // were, because a rewritten
+                                      // block didn't fit.
+};
+
+// Sets the variables to set in each child's environment, or
+// clears them if variables is null or empty.  Only call this
+// while the hooks are not installed.  Returns false, leaving the
+// variables cleared, if one is not valid.
+HOOKDLL_API bool SetLaunchEnvironment(const char *variables);
+
+// Returns the variables set in each child's environment, or an
+// empty string if there are none.  Injected children are given
+// the same variables.
+HOOKDLL_API const char *GetLaunchEnvironment();
+
+// Sets the command line rewrite rules, or clears them if rules
+// is null or empty.  Only call this while the hooks are not
+// installed.  Returns false, leaving the rules cleared, if a
+// rule is not valid.
+HOOKDLL_API bool SetCommandLineRewrite(const char *rules);
+
+// Returns the command line rewrite rules, or an empty string if
+// there are none.  Injected children are given the same rules.
+HOOKDLL_API const char *GetCommandLineRewrite();
+
+// Returns how the launches the stage has seen were rewritten.
+HOOKDLL_API void GetLaunchRewriteStats(LaunchRewriteStats &stats);
+
+// True if there are variables or rules.  Only changed by
+// SetLaunchEnvironment and SetCommandLineRewrite.
+extern bool launchRewriteActive;
+
+// Rewrites a launch's command line, environment block and
+// creation flags, if anything needs changing, by pointing them
+// at rewritten copies in the calling thread's arena.  Leaves
+// them alone otherwise, or if there is no room for the copies.
+// Call FinishLaunchRewrite once the launch has been made.
+void RewriteLaunch(char *&commandLine, LPVOID &environment, DWORD &creationFlags);
+void RewriteLaunch(WCHAR *&commandLine, LPVOID &environment, DWORD &creationFlags);
+
+// Gives the rewritten command line's space in the arena back.
+// Cached environment blocks stay.
+void FinishLaunchRewrite();
+
+// Records that our own environment has changed, so launches that
+// inherit it rewrite it again.  Called by the hooks on the APIs
+// that change it.
+void NoteEnvironmentChanged();
+
+// Sets whether those hooks are attached.  While they aren't,
+// our environment is fetched for every launch that inherits it.
+void TrackEnvironmentChanges(bool tracked);
+
+// Frees every thread's arena.  Called when the DLL unloads.
+void StopLaunchRewrite();
@@ -0,0 +1,345 @@
+//
+// reaper.cpp
+//
+// Asynchronous reaping of the child processes the demo program
+// launches.  See reaper.h for a description.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "reaper.h"
+#include "childstartup.h"
+
+// Completion keys for the messages on the port.
+#define REAPER_KEY_JOB          1    // From the job; bytes is the message, overlapped the process ID.
+#define REAPER_KEY_ADD          2    // Track a child; bytes is its ID, overlapped its process handle.
+#define REAPER_KEY_ADD_UNJOBBED 3    // Likewise, for a child that couldn't be put in the job.
+#define REAPER_KEY_TERMINATE    4    // Terminate a child; bytes is its ID.
+#define REAPER_KEY_STOP         5    // Stop; bytes is how long to wait for the rest, in ms.
+
+// Most children tracked at once.  Any more are handed back
+// right away, with their handles closed.
+#define REAPER_MAX_PROCESSES    1024
+
+// Handles of exited children are closed once this many have
+// piled up, or once the port has been idle for
+// REAPER_FLUSH_MS, whichever is first.
+#define REAPER_CLOSE_BATCH      32
+#define REAPER_FLUSH_MS         100
+
+// A child the reaper is waiting on.
+struct ReapedProcess
+{
+    DWORD  processId;
+    HANDLE process;
+    bool   inJob;        // False if the job won't report its exit,
+                         // so it has to be polled.
+};
+
+static HANDLE reaperJob = nullptr;
+static HANDLE reaperPort = nullptr;
+static HANDLE reaperThread = nullptr;
+
+// Owned by the reaper thread until it exits.
+static ReapedProcess reapedProcesses[REAPER_MAX_PROCESSES];
+static int numReapedProcesses = 0;
+static HANDLE closeBatch[REAPER_CLOSE_BATCH];
+static int numToClose = 0;
+static ReaperStats reaperStats = {0};
+
+// Number of tracked children that aren't in the job.
+static int numUnjobbedProcesses = 0;
+
+//
+// Closes the handles of the children that have exited.
+//
+static void FlushCloseBatch()
+{
+    for (int i = 0; i < numToClose; i++)
+        CloseHandle(closeBatch[i]);
+    numToClose = 0;
+}
+
+//
+// Queues a handle to be closed with the next batch.
+//
+static void QueueClose(HANDLE handle)
+{
+    closeBatch[numToClose++] = handle;
+    if (numToClose == REAPER_CLOSE_BATCH)
+        FlushCloseBatch();
+}
+
+//
+// Returns the index of a tracked child, or -1 if it isn't
+// tracked.
+//
+static int FindReapedProcess(DWORD processId)
+{
+    for (int i = 0; i < numReapedProcesses; i++)
+    {
+        if (reapedProcesses[i].processId == processId)
+            return i;
+    }
+
+    return -1;
+}
+
+//
+// Stops tracking a child, and queues its handle to be closed.
+//
+static void RemoveReapedProcess(int index)
+{
+    if (!reapedProcesses[index].inJob)
+        numUnjobbedProcesses--;
+    QueueClose(reapedProcesses[index].process);
+    reapedProcesses[index] = reapedProcesses[--numReapedProcesses];
+}
+
+//
+// Checks the handles of tracked children for ones that have
+// exited without the job telling us, either all of them or
+// only those that aren't in the job, and stops tracking those.
+//
+static void PollReapedProcesses(bool all)
+{
+    for (int i = numReapedProcesses - 1; i >= 0; i--)
+    {
+        if ((all || !reapedProcesses[i].inJob) &&
+            WaitForSingleObject(reapedProcesses[i].process, 0) == WAIT_OBJECT_0)
+        {
+            RemoveReapedProcess(i);
+            reaperStats.numReaped++;
+        }
+    }
+}
+
+//
+// Handles one message from the port.
+//
+static void HandleReaperMessage(ULONG_PTR key, DWORD bytes, LPOVERLAPPED overlapped)
+{
+    if (key == REAPER_KEY_ADD || key == REAPER_KEY_ADD_UNJOBBED)
+    {
+        if (numReapedProcesses >= REAPER_MAX_PROCESSES)
+        {
+            QueueClose((HANDLE)overlapped);
+            return;
+        }
+
+        ReapedProcess &reaped = reapedProcesses[numReapedProcesses++];
+        reaped.processId = bytes;
+        reaped.process = (HANDLE)overlapped;
+        reaped.inJob = key == REAPER_KEY_ADD;
+        if (!reaped.inJob)
+            numUnjobbedProcesses++;
+        reaperStats.numTracked++;
+    }
+    else if (key == REAPER_KEY_JOB)
+    {
+        // The job also reports on our children's own children,
+        // which we have no handles for; those won't be found.
+        if (bytes != JOB_OBJECT_MSG_EXIT_PROCESS && bytes != JOB_OBJECT_MSG_ABNORMAL_EXIT_PROCESS)
+            return;
+
+        const int index = FindReapedProcess((DWORD)(ULONG_PTR)overlapped);
+        if (index >= 0)
+        {
+            RemoveReapedProcess(index);
+            reaperStats.numReaped++;
+        }
+    }
+    else if (key == REAPER_KEY_TERMINATE)
+    {
+        const int index = FindReapedProcess(bytes);
+        if (index < 0)
+            return;
+
+        // Terminating a child that has just exited fails with
+        // access denied, which is fine.
+        const HANDLE process = reapedProcesses[index].process;
+        if (!TerminateProcess(process, 1))
+        {
+            const DWORD error = GetLastError();
+            DWORD exitCode = 0;
+            if (!GetExitCodeProcess(process, &exitCode) || exitCode == STILL_ACTIVE)
+                printf("ERROR: Failed terminating process ID %lu (error %lu)!\n", bytes, error);
+        }
+    }
+}
+
+//
+// Entry point of the reaper thread.
+//
+static DWORD WINAPI ReaperThreadProc(LPVOID)
+{
+    bool stopping = false;
+    ULONGLONG stopDeadline = 0;
+
+    for (;;)
+    {
+        // Once stopping, quit when every child has exited, or
+        // when we run out of time waiting for them.
+        DWORD timeout = REAPER_FLUSH_MS;
+        if (stopping)
+        {
+            const ULONGLONG now = GetTickCount64();
+            if (!numReapedProcesses || now >= stopDeadline)
+                break;
+            if (stopDeadline - now < timeout)
+                timeout = (DWORD)(stopDeadline - now);
+        }
+
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        LPOVERLAPPED overlapped = nullptr;
+        if (!GetQueuedCompletionStatus(reaperPort, &bytes, &key, &overlapped, timeout))
+        {
+            // Nothing happened for a while; a good time to close
+            // whatever handles are waiting, and to check on the
+            // children the job isn't watching.
+            if (numUnjobbedProcesses)
+                PollReapedProcesses(false);
+            FlushCloseBatch();
+            continue;
+        }
+
+        if (key == REAPER_KEY_STOP)
+        {
+            stopping = true;
+            stopDeadline = GetTickCount64() + bytes;
+        }
+        else
+        {
+            HandleReaperMessage(key, bytes, overlapped);
+        }
+    }
+
+    // A child whose exit message hasn't arrived yet, or never
+    // will, isn't still running if its handle is signaled.
+    PollReapedProcesses(true);
+    reaperStats.numAbandoned = numReapedProcesses;
+    while (numReapedProcesses > 0)
+        RemoveReapedProcess(numReapedProcesses - 1);
+    FlushCloseBatch();
+    return 0;
+}
+
+bool StartReaper()
+{
+    reaperJob = CreateJobObject(nullptr, nullptr);
+    if (!reaperJob)
+    {
+        printf("ERROR: Failed creating reaper job (error %lu)!\n", GetLastError());
+        return false;
+    }
+
+    reaperPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    if (!reaperPort)
+    {
+        printf("ERROR: Failed creating reaper completion port (error %lu)!\n", GetLastError());
+        CloseHandle(reaperJob);
+        reaperJob = nullptr;
+        return false;
+    }
+
+    JOBOBJECT_ASSOCIATE_COMPLETION_PORT portInfo = {0};
+    portInfo.CompletionKey = (PVOID)REAPER_KEY_JOB;
+    portInfo.CompletionPort = reaperPort;
+    if (!SetInformationJobObject(reaperJob, JobObjectAssociateCompletionPortInformation,
+                                 &portInfo, sizeof(portInfo)))
+    {
+        printf("ERROR: Failed connecting reaper job to its port (error %lu)!\n", GetLastError());
+        CloseHandle(reaperPort);
+        CloseHandle(reaperJob);
+        reaperPort = nullptr;
+        reaperJob = nullptr;
+        return false;
+    }
+
+    memset(&reaperStats, 0, sizeof(reaperStats));
+    numUnjobbedProcesses = 0;
+    reaperThread = CreateThread(nullptr, 0, ReaperThreadProc, nullptr, 0, nullptr);
+    if (!reaperThread)
+    {
+        printf("ERROR: Failed creating reaper thread (error %lu)!\n", GetLastError());
+        CloseHandle(reaperPort);
+        CloseHandle(reaperJob);
+        reaperPort = nullptr;
+        reaperJob = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool ReapProcess(PROCESS_INFORMATION &processInfo)
+{
+    const DWORD processId = processInfo.dwProcessId;
+    const HANDLE thread = processInfo.hThread;
+    const HANDLE process = processInfo.hProcess;
+    processInfo.hThread = nullptr;
+    processInfo.hProcess = nullptr;
+    if (!process || !thread || !reaperThread)
+    {
+        if (thread)
+        {
+            ResumeHeldChildStartup(processId);
+            ResumeThread(thread);
+            CloseHandle(thread);
+        }
+        if (process)
+            CloseHandle(process);
+        return false;
+    }
+
+    // The child is still suspended, so it is in the job before it
+    // can exit, and the reaper hears about it before its exit
+    // message.  A child that can't be put in the job is still
+    // tracked, and its handle polled instead.
+    const bool inJob = AssignProcessToJobObject(reaperJob, process) != FALSE;
+    if (!inJob)
+    {
+        printf("ERROR: Failed adding process ID %lu to reaper job (error %lu)!\n",
+            processId, GetLastError());
+    }
+
+    const bool posted = PostQueuedCompletionStatus(reaperPort, processId,
+        inJob ? REAPER_KEY_ADD : REAPER_KEY_ADD_UNJOBBED, (LPOVERLAPPED)process) != FALSE;
+
+    // If the hooks injected the child, its startup is timed from
+    // here, not from when it was created.
+    ResumeHeldChildStartup(processId);
+    ResumeThread(thread);
+    CloseHandle(thread);
+    if (!posted)
+    {
+        CloseHandle(process);
+        return false;
+    }
+
+    return inJob;
+}
+
+void TerminateReapedProcess(DWORD processId)
+{
+    if (reaperThread)
+        PostQueuedCompletionStatus(reaperPort, processId, REAPER_KEY_TERMINATE, nullptr);
+}
+
+ReaperStats StopReaper(DWORD timeoutMs)
+{
+    if (!reaperThread)
+        return reaperStats;
+
+    PostQueuedCompletionStatus(reaperPort, timeoutMs, REAPER_KEY_STOP, nullptr);
+    WaitForSingleObject(reaperThread, INFINITE);
+
+    CloseHandle(reaperThread);
+    CloseHandle(reaperPort);
+    CloseHandle(reaperJob);
+    reaperThread = nullptr;
+    reaperPort = nullptr;
+    reaperJob = nullptr;
+    return reaperStats;
+}
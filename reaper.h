@@ -0,0 +1,53 @@
+//
+// reaper.h
+//
+// Asynchronous reaping of the child processes the demo program
+// launches.
+//
+// Each child is added to a job object whose notifications go to
+// an I/O completion port.  One reaper thread waits on the port,
+// and when the job reports that a child has exited, it closes
+// the child's handle, in batches.  The thread that launched the
+// child hands its handles off with a single posted completion
+// and never blocks waiting for the child.  Terminating a child
+// also goes through the reaper thread, using the handle it
+// holds, so a child is never looked up by process ID after its
+// ID could have been reused.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Counts kept by the reaper.
+struct ReaperStats
+{
+    int numTracked;      // Children handed to the reaper.
+    int numReaped;       // Children whose exit was reported.
+    int numAbandoned;    // Children still running when it stopped.
+};
+
+// Creates the job, completion port and reaper thread.  Returns
+// true if successful.
+bool StartReaper();
+
+// Hands a newly created child to the reaper, which takes over
+// its process handle.  The child must have been created with
+// CREATE_SUSPENDED, so it is in the job before it can exit; it
+// is resumed here, after telling the hooks (see
+// childstartup.h).  The thread handle is closed, and both
+// handles in processInfo are cleared.  Returns true if the job
+// will report the child's exit; if it can't be put in the job,
+// the reaper polls its handle instead.  Either way, the caller
+// no longer owns either handle.
+bool ReapProcess(PROCESS_INFORMATION &processInfo);
+
+// Asks the reaper thread to terminate a child handed to it,
+// unless it has already exited.  Doesn't wait.
+void TerminateReapedProcess(DWORD processId);
+
+// Waits up to timeoutMs for the remaining children to exit,
+// then stops the reaper thread, closes every handle it still
+// holds, and returns its counts.
+ReaperStats StopReaper(DWORD timeoutMs);
@@ -0,0 +1,299 @@
+//
+// report.cpp
+//
+// Builder for the demo program's results report.  See report.h
+// for a description.
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "report.h"
+
+// One report buffer.
+struct ReportBuffer
+{
+    char   text[REPORT_BUFFER_SIZE];
+    size_t length;
+    bool   truncated;
+};
+
+static ReportBuffer textReport;
+static ReportBuffer jsonReport;
+
+// Where to write the JSON report, or null if there isn't one.
+static const char *jsonReportFile = nullptr;
+
+// For each open JSON object or array, whether anything has been
+// added to it yet, so the next value needs a comma first, and
+// the character that closes it.
+static bool jsonNeedsComma[REPORT_MAX_DEPTH];
+static char jsonCloser[REPORT_MAX_DEPTH];
+static int jsonDepth = 0;
+
+//
+// Appends formatted text to a buffer.
+//
+static void AppendFormatV(ReportBuffer &buffer, const char *format, va_list args)
+{
+    if (buffer.truncated)
+        return;
+
+    const size_t room = sizeof(buffer.text) - buffer.length;
+    const int written = _vsnprintf_s(buffer.text + buffer.length, room, _TRUNCATE, format, args);
+    if (written < 0)
+    {
+        buffer.length = sizeof(buffer.text) - 1;
+        buffer.truncated = true;
+        return;
+    }
+
+    buffer.length += written;
+}
+
+static void AppendFormat(ReportBuffer &buffer, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    AppendFormatV(buffer, format, args);
+    va_end(args);
+}
+
+//
+// Appends one character to a buffer.
+//
+static void AppendChar(ReportBuffer &buffer, char c)
+{
+    if (buffer.truncated)
+        return;
+
+    if (buffer.length + 1 >= sizeof(buffer.text))
+    {
+        buffer.truncated = true;
+        return;
+    }
+
+    buffer.text[buffer.length++] = c;
+    buffer.text[buffer.length] = '\0';
+}
+
+//
+// Appends a string to the JSON report as a quoted JSON string.
+//
+static void AppendJsonQuoted(const char *value)
+{
+    AppendChar(jsonReport, '"');
+    for (const char *p = value; *p; p++)
+    {
+        const unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\')
+        {
+            AppendChar(jsonReport, '\\');
+            AppendChar(jsonReport, (char)c);
+        }
+        else if (c < 0x20)
+            AppendFormat(jsonReport, "\\u%04x", c);
+        else
+            AppendChar(jsonReport, (char)c);
+    }
+    AppendChar(jsonReport, '"');
+}
+
+//
+// Starts a value in the JSON report: a comma if it isn't the
+// first in its object or array, and its key if it has one.
+// Returns false if there is no JSON report.
+//
+static bool StartJsonValue(const char *key)
+{
+    if (!jsonReportFile || jsonDepth <= 0)
+        return false;
+
+    if (jsonNeedsComma[jsonDepth - 1])
+        AppendChar(jsonReport, ',');
+    jsonNeedsComma[jsonDepth - 1] = true;
+
+    if (key)
+    {
+        AppendJsonQuoted(key);
+        AppendChar(jsonReport, ':');
+    }
+    return true;
+}
+
+//
+// Opens a JSON object or array.  Anything nested too deeply is
+// left out, and makes the report too big to write.
+//
+static void OpenJsonScope(const char *key, char open, char close)
+{
+    if (jsonDepth >= REPORT_MAX_DEPTH)
+    {
+        jsonReport.truncated = true;
+        return;
+    }
+
+    if (!StartJsonValue(key))
+        return;
+
+    AppendChar(jsonReport, open);
+    jsonNeedsComma[jsonDepth] = false;
+    jsonCloser[jsonDepth] = close;
+    jsonDepth++;
+}
+
+//
+// Closes the innermost JSON object or array.
+//
+static void CloseJsonScope()
+{
+    if (!jsonReportFile || jsonDepth <= 1)
+        return;
+
+    jsonDepth--;
+    AppendChar(jsonReport, jsonCloser[jsonDepth]);
+}
+
+void SetJsonReportFile(const char *path)
+{
+    jsonReportFile = path;
+}
+
+void StartReport()
+{
+    textReport.length = 0;
+    textReport.text[0] = '\0';
+    textReport.truncated = false;
+
+    jsonReport.length = 0;
+    jsonReport.text[0] = '\0';
+    jsonReport.truncated = false;
+
+    // Everything goes in one top-level object.
+    jsonDepth = 1;
+    jsonNeedsComma[0] = false;
+    jsonCloser[0] = '}';
+    if (jsonReportFile)
+        AppendChar(jsonReport, '{');
+}
+
+void ReportText(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    AppendFormatV(textReport, format, args);
+    va_end(args);
+}
+
+void ReportJsonBeginObject(const char *key)
+{
+    OpenJsonScope(key, '{', '}');
+}
+
+void ReportJsonEndObject()
+{
+    CloseJsonScope();
+}
+
+void ReportJsonBeginArray(const char *key)
+{
+    OpenJsonScope(key, '[', ']');
+}
+
+void ReportJsonEndArray()
+{
+    CloseJsonScope();
+}
+
+void ReportJsonInt(const char *key, long long value)
+{
+    if (StartJsonValue(key))
+        AppendFormat(jsonReport, "%lld", value);
+}
+
+void ReportJsonNumber(const char *key, double value)
+{
+    if (StartJsonValue(key))
+        AppendFormat(jsonReport, "%.3f", value);
+}
+
+void ReportJsonBool(const char *key, bool value)
+{
+    if (StartJsonValue(key))
+        AppendFormat(jsonReport, "%s", value ? "true" : "false");
+}
+
+void ReportJsonString(const char *key, const char *value)
+{
+    if (StartJsonValue(key))
+        AppendJsonQuoted(value ? value : "");
+}
+
+void ReportJsonWideString(const char *key, const wchar_t *value)
+{
+    if (!jsonReportFile)
+        return;
+
+    // JSON is UTF-8.  A string too long for this just comes out
+    // empty.
+    char utf8[1024] = {0};
+    if (value)
+        WideCharToMultiByte(CP_UTF8, 0, value, -1, utf8, sizeof(utf8), nullptr, nullptr);
+    ReportJsonString(key, utf8);
+}
+
+//
+// Writes a whole buffer to a file handle.
+//
+static bool WriteReportBuffer(HANDLE file, const ReportBuffer &buffer)
+{
+    DWORD written = 0;
+    return WriteFile(file, buffer.text, (DWORD)buffer.length, &written, nullptr) &&
+           written == buffer.length;
+}
+
+bool FinishReport()
+{
+    if (textReport.truncated)
+    {
+        static const char truncatedNote[] = "\n(report truncated)\n";
+        textReport.length = sizeof(textReport.text) - sizeof(truncatedNote);
+        memcpy(textReport.text + textReport.length, truncatedNote, sizeof(truncatedNote));
+        textReport.length += sizeof(truncatedNote) - 1;
+    }
+
+    // Anything printf has buffered goes out first, so the report
+    // lands after it.
+    fflush(stdout);
+    bool ok = WriteReportBuffer(GetStdHandle(STD_OUTPUT_HANDLE), textReport);
+    textReport.length = 0;
+
+    if (!jsonReportFile)
+        return ok;
+
+    while (jsonDepth > 1)
+        CloseJsonScope();
+    AppendChar(jsonReport, '}');
+    AppendChar(jsonReport, '\n');
+    if (jsonReport.truncated)
+    {
+        printf("ERROR: JSON report doesn't fit in %d bytes; not writing it!\n", REPORT_BUFFER_SIZE);
+        return false;
+    }
+
+    const HANDLE file = CreateFileA(jsonReportFile, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        printf("ERROR: Failed creating JSON report \"%s\" (error %lu)!\n", jsonReportFile, GetLastError());
+        return false;
+    }
+
+    if (!WriteReportBuffer(file, jsonReport))
+    {
+        printf("ERROR: Failed writing JSON report \"%s\" (error %lu)!\n", jsonReportFile, GetLastError());
+        ok = false;
+    }
+    CloseHandle(file);
+    jsonReport.length = 0;
+    return ok;
+}
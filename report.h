@@ -0,0 +1,59 @@
+//
+// report.h
+//
+// Builder for the demo program's results report.
+//
+// The console is synchronous and slow, and printing the results
+// a line at a time with printf also ends up timing the console.
+// Instead the report is formatted into a preallocated buffer and
+// written to stdout with one WriteFile call once it is done, so
+// building it never allocates and never waits on the console.
+//
+// The same report can also be built as JSON for other programs
+// to read, into a second buffer that is written to a file.  Each
+// fact in the report is given to both: ReportText formats the
+// console's text, and the ReportJson functions add the same fact
+// to the JSON, if a JSON file was asked for.  The JSON is one
+// object, with nested objects and arrays opened and closed in
+// order; commas are added where they're needed.
+//
+// If a report outgrows its buffer, the rest is left out and the
+// text says so.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Size of each report buffer.
+#define REPORT_BUFFER_SIZE      (64 * 1024)
+
+// Deepest nesting of JSON objects and arrays.
+#define REPORT_MAX_DEPTH        8
+
+// Has FinishReport also write the report as JSON to the given
+// file.  The path must stay valid.
+void SetJsonReportFile(const char *path);
+
+// Starts a new report, throwing away anything not yet written.
+void StartReport();
+
+// Formats text into the console report.
+void ReportText(const char *format, ...);
+
+// Adds to the JSON report.  The key is null for the values of
+// an array.
+void ReportJsonBeginObject(const char *key);
+void ReportJsonEndObject();
+void ReportJsonBeginArray(const char *key);
+void ReportJsonEndArray();
+void ReportJsonInt(const char *key, long long value);
+void ReportJsonNumber(const char *key, double value);
+void ReportJsonBool(const char *key, bool value);
+void ReportJsonString(const char *key, const char *value);
+void ReportJsonWideString(const char *key, const wchar_t *value);
+
+// Writes the console report to stdout, and the JSON report to
+// its file if there is one.  Returns true if successful.
+bool FinishReport();
@@ -0,0 +1,159 @@
+//
+// stringtable.cpp
+//
+// Interning of the strings launch events refer to.  See
+// stringtable.h for a description.
+//
+
+#include <string.h>
+#include "stringtable.h"
+#include "telemetry.h"
+
+// How many times to check a slot that another thread is still
+// filling in before giving up on it and probing further.  The
+// string may then get a second slot, which is harmless.
+#define STRING_FILL_SPINS       1000
+
+// The table.  This is normally in our own data, but moves into
+// shared memory if telemetry is published.
+static TelemetryStringTable localStringTable;
+static TelemetryStringTable *stringTable = &localStringTable;
+
+//
+// Returns the FNV-1a hash of a string's characters.
+//
+template <typename CharT>
+static DWORD HashChars(const CharT *chars, size_t length)
+{
+    DWORD hash = 2166136261UL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (DWORD)chars[i];
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
+//
+// Returns true if a slot that's ready holds the given string.
+//
+template <typename CharT>
+static bool SlotMatches(const TelemetryStringSlot &slot, DWORD hash, const CharT *chars, size_t length)
+{
+    const DWORD wide = sizeof(CharT) == sizeof(WCHAR) ? 1 : 0;
+    return slot.hash == hash && slot.length == length && slot.wide == wide &&
+           memcmp(stringTable->arena + slot.offset, chars, length * sizeof(CharT)) == 0;
+}
+
+//
+// Copies a string into a slot this thread has just claimed.
+// Returns false if the arena is full, in which case the slot
+// is handed back.
+//
+template <typename CharT>
+static bool FillSlot(TelemetryStringSlot &slot, DWORD hash, const CharT *chars, size_t length)
+{
+    // Keep every string aligned for WCHAR.
+    const LONG size = (LONG)((length * sizeof(CharT) + sizeof(WCHAR) - 1) & ~(sizeof(WCHAR) - 1));
+    const LONG end = InterlockedAdd(&stringTable->arenaUsed, size);
+    if (end > STRING_ARENA_SIZE)
+    {
+        InterlockedExchange(&slot.state, STRING_SLOT_FREE);
+        return false;
+    }
+
+    memcpy(stringTable->arena + (end - size), chars, length * sizeof(CharT));
+    slot.hash = hash;
+    slot.offset = (DWORD)(end - size);
+    slot.length = (DWORD)length;
+    slot.wide = sizeof(CharT) == sizeof(WCHAR) ? 1 : 0;
+    InterlockedExchange(&slot.state, STRING_SLOT_READY);
+    return true;
+}
+
+//
+// Does the work of InternString for either kind of string.
+//
+template <typename CharT>
+static DWORD InternChars(const CharT *chars, size_t length)
+{
+    if (!chars || !length)
+        return 0;
+
+    // Once the arena is full there's no point looking.
+    if (length > STRING_MAX_CHARS || ReadNoFence(&stringTable->arenaUsed) >= STRING_ARENA_SIZE)
+    {
+        InterlockedIncrement64(&stringTable->misses);
+        return 0;
+    }
+
+    const DWORD hash = HashChars(chars, length);
+    DWORD index = hash & (STRING_TABLE_SIZE - 1);
+    for (int probes = 0; probes < STRING_TABLE_SIZE; probes++)
+    {
+        TelemetryStringSlot &slot = stringTable->slots[index];
+        for (int spins = 0; spins < STRING_FILL_SPINS; spins++)
+        {
+            const LONG state = ReadAcquire(&slot.state);
+            if (state == STRING_SLOT_READY)
+            {
+                if (SlotMatches(slot, hash, chars, length))
+                    return index + 1;
+                break;
+            }
+
+            if (state == STRING_SLOT_FREE &&
+                InterlockedCompareExchange(&slot.state, STRING_SLOT_FILLING, STRING_SLOT_FREE) == STRING_SLOT_FREE)
+            {
+                if (FillSlot(slot, hash, chars, length))
+                    return index + 1;
+
+                InterlockedIncrement64(&stringTable->misses);
+                return 0;
+            }
+
+            YieldProcessor();
+        }
+
+        index = (index + 1) & (STRING_TABLE_SIZE - 1);
+    }
+
+    InterlockedIncrement64(&stringTable->misses);
+    return 0;
+}
+
+void StringTableSetStorage(TelemetryStringTable *table)
+{
+    stringTable = table ? table : &localStringTable;
+}
+
+DWORD InternString(const char *chars, size_t length)
+{
+    return InternChars(chars, length);
+}
+
+DWORD InternString(const WCHAR *chars, size_t length)
+{
+    return InternChars(chars, length);
+}
+
+bool GetInternedString(DWORD id, InternedString &string)
+{
+    if (id == 0 || id > STRING_TABLE_SIZE)
+        return false;
+
+    const TelemetryStringSlot &slot = stringTable->slots[id - 1];
+    if (ReadAcquire(&slot.state) != STRING_SLOT_READY)
+        return false;
+
+    string.chars = stringTable->arena + slot.offset;
+    string.length = slot.length;
+    string.wide = slot.wide != 0;
+    return true;
+}
+
+long long GetStringTableMissCount()
+{
+    return ReadNoFence64(&stringTable->misses);
+}
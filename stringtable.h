@@ -0,0 +1,68 @@
+//
+// stringtable.h
+//
+// Interning of the application names and command lines that
+// launch events refer to.
+//
+// Build systems launch the same tools over and over with nearly
+// the same command lines, so rather than copy every string into
+// every event, the hooks look each string up in a fixed-size
+// hash table and put its ID in the event.  A string is only
+// copied the first time it is seen, into an arena that is
+// never freed, so an ID stays valid for as long as the table
+// does.  Command lines are split after the program name, which
+// is interned on its own, and only the arguments that follow
+// are copied into the event.
+//
+// The table is lock-free: a new string claims its slot with a
+// compare-exchange and its arena space with an interlocked add,
+// and finding a string that's already there only reads.  Once
+// the slots or the arena run out, strings are simply not
+// interned, and the event keeps its own (truncated) copy
+// instead.  Like the counters and the event ring, the table can
+// live in shared memory; see telemetry.h.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Number of slots in the table.  Must be a power of two.
+#define STRING_TABLE_SIZE       2048
+
+// Bytes of string storage shared by every slot.
+#define STRING_ARENA_SIZE       (128 * 1024)
+
+// Longest string that gets interned, in characters.
+#define STRING_MAX_CHARS        1024
+
+// A string that was interned, as returned by GetInternedString.
+// The characters are not null-terminated.
+struct InternedString
+{
+    const void *chars;       // char or WCHAR, depending on wide.
+    DWORD       length;      // Length in characters.
+    bool        wide;
+};
+
+struct TelemetryStringTable;
+
+// Moves the table into the given storage (see telemetry.h), or
+// back to our own data if null.  Only call this while the hooks
+// are not installed, since it forgets every ID.
+void StringTableSetStorage(TelemetryStringTable *table);
+
+// Returns the ID of a string, interning it if it hasn't been
+// seen before, or zero if it couldn't be interned.
+DWORD InternString(const char *chars, size_t length);
+DWORD InternString(const WCHAR *chars, size_t length);
+
+// Looks up an interned string by ID.  Returns false if there is
+// no such string.
+HOOKDLL_API bool GetInternedString(DWORD id, InternedString &string);
+
+// Returns the number of strings that couldn't be interned
+// because the table was full or they were too long.
+HOOKDLL_API long long GetStringTableMissCount();
@@ -0,0 +1,195 @@
+//
+// telemetry.cpp
+//
+// Shared-memory export of the hook counters and the launch
+// event ring.  See telemetry.h for a description.
+//
+
+#include <stddef.h>
+#include <stdio.h>
+#include "telemetry.h"
+
+static HANDLE telemetryMapping = nullptr;
+static TelemetryLayout *telemetryLayout = nullptr;
+
+//
+// Builds the mapping name for a process.
+//
+static void GetTelemetryName(DWORD processId, char *name, size_t nameSize)
+{
+    sprintf_s(name, nameSize, "%s%lu", TELEMETRY_NAME_PREFIX, processId);
+}
+
+bool PublishTelemetry()
+{
+    if (telemetryLayout)
+        return true;
+
+    char name[64];
+    GetTelemetryName(GetCurrentProcessId(), name, sizeof(name));
+
+    telemetryMapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                         0, sizeof(TelemetryLayout), name);
+    if (!telemetryMapping)
+    {
+        printf("ERROR: Failed creating telemetry mapping \"%s\" (error %lu)!\n", name, GetLastError());
+        return false;
+    }
+
+    telemetryLayout = (TelemetryLayout *)MapViewOfFile(telemetryMapping, FILE_MAP_ALL_ACCESS,
+                                                       0, 0, sizeof(TelemetryLayout));
+    if (!telemetryLayout)
+    {
+        printf("ERROR: Failed mapping telemetry (error %lu)!\n", GetLastError());
+        CloseHandle(telemetryMapping);
+        telemetryMapping = nullptr;
+        return false;
+    }
+
+    TelemetryHeader &header = telemetryLayout->header;
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    header.version = TELEMETRY_VERSION;
+    header.totalSize = sizeof(TelemetryLayout);
+    header.processId = GetCurrentProcessId();
+    header.qpcFrequency = frequency.QuadPart;
+    header.startTime = HookStatsReadTimestamp();
+    header.numHookIds = NUM_HOOK_IDS;
+    header.numLatencyKinds = NUM_LATENCY_KINDS;
+    header.numLatencyBuckets = NUM_LATENCY_BUCKETS;
+    header.numCounterBlocks = TELEMETRY_COUNTER_BLOCKS;
+    header.counterBlockSize = sizeof(TelemetryCounterBlock);
+    header.eventRingSize = EVENT_RING_SIZE;
+    header.eventCellSize = sizeof(TelemetryEventCell);
+    header.stringTableSize = STRING_TABLE_SIZE;
+    header.stringArenaSize = STRING_ARENA_SIZE;
+    header.counterBlocksOffset = (DWORD)offsetof(TelemetryLayout, counterBlocks);
+    header.eventRingOffset = (DWORD)offsetof(TelemetryLayout, eventRing);
+    header.stringTableOffset = (DWORD)offsetof(TelemetryLayout, stringTable);
+
+    HookStatsSetStorage(telemetryLayout->counterBlocks);
+    EventLogSetStorage(&telemetryLayout->eventRing);
+    StringTableSetStorage(&telemetryLayout->stringTable);
+
+    // Readers key off the magic number, so set it last.
+    InterlockedExchange((volatile LONG *)&header.magic, (LONG)TELEMETRY_MAGIC);
+    return true;
+}
+
+bool IsTelemetryPublished()
+{
+    return telemetryLayout != nullptr;
+}
+
+void UnpublishTelemetry()
+{
+    if (!telemetryLayout)
+        return;
+
+    HookStatsSetStorage(nullptr);
+    EventLogSetStorage(nullptr);
+    StringTableSetStorage(nullptr);
+
+    UnmapViewOfFile(telemetryLayout);
+    CloseHandle(telemetryMapping);
+    telemetryLayout = nullptr;
+    telemetryMapping = nullptr;
+}
+
+bool OpenTelemetry(DWORD processId, TelemetryView &view)
+{
+    view.mapping = nullptr;
+    view.layout = nullptr;
+
+    char name[64];
+    GetTelemetryName(processId, name, sizeof(name));
+
+    view.mapping = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+    if (!view.mapping)
+        return false;
+
+    view.layout = (const TelemetryLayout *)MapViewOfFile(view.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view.layout)
+    {
+        CloseTelemetry(view);
+        return false;
+    }
+
+    const TelemetryHeader &header = view.layout->header;
+    if (header.magic != TELEMETRY_MAGIC ||
+        header.version != TELEMETRY_VERSION ||
+        header.totalSize != sizeof(TelemetryLayout) ||
+        header.numHookIds != NUM_HOOK_IDS ||
+        header.numLatencyBuckets != NUM_LATENCY_BUCKETS ||
+        header.eventCellSize != sizeof(TelemetryEventCell) ||
+        header.stringTableSize != STRING_TABLE_SIZE ||
+        header.stringArenaSize != STRING_ARENA_SIZE)
+    {
+        CloseTelemetry(view);
+        return false;
+    }
+
+    return true;
+}
+
+void CloseTelemetry(TelemetryView &view)
+{
+    if (view.layout)
+        UnmapViewOfFile(view.layout);
+    if (view.mapping)
+        CloseHandle(view.mapping);
+
+    view.layout = nullptr;
+    view.mapping = nullptr;
+}
+
+long long ReadTelemetryCallCount(const TelemetryView &view, int hookId)
+{
+    if (!view.layout || hookId < 0 || hookId >= NUM_HOOK_IDS)
+        return 0;
+
+    long long total = 0;
+    for (int i = 0; i < TELEMETRY_COUNTER_BLOCKS; i++)
+        total += ReadNoFence64(&view.layout->counterBlocks[i].calls[hookId]);
+
+    return total;
+}
+
+bool ReadTelemetryEvent(const TelemetryView &view, long long position, LaunchEvent &event)
+{
+    if (!view.layout || position < 0)
+        return false;
+
+    const TelemetryEventCell &cell = view.layout->eventRing.cells[position & (EVENT_RING_SIZE - 1)];
+    if (ReadAcquire64(&cell.sequence) != position + 1)
+        return false;
+
+    event = cell.event;
+
+    // If the cell was handed back and reused while we copied it,
+    // the sequence will have moved on.
+    MemoryBarrier();
+    return ReadNoFence64(&cell.sequence) == position + 1;
+}
+
+bool ReadTelemetryString(const TelemetryView &view, DWORD id, InternedString &string)
+{
+    if (!view.layout || id == 0 || id > STRING_TABLE_SIZE)
+        return false;
+
+    const TelemetryStringTable &table = view.layout->stringTable;
+    const TelemetryStringSlot &slot = table.slots[id - 1];
+    if (ReadAcquire(&slot.state) != STRING_SLOT_READY)
+        return false;
+
+    // Don't trust the other process to have kept the string
+    // inside the arena.
+    const DWORD charSize = slot.wide ? sizeof(WCHAR) : sizeof(char);
+    if (slot.offset > STRING_ARENA_SIZE || slot.length > (STRING_ARENA_SIZE - slot.offset) / charSize)
+        return false;
+
+    string.chars = table.arena + slot.offset;
+    string.length = slot.length;
+    string.wide = slot.wide != 0;
+    return true;
+}
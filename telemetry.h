@@ -0,0 +1,178 @@
+//
+// telemetry.h
+//
+// Shared-memory export of the hook counters and the launch
+// event ring.
+//
+// When telemetry is published, the per-thread counter blocks
+// (hookstats.cpp), the event ring (eventlog.cpp) and the string
+// table the events refer to (stringtable.cpp) live in a
+// named file mapping instead of in the process's own data, so
+// a monitoring agent in another process can map the same view
+// and poll it directly.  The hooks write exactly as they do
+// without telemetry; nothing extra happens per call.
+//
+// The layout below is shared with readers in other processes,
+// so any change to it must bump TELEMETRY_VERSION.  Every
+// section starts on a cache line boundary.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+#include "eventlog.h"
+#include "hookstats.h"
+#include "stringtable.h"
+
+#define TELEMETRY_MAGIC         0x4D54484BUL  // "KHTM"
+#define TELEMETRY_VERSION       5
+
+// Name of the mapping for a process is this prefix followed by
+// the process ID in decimal.
+#define TELEMETRY_NAME_PREFIX   "Local\\DetoursDemoTelemetry_"
+
+// Number of per-thread counter blocks.  Each thread takes the
+// next block the first time it calls a hook.  If more threads
+// than this ever call hooks, the later ones wrap around and
+// share blocks with earlier ones, which is still correct
+// because the counters are updated with interlocked adds.
+#define TELEMETRY_COUNTER_BLOCKS 64
+
+// One thread's set of counters, padded out to its own cache
+// line(s) so neighboring threads don't false-share.
+struct alignas(64) TelemetryCounterBlock
+{
+    volatile LONG64 calls[NUM_HOOK_IDS];         // Estimated from the
+                                                 // weights, if sampled.
+    volatile LONG64 sampledCalls[NUM_HOOK_IDS];  // Calls recorded.
+    volatile LONG64 latency[NUM_HOOK_IDS][NUM_LATENCY_KINDS][NUM_LATENCY_BUCKETS];
+};
+
+// One slot in the event ring.  The sequence number tells
+// whether the cell is free for the producer at a given ring
+// position, or holds an event ready at that position.  A
+// reader in another process can copy out an event at position
+// P whenever the sequence is P + 1 both before and after the
+// copy.
+struct alignas(64) TelemetryEventCell
+{
+    volatile LONG64 sequence;
+    LONG64          position;    // Position this cell was claimed for.
+    LaunchEvent     event;
+};
+
+// The event ring.  The most recent half of the ring is always
+// left in place after it has been drained, so readers polling
+// the mapping get a window of recent events to catch up on.
+struct alignas(64) TelemetryEventRing
+{
+    volatile LONG64    writePosition;    // Next position producers will claim.
+    alignas(64) TelemetryEventCell cells[EVENT_RING_SIZE];
+};
+
+// States of a string table slot.
+#define STRING_SLOT_FREE        0    // Not used yet.
+#define STRING_SLOT_FILLING     1    // Claimed, string being copied in.
+#define STRING_SLOT_READY       2    // Holds a string.
+
+// One slot in the string table.  The other fields are only
+// valid once the state is STRING_SLOT_READY, and never change
+// after that.  A string's ID is its slot index plus one.
+struct TelemetryStringSlot
+{
+    volatile LONG state;         // STRING_SLOT_* state.
+    DWORD         hash;          // Hash of the characters.
+    DWORD         offset;        // Offset of the characters in the arena.
+    DWORD         length;        // Length in characters.
+    DWORD         wide;          // Nonzero if the characters are WCHAR.
+};
+
+// The string table.  The arena is handed out from the front,
+// and nothing in it ever moves or is freed.
+struct alignas(64) TelemetryStringTable
+{
+    volatile LONG   arenaUsed;   // Bytes of the arena handed out.
+    volatile LONG64 misses;      // Strings that couldn't be interned.
+    alignas(64) TelemetryStringSlot slots[STRING_TABLE_SIZE];
+    alignas(64) BYTE arena[STRING_ARENA_SIZE];
+};
+
+// Fixed header at the start of the mapping.  Readers should
+// check the magic, version and sizes before using anything
+// else.
+struct alignas(64) TelemetryHeader
+{
+    DWORD     magic;             // TELEMETRY_MAGIC.
+    DWORD     version;           // TELEMETRY_VERSION.
+    DWORD     totalSize;         // Size of the whole mapping, in bytes.
+    DWORD     processId;         // Process being monitored.
+    long long qpcFrequency;      // QueryPerformanceFrequency, for
+                                 // converting latencies and timestamps.
+    long long startTime;         // QueryPerformanceCounter when published.
+    DWORD     numHookIds;        // NUM_HOOK_IDS.
+    DWORD     numLatencyKinds;   // NUM_LATENCY_KINDS.
+    DWORD     numLatencyBuckets; // NUM_LATENCY_BUCKETS.
+    DWORD     numCounterBlocks;  // TELEMETRY_COUNTER_BLOCKS.
+    DWORD     counterBlockSize;  // sizeof(TelemetryCounterBlock).
+    DWORD     eventRingSize;     // EVENT_RING_SIZE.
+    DWORD     eventCellSize;     // sizeof(TelemetryEventCell).
+    DWORD     stringTableSize;   // STRING_TABLE_SIZE.
+    DWORD     stringArenaSize;   // STRING_ARENA_SIZE.
+    DWORD     counterBlocksOffset;   // Offset of the counter blocks.
+    DWORD     eventRingOffset;       // Offset of the TelemetryEventRing.
+    DWORD     stringTableOffset;     // Offset of the TelemetryStringTable.
+};
+
+// The whole mapping.
+struct TelemetryLayout
+{
+    TelemetryHeader       header;
+    TelemetryCounterBlock counterBlocks[TELEMETRY_COUNTER_BLOCKS];
+    TelemetryEventRing    eventRing;
+    TelemetryStringTable  stringTable;
+};
+
+// Creates the named mapping for the current process and moves
+// the counters and event ring into it.  This must be called
+// before any hooks are installed.  Returns true if successful.
+HOOKDLL_API bool PublishTelemetry();
+
+// Unmaps the current process's telemetry.  The hooks must have
+// been removed first.
+HOOKDLL_API void UnpublishTelemetry();
+
+// Returns true if the current process's telemetry is published.
+HOOKDLL_API bool IsTelemetryPublished();
+
+// A read-only view of another process's telemetry.
+struct TelemetryView
+{
+    HANDLE                 mapping;
+    const TelemetryLayout *layout;
+};
+
+// Maps the telemetry of the given process for reading, and
+// checks that its layout matches ours.  Returns true if
+// successful.
+HOOKDLL_API bool OpenTelemetry(DWORD processId, TelemetryView &view);
+
+// Unmaps a view from OpenTelemetry.
+HOOKDLL_API void CloseTelemetry(TelemetryView &view);
+
+// Returns the total calls to a hook in a telemetry view,
+// summed across the counter blocks.  If the hook samples its
+// calls, this is the estimate from the calls recorded.
+HOOKDLL_API long long ReadTelemetryCallCount(const TelemetryView &view, int hookId);
+
+// Copies out the event at the given ring position from a
+// telemetry view.  Returns false if that event is not in the
+// ring, either because it hasn't been written yet or because
+// it has already been overwritten.
+HOOKDLL_API bool ReadTelemetryEvent(const TelemetryView &view, long long position, LaunchEvent &event);
+
+// Looks up a string an event refers to in a telemetry view.
+// The characters point into the view.  Returns false if there
+// is no such string.
+HOOKDLL_API bool ReadTelemetryString(const TelemetryView &view, DWORD id, InternedString &string);
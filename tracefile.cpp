@@ -0,0 +1,271 @@
+//
+// tracefile.cpp
+//
+// Binary trace file of the launch events.  See tracefile.h for
+// a description of the format.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "tracefile.h"
+#include "stringtable.h"
+
+static HANDLE traceFile = INVALID_HANDLE_VALUE;
+static HANDLE traceMapping = nullptr;
+
+// View of the chunk being written, and where it is in the file.
+static BYTE *traceChunk = nullptr;
+static DWORD traceChunkIndex = 0;
+
+// Fields repeated in every chunk header.
+static long long traceStartTimestamp = 0;
+static long long traceTicksPerSecond = 0;
+
+// Which interned strings are in the trace already, by ID.
+static bool traceStringWritten[STRING_TABLE_SIZE + 1];
+
+//
+// Returns the header of the chunk being written.
+//
+static TraceChunkHeader &CurrentChunkHeader()
+{
+    return *(TraceChunkHeader *)traceChunk;
+}
+
+//
+// Maps the chunk with the given index, which extends the file to
+// hold it, and fills in its header.  Returns true if successful.
+//
+static bool MapTraceChunk(DWORD index)
+{
+    const ULONGLONG offset = (ULONGLONG)index * TRACE_CHUNK_SIZE;
+    const ULONGLONG end = offset + TRACE_CHUNK_SIZE;
+    traceMapping = CreateFileMapping(traceFile, nullptr, PAGE_READWRITE,
+        (DWORD)(end >> 32), (DWORD)end, nullptr);
+    if (!traceMapping)
+    {
+        printf("ERROR: Failed extending trace file (error %lu)!\n", GetLastError());
+        return false;
+    }
+
+    traceChunk = (BYTE *)MapViewOfFile(traceMapping, FILE_MAP_WRITE,
+        (DWORD)(offset >> 32), (DWORD)offset, TRACE_CHUNK_SIZE);
+    if (!traceChunk)
+    {
+        printf("ERROR: Failed mapping trace file (error %lu)!\n", GetLastError());
+        CloseHandle(traceMapping);
+        traceMapping = nullptr;
+        return false;
+    }
+
+    TraceChunkHeader &header = CurrentChunkHeader();
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.headerSize = sizeof(TraceChunkHeader);
+    header.chunkIndex = index;
+    header.processId = GetCurrentProcessId();
+    header.complete = 0;
+    header.usedBytes = 0;
+    header.numRecords = 0;
+    header.ticksPerSecond = traceTicksPerSecond;
+    header.startTimestamp = traceStartTimestamp;
+    traceChunkIndex = index;
+    return true;
+}
+
+//
+// Marks the chunk being written complete and unmaps it.
+//
+static void UnmapTraceChunk()
+{
+    if (!traceChunk)
+        return;
+
+    CurrentChunkHeader().complete = 1;
+    UnmapViewOfFile(traceChunk);
+    CloseHandle(traceMapping);
+    traceChunk = nullptr;
+    traceMapping = nullptr;
+}
+
+//
+// Returns room for a record of the given size at the end of the
+// chunk being written, moving on to the next chunk if it won't
+// fit, or null if the trace can't be written.
+//
+static BYTE *ReserveTraceRecord(DWORD size)
+{
+    if (!traceChunk)
+        return nullptr;
+
+    if (sizeof(TraceChunkHeader) + CurrentChunkHeader().usedBytes + size > TRACE_CHUNK_SIZE)
+    {
+        UnmapTraceChunk();
+
+        // If the next chunk can't be mapped, the trace just ends
+        // with the chunks already written.
+        if (!MapTraceChunk(traceChunkIndex + 1))
+            return nullptr;
+    }
+
+    return traceChunk + sizeof(TraceChunkHeader) + CurrentChunkHeader().usedBytes;
+}
+
+//
+// Counts a record written at the end of the chunk, so readers
+// can see it.
+//
+static void CommitTraceRecord(DWORD size)
+{
+    TraceChunkHeader &header = CurrentChunkHeader();
+    header.usedBytes += size;
+    header.numRecords++;
+}
+
+//
+// Returns a record's size once it is padded.
+//
+static DWORD PadTraceRecord(size_t size)
+{
+    return (DWORD)((size + TRACE_RECORD_ALIGN - 1) & ~(size_t)(TRACE_RECORD_ALIGN - 1));
+}
+
+//
+// Writes an interned string to the trace, if it isn't there
+// already.
+//
+static void WriteTraceString(DWORD id)
+{
+    if (!id || id > STRING_TABLE_SIZE || traceStringWritten[id])
+        return;
+
+    InternedString string;
+    if (!GetInternedString(id, string))
+        return;
+
+    const size_t charsSize = string.length * (string.wide ? sizeof(WCHAR) : sizeof(char));
+    const DWORD size = PadTraceRecord(sizeof(TraceStringRecord) + charsSize);
+    BYTE *data = ReserveTraceRecord(size);
+    if (!data)
+        return;
+
+    TraceStringRecord &record = *(TraceStringRecord *)data;
+    memset(data, 0, size);
+    record.header.type = TRACE_RECORD_STRING;
+    record.header.size = (WORD)size;
+    record.id = id;
+    record.length = string.length;
+    record.wide = string.wide ? 1 : 0;
+    memcpy(data + sizeof(record), string.chars, charsSize);
+
+    CommitTraceRecord(size);
+    traceStringWritten[id] = true;
+}
+
+//
+// Returns the length of a string in an event.
+//
+template <typename CharT, size_t N>
+static size_t EventStringLength(const CharT (&s)[N])
+{
+    size_t length = 0;
+    while (length < N && s[length])
+        length++;
+    return length;
+}
+
+bool OpenTraceFile(const char *filename, long long startTimestamp)
+{
+    if (traceFile != INVALID_HANDLE_VALUE)
+        return true;
+
+    traceFile = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+        nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (traceFile == INVALID_HANDLE_VALUE)
+    {
+        printf("ERROR: Failed creating trace file \"%s\" (error %lu)!\n", filename, GetLastError());
+        return false;
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    traceTicksPerSecond = frequency.QuadPart;
+    traceStartTimestamp = startTimestamp;
+    memset(traceStringWritten, 0, sizeof(traceStringWritten));
+
+    if (!MapTraceChunk(0))
+    {
+        CloseHandle(traceFile);
+        traceFile = INVALID_HANDLE_VALUE;
+        return false;
+    }
+
+    return true;
+}
+
+void WriteTraceEvent(const LaunchEvent &event)
+{
+    if (!traceChunk)
+        return;
+
+    WriteTraceString(event.appNameId);
+    WriteTraceString(event.programId);
+
+    const size_t charSize = event.wide ? sizeof(WCHAR) : sizeof(char);
+    const size_t appNameLength = event.appNameId ? 0 :
+        event.wide ? EventStringLength(event.appName.w) : EventStringLength(event.appName.a);
+    const size_t argumentsLength =
+        event.wide ? EventStringLength(event.commandLine.w) : EventStringLength(event.commandLine.a);
+    const DWORD size = PadTraceRecord(sizeof(TraceLaunchRecord) + (appNameLength + argumentsLength) * charSize);
+    BYTE *data = ReserveTraceRecord(size);
+    if (!data)
+        return;
+
+    TraceLaunchRecord &record = *(TraceLaunchRecord *)data;
+    memset(data, 0, size);
+    record.header.type = TRACE_RECORD_LAUNCH;
+    record.header.size = (WORD)size;
+    record.hookId = (DWORD)event.hookId;
+    record.timestamp = event.timestamp;
+    record.apiTicks = event.apiTicks;
+    record.threadId = event.threadId;
+    record.creationFlags = event.creationFlags;
+    record.result = (DWORD)event.result;
+    record.error = event.error;
+    record.processId = event.processId;
+    record.appNameId = event.appNameId;
+    record.programId = event.programId;
+    record.wide = event.wide ? 1 : 0;
+    record.appNameLength = (WORD)appNameLength;
+    record.argumentsLength = (WORD)argumentsLength;
+
+    BYTE *chars = data + sizeof(record);
+    memcpy(chars, &event.appName, appNameLength * charSize);
+    memcpy(chars + appNameLength * charSize, &event.commandLine, argumentsLength * charSize);
+
+    CommitTraceRecord(size);
+}
+
+void CloseTraceFile()
+{
+    if (traceFile == INVALID_HANDLE_VALUE)
+        return;
+
+    // The file can't be trimmed while the chunk is mapped.
+    LARGE_INTEGER end = {0};
+    if (traceChunk)
+    {
+        end.QuadPart = (LONGLONG)traceChunkIndex * TRACE_CHUNK_SIZE +
+            sizeof(TraceChunkHeader) + CurrentChunkHeader().usedBytes;
+    }
+    UnmapTraceChunk();
+
+    if (end.QuadPart)
+    {
+        SetFilePointerEx(traceFile, end, nullptr, FILE_BEGIN);
+        SetEndOfFile(traceFile);
+    }
+
+    CloseHandle(traceFile);
+    traceFile = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,112 @@
+//
+// tracefile.h
+//
+// Binary trace file of the launch events, for recording whole
+// sessions to disk.  Read it back with traceread.exe.
+//
+// The file is a sequence of fixed-size chunks, each starting
+// with a TraceChunkHeader and followed by variable-size records.
+// The event log's drain thread writes the records straight into
+// a mapped view of the current chunk, and maps the next chunk
+// when it fills up, so nothing ever calls WriteFile and the
+// hooked threads never wait on the disk.  Each chunk's header
+// is updated after every record, so if the process dies, every
+// record written before that can still be read, and a complete
+// chunk never changes again.
+//
+// Interned strings (see stringtable.h) are written as string
+// records the first time a launch refers to them, so a reader
+// must go through the chunks in order.
+//
+// Every chunk header repeats what a reader needs to make sense
+// of its timestamps, so the file has no separate header.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "eventlog.h"
+
+#define TRACE_MAGIC             0x43525448UL  // "HTRC"
+#define TRACE_VERSION           1
+
+// Size of each chunk.  A multiple of the allocation
+// granularity, so each chunk can be mapped on its own.
+#define TRACE_CHUNK_SIZE        (256 * 1024)
+
+// Start of every chunk.
+struct TraceChunkHeader
+{
+    DWORD     magic;             // TRACE_MAGIC.
+    DWORD     version;           // TRACE_VERSION.
+    DWORD     headerSize;        // sizeof(TraceChunkHeader).
+    DWORD     chunkIndex;        // Position of the chunk in the file.
+    DWORD     processId;         // Process that wrote the trace.
+    DWORD     complete;          // Nonzero once the chunk is full or
+                                 // the trace was closed.
+    DWORD     usedBytes;         // Bytes of records after the header.
+    DWORD     numRecords;        // Number of records in the chunk.
+    long long ticksPerSecond;    // QueryPerformanceFrequency value.
+    long long startTimestamp;    // QueryPerformanceCounter value when
+                                 // the trace was started.
+};
+
+// Types of record.
+#define TRACE_RECORD_STRING     1
+#define TRACE_RECORD_LAUNCH     2
+
+// Records are padded to a multiple of this many bytes.
+#define TRACE_RECORD_ALIGN      8
+
+// Start of every record.
+struct TraceRecordHeader
+{
+    WORD type;                   // TRACE_RECORD_* type.
+    WORD size;                   // Size of the whole record, in bytes,
+                                 // including padding.
+};
+
+// An interned string, followed by its characters.
+struct TraceStringRecord
+{
+    TraceRecordHeader header;
+    DWORD             id;        // Interned string ID.
+    DWORD             length;    // Length in characters.
+    DWORD             wide;      // Nonzero if the characters are WCHAR.
+};
+
+// One launch event (see LaunchEvent), followed by the
+// characters of the application name, if it wasn't interned,
+// and then of the arguments.  Neither is null-terminated.
+struct TraceLaunchRecord
+{
+    TraceRecordHeader header;
+    DWORD             hookId;
+    long long         timestamp;
+    long long         apiTicks;
+    DWORD             threadId;
+    DWORD             creationFlags;
+    DWORD             result;
+    DWORD             error;
+    DWORD             processId;
+    DWORD             appNameId;
+    DWORD             programId;
+    WORD              wide;
+    WORD              appNameLength;     // In characters.
+    WORD              argumentsLength;   // In characters.
+    WORD              reserved;
+};
+
+// Creates the trace file, overwriting any that's there, and
+// maps its first chunk.  Returns true if successful.
+bool OpenTraceFile(const char *filename, long long startTimestamp);
+
+// Appends a launch event to the trace, preceded by any interned
+// strings it refers to that aren't in the trace yet.  Only the
+// event log's drain thread calls this.
+void WriteTraceEvent(const LaunchEvent &event);
+
+// Marks the last chunk complete, trims the unused end of it off
+// the file, and closes the file.
+void CloseTraceFile();
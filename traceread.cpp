@@ -0,0 +1,317 @@
+//
+// traceread.cpp
+//
+// Small tool that converts a binary trace file, as written by
+// the demo program's -trace option (see tracefile.h), to CSV
+// or JSON.
+//
+// Usage:  traceread [-json] <tracefile>
+//
+// The converted launches go to stdout, one per line, with
+// interned strings put back in place and the program and
+// arguments joined back into the full command line.  Strings
+// are written as UTF-8.  Errors and the summary go to stderr,
+// so they don't end up in the converted output.
+//
+// A trace whose writer died still converts: every chunk is read
+// up to the last record its header counts, and reading stops at
+// the first chunk that isn't valid.
+//
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hookstats.h"
+#include "stringtable.h"
+#include "tracefile.h"
+
+// Room for a converted string.  Interned strings are at most
+// STRING_MAX_CHARS characters, and UTF-8 takes at most three
+// bytes for each WCHAR.
+#define UTF8_STRING_SIZE        (STRING_MAX_CHARS * 3 + 1)
+
+// Interned strings seen so far in the trace, as UTF-8, by ID.
+static char *traceStrings[STRING_TABLE_SIZE + 1] = {0};
+
+// True to write JSON rather than CSV.
+static bool writeJson = false;
+
+// Number of launches written so far.
+static long long numLaunches = 0;
+
+//
+// Converts characters from a trace to a null-terminated UTF-8
+// string.  Narrow strings are in the writer's ANSI code page,
+// assumed to be the same as ours.
+//
+static void ConvertTraceString(const void *chars, DWORD length, bool wide, char *out, size_t outSize)
+{
+    out[0] = '\0';
+    if (length > STRING_MAX_CHARS)
+        length = STRING_MAX_CHARS;
+    if (!length)
+        return;
+
+    WCHAR wideChars[STRING_MAX_CHARS];
+    const WCHAR *source = (const WCHAR *)chars;
+    if (!wide)
+    {
+        length = (DWORD)MultiByteToWideChar(CP_ACP, 0, (const char *)chars, (int)length,
+            wideChars, STRING_MAX_CHARS);
+        source = wideChars;
+    }
+
+    const int written = WideCharToMultiByte(CP_UTF8, 0, source, (int)length,
+        out, (int)outSize - 1, nullptr, nullptr);
+    out[written > 0 ? written : 0] = '\0';
+}
+
+//
+// Writes a string as a quoted CSV field.
+//
+static void WriteCsvString(const char *s)
+{
+    putchar('"');
+    for (; *s; s++)
+    {
+        if (*s == '"')
+            putchar('"');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+//
+// Writes a string as a quoted JSON string.
+//
+static void WriteJsonString(const char *s)
+{
+    putchar('"');
+    for (; *s; s++)
+    {
+        const unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+//
+// Reads a string record and remembers its string.  Returns false
+// if the record is not valid.
+//
+static bool ReadStringRecord(const BYTE *data, DWORD size)
+{
+    // None of the record can be looked at until it is known to
+    // be all there.
+    if (size < sizeof(TraceStringRecord))
+        return false;
+
+    const TraceStringRecord &record = *(const TraceStringRecord *)data;
+    const size_t charSize = record.wide ? sizeof(WCHAR) : sizeof(char);
+    if (record.id == 0 || record.id > STRING_TABLE_SIZE ||
+        record.length > STRING_MAX_CHARS || sizeof(record) + record.length * charSize > size)
+        return false;
+
+    char *string = (char *)malloc(UTF8_STRING_SIZE);
+    if (!string)
+        return false;
+
+    ConvertTraceString(data + sizeof(record), record.length, record.wide != 0, string, UTF8_STRING_SIZE);
+    free(traceStrings[record.id]);
+    traceStrings[record.id] = string;
+    return true;
+}
+
+//
+// Reads a launch record and writes it out.  Returns false if the
+// record is not valid.
+//
+static bool ReadLaunchRecord(const BYTE *data, DWORD size, const TraceChunkHeader &chunk)
+{
+    if (size < sizeof(TraceLaunchRecord))
+        return false;
+
+    const TraceLaunchRecord &record = *(const TraceLaunchRecord *)data;
+    const size_t charSize = record.wide ? sizeof(WCHAR) : sizeof(char);
+    if (sizeof(record) + ((size_t)record.appNameLength + record.argumentsLength) * charSize > size ||
+        record.appNameId > STRING_TABLE_SIZE || record.programId > STRING_TABLE_SIZE)
+        return false;
+
+    const BYTE *chars = data + sizeof(record);
+    char appName[UTF8_STRING_SIZE];
+    if (record.appNameId)
+        strcpy_s(appName, traceStrings[record.appNameId] ? traceStrings[record.appNameId] : "");
+    else
+        ConvertTraceString(chars, record.appNameLength, record.wide != 0, appName, sizeof(appName));
+
+    char commandLine[UTF8_STRING_SIZE * 2];
+    char arguments[UTF8_STRING_SIZE];
+    ConvertTraceString(chars + record.appNameLength * charSize, record.argumentsLength,
+        record.wide != 0, arguments, sizeof(arguments));
+    const char *program = (record.programId && traceStrings[record.programId]) ? traceStrings[record.programId] : "";
+    sprintf_s(commandLine, "%s%s", program, arguments);
+
+    const double microsecondsPerTick = chunk.ticksPerSecond ? 1000000.0 / chunk.ticksPerSecond : 0.0;
+    const double time = (double)(record.timestamp - chunk.startTimestamp) * microsecondsPerTick;
+    const double apiTime = (double)record.apiTicks * microsecondsPerTick;
+
+    if (writeJson)
+    {
+        printf("%s{\"time_us\":%.1f,\"thread\":%lu,\"api\":\"%s\",\"api_us\":%.1f,"
+            "\"result\":%lu,\"error\":%lu,\"pid\":%lu,\"flags\":%lu,\"application\":",
+            numLaunches ? ",\n" : "", time, record.threadId, HookIdName((int)record.hookId), apiTime,
+            record.result, record.error, record.processId, record.creationFlags);
+        WriteJsonString(appName);
+        printf(",\"command_line\":");
+        WriteJsonString(commandLine);
+        putchar('}');
+    }
+    else
+    {
+        printf("%.1f,%lu,%s,%.1f,%lu,%lu,%lu,0x%08lX,",
+            time, record.threadId, HookIdName((int)record.hookId), apiTime,
+            record.result, record.error, record.processId, record.creationFlags);
+        WriteCsvString(appName);
+        putchar(',');
+        WriteCsvString(commandLine);
+        putchar('\n');
+    }
+
+    numLaunches++;
+    return true;
+}
+
+//
+// Reads the records in one chunk.  Returns false if a record is
+// not valid.
+//
+static bool ReadChunkRecords(const BYTE *records, DWORD usedBytes, const TraceChunkHeader &chunk)
+{
+    DWORD offset = 0;
+    while (offset + sizeof(TraceRecordHeader) <= usedBytes)
+    {
+        const TraceRecordHeader &header = *(const TraceRecordHeader *)(records + offset);
+        if (header.size < sizeof(header) || header.size % TRACE_RECORD_ALIGN || header.size > usedBytes - offset)
+            return false;
+
+        bool valid = true;
+        if (header.type == TRACE_RECORD_STRING)
+            valid = ReadStringRecord(records + offset, header.size);
+        else if (header.type == TRACE_RECORD_LAUNCH)
+            valid = ReadLaunchRecord(records + offset, header.size, chunk);
+        if (!valid)
+            return false;
+
+        offset += header.size;
+    }
+
+    return true;
+}
+
+//
+// Converts the whole trace file.  Returns true if it was a
+// valid trace.
+//
+static bool ConvertTraceFile(const char *filename)
+{
+    FILE *file = nullptr;
+    if (fopen_s(&file, filename, "rb") != 0 || !file)
+    {
+        fprintf(stderr, "ERROR: Failed opening trace file \"%s\"!\n", filename);
+        return false;
+    }
+
+    BYTE *chunk = (BYTE *)malloc(TRACE_CHUNK_SIZE);
+    if (!chunk)
+    {
+        fprintf(stderr, "ERROR: Out of memory!\n");
+        fclose(file);
+        return false;
+    }
+
+    if (writeJson)
+        printf("[\n");
+    else
+        printf("time_us,thread,api,api_us,result,error,pid,flags,application,command_line\n");
+
+    DWORD numChunks = 0;
+    bool complete = true;
+    bool valid = true;
+    for (;;)
+    {
+        const size_t size = fread(chunk, 1, TRACE_CHUNK_SIZE, file);
+        const TraceChunkHeader &header = *(const TraceChunkHeader *)chunk;
+        if (size < sizeof(header) || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+            header.headerSize != sizeof(header) || header.chunkIndex != numChunks)
+        {
+            // A writer that died while extending the file can leave
+            // one unused chunk at the end.
+            if (!numChunks)
+            {
+                fprintf(stderr, "ERROR: \"%s\" is not a trace file!\n", filename);
+                valid = false;
+            }
+            break;
+        }
+
+        const DWORD available = (DWORD)(size - sizeof(header));
+        const DWORD usedBytes = header.usedBytes < available ? header.usedBytes : available;
+        complete = header.complete != 0;
+        if (!ReadChunkRecords(chunk + sizeof(header), usedBytes, header))
+        {
+            fprintf(stderr, "ERROR: Trace chunk %lu is damaged; stopping there!\n", numChunks);
+            valid = false;
+            break;
+        }
+
+        numChunks++;
+        if (size < TRACE_CHUNK_SIZE)
+            break;
+    }
+
+    if (writeJson)
+        printf("%s]\n", numLaunches ? "\n" : "");
+
+    fprintf(stderr, "Read %lld launch(es) from %lu chunk(s)%s.\n", numLaunches, numChunks,
+        complete ? "" : "; the trace was not closed, so it may be missing its last events");
+
+    free(chunk);
+    fclose(file);
+    return valid;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!_stricmp(argv[i], "-json"))
+            writeJson = true;
+        else if (!filename && argv[i][0] != '-')
+            filename = argv[i];
+        else
+        {
+            fprintf(stderr, "ERROR: Unknown option \"%s\"!\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (!filename)
+    {
+        fprintf(stderr, "Usage: traceread [-json] <tracefile>\n");
+        return -1;
+    }
+
+    const bool valid = ConvertTraceFile(filename);
+    for (int i = 0; i <= STRING_TABLE_SIZE; i++)
+        free(traceStrings[i]);
+
+    return valid ? 0 : -1;
+}
@@ -0,0 +1,158 @@
+//
+// trampolinepool.cpp
+//
+// Keeps Detours' trampoline regions from one hook transaction to
+// the next, and accounts for them.  See trampolinepool.h for a
+// description.
+//
+
+#include "trampolinepool.h"
+#include "detours.h"
+
+// One region that trampolines were seen in.
+struct TrampolineRegion
+{
+    PVOID  base;              // Allocation base of the region.
+    SIZE_T size;              // Bytes from the base to the end of
+                              // the allocation.
+    int    numTrampolines;    // Live trampolines in the region.
+    bool   allocated;         // False once Detours has freed it; the
+                              // entry is then free for reuse.
+};
+
+static TrampolineRegion regions[TRAMPOLINE_POOL_MAX_REGIONS] = {0};
+static int numRegionEntries = 0;
+
+static long long regionsAllocated = 0;
+static long long regionsFreed = 0;
+
+// True once Detours has been told to keep its regions.
+static bool poolStarted = false;
+
+//
+// Returns the size of the allocation starting at the given base.
+//
+static SIZE_T GetAllocationSize(PVOID base)
+{
+    SIZE_T size = 0;
+    MEMORY_BASIC_INFORMATION info;
+    while (VirtualQuery((BYTE *)base + size, &info, sizeof(info)) == sizeof(info) &&
+           info.State != MEM_FREE && info.AllocationBase == base)
+    {
+        size += info.RegionSize;
+    }
+    return size;
+}
+
+//
+// Checks whether Detours has freed a region since we last
+// looked, and records it if so.
+//
+static void RefreshRegion(TrampolineRegion &region)
+{
+    if (!region.allocated)
+        return;
+
+    MEMORY_BASIC_INFORMATION info;
+    if (VirtualQuery(region.base, &info, sizeof(info)) == sizeof(info) &&
+        info.State != MEM_FREE && info.AllocationBase == region.base)
+        return;
+
+    region.allocated = false;
+    region.numTrampolines = 0;
+    regionsFreed++;
+}
+
+//
+// Returns the entry for the region a trampoline is in, adding
+// one if the region is new, or null if it can't be tracked.
+//
+static TrampolineRegion *FindTrampolineRegion(PVOID trampoline)
+{
+    MEMORY_BASIC_INFORMATION info;
+    if (!trampoline || VirtualQuery(trampoline, &info, sizeof(info)) != sizeof(info) || info.State == MEM_FREE)
+        return nullptr;
+
+    TrampolineRegion *unused = nullptr;
+    for (int i = 0; i < numRegionEntries; i++)
+    {
+        TrampolineRegion &region = regions[i];
+        RefreshRegion(region);
+        if (region.allocated && region.base == info.AllocationBase)
+            return &region;
+        if (!region.allocated && !unused)
+            unused = &region;
+    }
+
+    if (!unused)
+    {
+        if (numRegionEntries >= TRAMPOLINE_POOL_MAX_REGIONS)
+            return nullptr;
+        unused = &regions[numRegionEntries++];
+    }
+
+    unused->base = info.AllocationBase;
+    unused->size = GetAllocationSize(info.AllocationBase);
+    unused->numTrampolines = 0;
+    unused->allocated = true;
+    regionsAllocated++;
+    return unused;
+}
+
+void StartTrampolinePool()
+{
+    if (poolStarted)
+        return;
+
+    DetourSetRetainRegions(TRUE);
+    poolStarted = true;
+}
+
+void NoteTrampolineAttached(PVOID trampoline)
+{
+    TrampolineRegion *region = FindTrampolineRegion(trampoline);
+    if (region)
+        region->numTrampolines++;
+}
+
+void NoteTrampolineDetached(PVOID trampoline)
+{
+    TrampolineRegion *region = FindTrampolineRegion(trampoline);
+    if (!region || region->numTrampolines <= 0)
+        return;
+
+    // If the pool is working, the region outlives its last
+    // trampoline.  Check now, since Detours could otherwise
+    // reallocate it at the same address before we look again.
+    if (--region->numTrampolines == 0)
+        RefreshRegion(*region);
+}
+
+bool GetTrampolinePoolStats(TrampolinePoolStats &stats)
+{
+    stats = TrampolinePoolStats();
+    if (!poolStarted)
+        return false;
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+
+    for (int i = 0; i < numRegionEntries; i++)
+    {
+        TrampolineRegion &region = regions[i];
+        RefreshRegion(region);
+        if (!region.allocated)
+            continue;
+
+        stats.numRegions++;
+        if (!region.numTrampolines)
+            stats.numEmptyRegions++;
+        stats.numTrampolines += region.numTrampolines;
+        stats.regionBytes += region.size;
+    }
+
+    stats.regionPages = stats.regionBytes / systemInfo.dwPageSize;
+    stats.regionsAllocated = regionsAllocated;
+    stats.regionsFreed = regionsFreed;
+    return true;
+}
@@ -0,0 +1,72 @@
+//
+// trampolinepool.h
+//
+// Keeps the memory Detours puts trampolines in from one hook
+// transaction to the next, and accounts for it.
+//
+// Detours allocates trampolines in regions of its own, each
+// within jump range of the code it patches, and by default
+// frees any region that is left empty when a transaction
+// commits.  So every remove/install cycle, every lazily
+// installed batch and every dispatch benchmark case would cost
+// a VirtualFree and a VirtualAlloc, and the address space near
+// each target module would churn.  The pool switches on
+// DetourSetRetainRegions before the first transaction, so
+// emptied regions stay allocated, and the trampolines of later
+// batches are carved out of them instead.
+//
+// Detours has no way to hand it memory for trampolines, so the
+// pool doesn't allocate regions itself.  It tracks the regions
+// it sees the trampolines land in (one entry per allocation, as
+// reported by VirtualQuery), which tells us how many pages they
+// take and how well they are used.
+//
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "hookdll.h"
+
+// Most trampoline regions tracked.  Each region holds hundreds
+// of trampolines, and there are only as many regions as there
+// are distinct 2 GB neighbourhoods of hooked code, so this is
+// plenty.
+#define TRAMPOLINE_POOL_MAX_REGIONS     64
+
+// Use of the trampoline regions.
+struct TrampolinePoolStats
+{
+    int       numRegions;          // Regions holding trampolines now, or
+                                   // kept empty for later ones.
+    int       numEmptyRegions;     // Of those, regions with no live
+                                   // trampolines in them.
+    int       numTrampolines;      // Trampolines of attached hooks.
+    long long regionBytes;         // Bytes of address space the regions
+                                   // take.
+    long long regionPages;         // Pages the regions take.
+    long long regionsAllocated;    // Regions Detours has allocated so far.
+                                   // Stops growing once the pool was
+                                   // seen to cover every target.
+    long long regionsFreed;        // Regions Detours has freed so far.
+                                   // Stays zero while regions are kept.
+};
+
+// Has Detours keep its trampoline regions from now on.  Called
+// before every hook transaction; only the first call does
+// anything.
+void StartTrampolinePool();
+
+// Counts a trampoline Detours allocated for a hook that was
+// just attached.  As with the rest of the pool, only called
+// from within hook transactions, which never overlap.
+void NoteTrampolineAttached(PVOID trampoline);
+
+// Counts a trampoline Detours released for a hook that was just
+// detached.
+void NoteTrampolineDetached(PVOID trampoline);
+
+// Gets the use of the trampoline regions.  Call it between hook
+// transactions.  Returns false if no hooks have been attached
+// yet.
+HOOKDLL_API bool GetTrampolinePoolStats(TrampolinePoolStats &stats);